@@ -0,0 +1,206 @@
+//
+//  bench.c
+//  qt-flatten
+//
+//  Copyright (c) 2012 Tom Butterworth. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  * Neither the name of qt-flatten nor the name of its contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+//  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "generator.h"
+#include "../qt_flatten.h"
+
+#define bench_source_name "bench-source.mov"
+#define bench_dest_name "bench-dest.mov"
+
+typedef struct bench_case {
+    const char *name;
+    unsigned int track_count;
+    uint32_t chunk_count;
+    uint32_t samples_per_chunk;
+    uint32_t sample_size;
+    bool co64;
+    bool compress_moov;
+    bool reserve; // reserve enough free space for the moov atom to be moved in place
+    uint32_t interleave_interval;
+    bool sparse;
+    bool allow_compressed_moov_atom; // passed to the flatten functions
+    bool large; // only run with -l
+} bench_case;
+
+static const bench_case bench_cases[] = {
+    // name             tracks  chunks  samples size    co64   cmov   reserve interleave sparse compress large
+    {"small",           2,      1000,   10,     1000,   false, false, true,   0,         false, false,   false},
+    {"co64",            2,      1000,   10,     1000,   true,  false, true,   0,         false, false,   false},
+    {"compressed-moov", 2,      1000,   10,     1000,   false, true,  true,   0,         false, false,   false},
+    {"compress-output", 2,      1000,   10,     1000,   false, false, false,  0,         false, true,    false},
+    {"interleaved-free",2,      10000,  1,      1000,   false, false, true,   100,       false, false,   false},
+    {"many-tracks",     16,     1000,   10,     100,    false, false, true,   0,         false, false,   false},
+    {"many-chunks",     2,      500000, 1,      100,    false, false, true,   0,         false, false,   false},
+    {"large-data",      2,      2000,   10,     50000,  false, false, true,   0,         false, false,   false},
+    {"sparse-100gb",    4,      100000, 25,     10000,  true,  false, true,   0,         true,  false,   true},
+};
+
+static double bench_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool bench_generate(const bench_case *c, const char *path)
+{
+    generator_params params;
+    generator_params_init(&params);
+    params.track_count = c->track_count;
+    params.chunk_count = c->chunk_count;
+    params.samples_per_chunk = c->samples_per_chunk;
+    params.sample_size = c->sample_size;
+    params.co64 = c->co64;
+    params.compress_moov = c->compress_moov;
+    // room for each track's sample tables, with plenty to spare
+    if (c->reserve) params.reserve = 4096 + (uint64_t)c->track_count * (1024 + (uint64_t)c->chunk_count * 8);
+    params.interleave_interval = c->interleave_interval;
+    params.sparse = c->sparse;
+    return generator_write(&params, path);
+}
+
+static void bench_report(const bench_case *c, const char *operation, uint64_t size, double best, unsigned int repeat)
+{
+    printf("%-18s %-8s %14llu %10.4f %10.1f  (best of %u)\n", c->name, operation, (unsigned long long)size, best,
+           best > 0 ? size / best / 1e6 : 0.0, repeat);
+}
+
+int main(int argc, const char * argv[])
+{
+    const char *directory = ".";
+    const char *filter = NULL;
+    unsigned int repeat = 3;
+    bool large = false;
+    
+    // Process arguments
+    int next_arg = 1;
+    while (next_arg < argc)
+    {
+        if (strcmp(argv[next_arg], "-d") == 0 && next_arg + 1 < argc)
+        {
+            directory = argv[next_arg + 1];
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-r") == 0 && next_arg + 1 < argc)
+        {
+            repeat = (unsigned int)strtoul(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-l") == 0)
+        {
+            large = true;
+            next_arg++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (next_arg < argc) filter = argv[next_arg++];
+    if (next_arg != argc || repeat == 0)
+    {
+        fprintf(stderr, "usage: %s [-d DIRECTORY] [-r REPEAT] [-l] [CASE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    size_t path_length = strlen(directory) + 32;
+    char *source = malloc(path_length);
+    char *dest = malloc(path_length);
+    if (source == NULL || dest == NULL) return EXIT_FAILURE;
+    snprintf(source, path_length, "%s/%s", directory, bench_source_name);
+    snprintf(dest, path_length, "%s/%s", directory, bench_dest_name);
+    
+    int return_value = EXIT_SUCCESS;
+    printf("%-18s %-8s %14s %10s %10s\n", "case", "flatten", "bytes", "seconds", "MB/s");
+    for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        const bench_case *c = &bench_cases[i];
+        if ((c->large && !large) || (filter && strstr(c->name, filter) == NULL)) continue;
+        
+        // flatten to a new file, reusing one source
+        struct stat status;
+        if (!bench_generate(c, source) || stat(source, &status) != 0)
+        {
+            fprintf(stderr, "Error: %s: The movie could not be generated (%s).\n", c->name, strerror(errno));
+            return_value = EXIT_FAILURE;
+            continue;
+        }
+        uint64_t size = status.st_size;
+        double best = 0;
+        for (unsigned int r = 0; r < repeat; r++) {
+            remove(dest);
+            double start = bench_now();
+            qtf_result result = qtf_flatten_movie(source, dest, c->allow_compressed_moov_atom);
+            double elapsed = bench_now() - start;
+            if (result != qtf_result_ok)
+            {
+                fprintf(stderr, "Error: %s: qtf_flatten_movie() failed (%d).\n", c->name, (int)result);
+                return_value = EXIT_FAILURE;
+                break;
+            }
+            if (r == 0 || elapsed < best) best = elapsed;
+        }
+        remove(dest);
+        bench_report(c, "copy", size, best, repeat);
+        
+        // flatten in place, on a new source each time
+        for (unsigned int r = 0; r < repeat; r++) {
+            if (r > 0 && !bench_generate(c, source))
+            {
+                fprintf(stderr, "Error: %s: The movie could not be generated (%s).\n", c->name, strerror(errno));
+                return_value = EXIT_FAILURE;
+                break;
+            }
+            double start = bench_now();
+            qtf_result result = qtf_flatten_movie_in_place(source, c->allow_compressed_moov_atom);
+            double elapsed = bench_now() - start;
+            if (result == qtf_result_file_no_free_space) break;
+            if (result != qtf_result_ok)
+            {
+                fprintf(stderr, "Error: %s: qtf_flatten_movie_in_place() failed (%d).\n", c->name, (int)result);
+                return_value = EXIT_FAILURE;
+                break;
+            }
+            if (r == 0 || elapsed < best) best = elapsed;
+            if (r == repeat - 1) bench_report(c, "in-place", size, best, repeat);
+        }
+        remove(source);
+    }
+    free(source);
+    free(dest);
+    return return_value;
+}
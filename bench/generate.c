@@ -0,0 +1,118 @@
+//
+//  generate.c
+//  qt-flatten
+//
+//  Copyright (c) 2012 Tom Butterworth. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  * Neither the name of qt-flatten nor the name of its contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+//  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "generator.h"
+
+int main(int argc, const char * argv[])
+{
+    generator_params params;
+    generator_params_init(&params);
+    
+    // Process arguments
+    int next_arg = 1;
+    while (next_arg < argc)
+    {
+        if (strcmp(argv[next_arg], "-t") == 0 && next_arg + 1 < argc)
+        {
+            params.track_count = (unsigned int)strtoul(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-n") == 0 && next_arg + 1 < argc)
+        {
+            params.chunk_count = (uint32_t)strtoul(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-s") == 0 && next_arg + 1 < argc)
+        {
+            params.samples_per_chunk = (uint32_t)strtoul(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-z") == 0 && next_arg + 1 < argc)
+        {
+            params.sample_size = (uint32_t)strtoul(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-6") == 0)
+        {
+            params.co64 = true;
+            next_arg++;
+        }
+        else if (strcmp(argv[next_arg], "-c") == 0)
+        {
+            params.compress_moov = true;
+            next_arg++;
+        }
+        else if (strcmp(argv[next_arg], "-r") == 0 && next_arg + 1 < argc)
+        {
+            params.reserve = strtoull(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-k") == 0 && next_arg + 1 < argc)
+        {
+            params.interleave_interval = (uint32_t)strtoul(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-K") == 0 && next_arg + 1 < argc)
+        {
+            params.interleave_size = (uint32_t)strtoul(argv[next_arg + 1], NULL, 10);
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-S") == 0)
+        {
+            params.sparse = true;
+            next_arg++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    
+    if (next_arg + 1 != argc)
+    {
+        fprintf(stderr, "usage: %s [-t TRACKS] [-n CHUNKS] [-s SAMPLES_PER_CHUNK] [-z SAMPLE_SIZE] [-6] [-c] [-r RESERVE] "
+                "[-k INTERVAL] [-K SIZE] [-S] OUTPUT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (!generator_write(&params, argv[next_arg]))
+    {
+        fprintf(stderr, "Error: The movie could not be written (%s).\n",
+                errno == EOVERFLOW ? "chunk offsets need a co64 atom, use -6" : strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,443 @@
+//
+//  generator.c
+//  qt-flatten
+//
+//  Copyright (c) 2012 Tom Butterworth. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  * Neither the name of qt-flatten nor the name of its contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+//  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#endif
+
+#include "generator.h"
+
+#define generator_time_scale 600
+#define generator_sample_duration 20
+
+/*
+ a growable buffer the moov atom is built in
+ */
+typedef struct generator_buffer {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} generator_buffer;
+
+static void buffer_append(generator_buffer *buffer, const void *data, size_t length)
+{
+    if (buffer->failed) return;
+    if (buffer->length + length > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + length) capacity *= 2;
+        uint8_t *grown = realloc(buffer->data, capacity);
+        if (grown == NULL)
+        {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    if (data) memcpy(buffer->data + buffer->length, data, length);
+    else memset(buffer->data + buffer->length, 0, length);
+    buffer->length += length;
+}
+
+static void buffer_put_16(generator_buffer *buffer, uint16_t value)
+{
+    uint8_t bytes[2] = {value >> 8, value};
+    buffer_append(buffer, bytes, 2);
+}
+
+static void buffer_put_32(generator_buffer *buffer, uint32_t value)
+{
+    uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+    buffer_append(buffer, bytes, 4);
+}
+
+static void buffer_put_64(generator_buffer *buffer, uint64_t value)
+{
+    buffer_put_32(buffer, (uint32_t)(value >> 32));
+    buffer_put_32(buffer, (uint32_t)value);
+}
+
+static void buffer_put_fourcc(generator_buffer *buffer, const char *type)
+{
+    buffer_append(buffer, type, 4);
+}
+
+/*
+ starts a box, returning its offset for box_end()
+ */
+static size_t box_begin(generator_buffer *buffer, const char *type)
+{
+    size_t start = buffer->length;
+    buffer_put_32(buffer, 0);
+    buffer_put_fourcc(buffer, type);
+    return start;
+}
+
+static void box_end(generator_buffer *buffer, size_t start)
+{
+    if (buffer->failed) return;
+    uint32_t size = (uint32_t)(buffer->length - start);
+    uint8_t *p = buffer->data + start;
+    p[0] = size >> 24;
+    p[1] = size >> 16;
+    p[2] = size >> 8;
+    p[3] = size;
+}
+
+static void buffer_put_matrix(generator_buffer *buffer)
+{
+    static const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+    for (int i = 0; i < 9; i++) {
+        buffer_put_32(buffer, matrix[i]);
+    }
+}
+
+static void generator_write_track(generator_buffer *buffer, const generator_params *params, uint32_t track_id, const uint64_t *offsets)
+{
+    uint32_t sample_count = params->chunk_count * params->samples_per_chunk;
+    uint32_t duration = sample_count * generator_sample_duration;
+    
+    size_t trak = box_begin(buffer, "trak");
+    size_t tkhd = box_begin(buffer, "tkhd");
+    buffer_put_32(buffer, 0x00000003); // enabled, in movie
+    buffer_put_32(buffer, 0); // creation time
+    buffer_put_32(buffer, 0); // modification time
+    buffer_put_32(buffer, track_id);
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, duration);
+    buffer_append(buffer, NULL, 8 + 2 + 2 + 2 + 2); // reserved, layer, alternate group, volume, reserved
+    buffer_put_matrix(buffer);
+    buffer_put_32(buffer, 320 << 16);
+    buffer_put_32(buffer, 240 << 16);
+    box_end(buffer, tkhd);
+    
+    size_t mdia = box_begin(buffer, "mdia");
+    size_t mdhd = box_begin(buffer, "mdhd");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, generator_time_scale);
+    buffer_put_32(buffer, duration);
+    buffer_put_16(buffer, 0x55c4); // undetermined language
+    buffer_put_16(buffer, 0);
+    box_end(buffer, mdhd);
+    size_t hdlr = box_begin(buffer, "hdlr");
+    buffer_put_32(buffer, 0);
+    buffer_put_fourcc(buffer, "mhlr");
+    buffer_put_fourcc(buffer, "vide");
+    buffer_append(buffer, NULL, 12 + 1); // reserved, empty name
+    box_end(buffer, hdlr);
+    
+    size_t minf = box_begin(buffer, "minf");
+    size_t vmhd = box_begin(buffer, "vmhd");
+    buffer_put_32(buffer, 0x00000001);
+    buffer_append(buffer, NULL, 2 + 6); // graphics mode, opcolor
+    box_end(buffer, vmhd);
+    size_t dinf = box_begin(buffer, "dinf");
+    size_t dref = box_begin(buffer, "dref");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 1);
+    size_t url = box_begin(buffer, "url ");
+    buffer_put_32(buffer, 0x00000001); // the data is in this file
+    box_end(buffer, url);
+    box_end(buffer, dref);
+    box_end(buffer, dinf);
+    
+    size_t stbl = box_begin(buffer, "stbl");
+    size_t stsd = box_begin(buffer, "stsd");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 1);
+    size_t entry = box_begin(buffer, "raw ");
+    buffer_append(buffer, NULL, 6);
+    buffer_put_16(buffer, 1); // data reference index
+    buffer_append(buffer, NULL, 2 + 2 + 4 + 4 + 4); // version, revision, vendor, temporal and spatial quality
+    buffer_put_16(buffer, 320);
+    buffer_put_16(buffer, 240);
+    buffer_put_32(buffer, 0x00480000); // 72 dpi
+    buffer_put_32(buffer, 0x00480000);
+    buffer_put_32(buffer, 0);
+    buffer_put_16(buffer, 1); // frames per sample
+    buffer_append(buffer, NULL, 32); // compressor name
+    buffer_put_16(buffer, 24); // depth
+    buffer_put_16(buffer, 0xFFFF); // no color table
+    box_end(buffer, entry);
+    box_end(buffer, stsd);
+    size_t stts = box_begin(buffer, "stts");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 1);
+    buffer_put_32(buffer, sample_count);
+    buffer_put_32(buffer, generator_sample_duration);
+    box_end(buffer, stts);
+    size_t stsc = box_begin(buffer, "stsc");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 1);
+    buffer_put_32(buffer, 1);
+    buffer_put_32(buffer, params->samples_per_chunk);
+    buffer_put_32(buffer, 1);
+    box_end(buffer, stsc);
+    size_t stsz = box_begin(buffer, "stsz");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, params->sample_size);
+    buffer_put_32(buffer, sample_count);
+    box_end(buffer, stsz);
+    size_t stco = box_begin(buffer, params->co64 ? "co64" : "stco");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, params->chunk_count);
+    for (uint32_t i = 0; i < params->chunk_count; i++) {
+        if (params->co64) buffer_put_64(buffer, offsets[i]);
+        else buffer_put_32(buffer, (uint32_t)offsets[i]);
+    }
+    box_end(buffer, stco);
+    box_end(buffer, stbl);
+    box_end(buffer, minf);
+    box_end(buffer, mdia);
+    box_end(buffer, trak);
+}
+
+/*
+ builds the moov atom in buffer, offsets holding each track's chunk offsets in turn
+ */
+static void generator_write_moov(generator_buffer *buffer, const generator_params *params, const uint64_t *offsets)
+{
+    uint32_t duration = params->chunk_count * params->samples_per_chunk * generator_sample_duration;
+    
+    size_t moov = box_begin(buffer, "moov");
+    size_t mvhd = box_begin(buffer, "mvhd");
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, 0);
+    buffer_put_32(buffer, generator_time_scale);
+    buffer_put_32(buffer, duration);
+    buffer_put_32(buffer, 0x00010000); // rate
+    buffer_put_16(buffer, 0x0100); // volume
+    buffer_append(buffer, NULL, 10);
+    buffer_put_matrix(buffer);
+    buffer_append(buffer, NULL, 24);
+    buffer_put_32(buffer, params->track_count + 1); // next track ID
+    box_end(buffer, mvhd);
+    for (unsigned int t = 0; t < params->track_count; t++) {
+        generator_write_track(buffer, params, t + 1, offsets + (size_t)t * params->chunk_count);
+    }
+    box_end(buffer, moov);
+}
+
+/*
+ replaces the moov atom in buffer with one holding it compressed
+ */
+static bool generator_compress_moov(generator_buffer *buffer)
+{
+    uLongf compressed_length = compressBound((uLong)buffer->length);
+    generator_buffer compressed = {0};
+    
+    buffer_append(&compressed, NULL, 40 + compressed_length);
+    if (compressed.failed) return false;
+    if (compress2(compressed.data + 40, &compressed_length, buffer->data, (uLong)buffer->length, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        free(compressed.data);
+        return false;
+    }
+    uint32_t uncompressed_length = (uint32_t)buffer->length;
+    compressed.length = 0;
+    size_t moov = box_begin(&compressed, "moov");
+    size_t cmov = box_begin(&compressed, "cmov");
+    size_t dcom = box_begin(&compressed, "dcom");
+    buffer_put_fourcc(&compressed, "zlib");
+    box_end(&compressed, dcom);
+    size_t cmvd = box_begin(&compressed, "cmvd");
+    buffer_put_32(&compressed, uncompressed_length);
+    compressed.length += compressed_length; // the data is already in place
+    box_end(&compressed, cmvd);
+    box_end(&compressed, cmov);
+    box_end(&compressed, moov);
+    free(buffer->data);
+    *buffer = compressed;
+    return true;
+}
+
+static bool generator_write_all(int fd, const void *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0) return false;
+        data = (const uint8_t *)data + written;
+        length -= written;
+    }
+    return true;
+}
+
+/*
+ writes the header of an atom of size bytes, which has a 64-bit size if size doesn't fit in 32 bits
+ */
+static bool generator_write_header(int fd, const char *type, uint64_t size)
+{
+    generator_buffer header = {0};
+    if (size > UINT32_MAX)
+    {
+        buffer_put_32(&header, 1);
+        buffer_put_fourcc(&header, type);
+        buffer_put_64(&header, size);
+    }
+    else
+    {
+        buffer_put_32(&header, (uint32_t)size);
+        buffer_put_fourcc(&header, type);
+    }
+    bool success = !header.failed && generator_write_all(fd, header.data, header.length);
+    free(header.data);
+    return success;
+}
+
+/*
+ writes length bytes of an atom's contents, or leaves a hole if data is NULL
+ */
+static bool generator_write_contents(int fd, const void *data, uint64_t length)
+{
+    if (data == NULL) return lseek(fd, (off_t)length, SEEK_CUR) != -1;
+    return generator_write_all(fd, data, (size_t)length);
+}
+
+void generator_params_init(generator_params *params)
+{
+    params->track_count = 2;
+    params->chunk_count = 1000;
+    params->samples_per_chunk = 10;
+    params->sample_size = 1000;
+    params->co64 = false;
+    params->compress_moov = false;
+    params->reserve = 0;
+    params->interleave_interval = 0;
+    params->interleave_size = 64;
+    params->sparse = false;
+}
+
+bool generator_write(const generator_params *params, const char *path)
+{
+    static const uint8_t ftyp[20] = {0, 0, 0, 20, 'f', 't', 'y', 'p', 'q', 't', ' ', ' ', 0, 0, 2, 0, 'q', 't', ' ', ' '};
+    uint64_t chunk_length = (uint64_t)params->samples_per_chunk * params->sample_size;
+    uint64_t total_chunks = (uint64_t)params->chunk_count * params->track_count;
+    bool success = true;
+    
+    if (params->track_count == 0 || params->chunk_count == 0 || chunk_length == 0 || chunk_length > SIZE_MAX
+        || (uint64_t)params->chunk_count * params->samples_per_chunk > UINT32_MAX / generator_sample_duration
+        || (params->reserve > 0 && params->reserve < 8) || (params->interleave_interval > 0 && params->interleave_size < 8))
+    {
+        errno = EINVAL;
+        return false;
+    }
+    
+    uint64_t *offsets = malloc(sizeof(uint64_t) * total_chunks);
+    // a chunk of each track, filled with a pattern distinct to the track
+    uint8_t *chunk = params->sparse ? NULL : malloc((size_t)chunk_length * params->track_count);
+    if (offsets == NULL || (!params->sparse && chunk == NULL))
+    {
+        free(offsets);
+        free(chunk);
+        errno = ENOMEM;
+        return false;
+    }
+    for (uint64_t i = 0; chunk != NULL && i < chunk_length * params->track_count; i++) {
+        chunk[i] = (uint8_t)((i / chunk_length) * 37 + i * 13);
+    }
+    
+#if defined(_WIN32)
+    int fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#endif
+    if (fd == -1) success = false;
+    
+    uint64_t offset = sizeof(ftyp);
+    if (success) success = generator_write_all(fd, ftyp, sizeof(ftyp));
+    if (success && params->reserve > 0)
+    {
+        uint64_t header_length = params->reserve > UINT32_MAX ? 16 : 8;
+        success = generator_write_header(fd, "free", params->reserve) && generator_write_contents(fd, NULL, params->reserve - header_length);
+        offset += params->reserve;
+    }
+    
+    // the tracks' chunks alternate, in mdat atoms of interleave_interval chunks
+    uint64_t segment_chunks = params->interleave_interval ? params->interleave_interval : total_chunks;
+    for (uint64_t g = 0; success && g < total_chunks; g++) {
+        if (g % segment_chunks == 0)
+        {
+            if (g > 0)
+            {
+                const char *type = (g / segment_chunks) % 2 ? "free" : "skip";
+                success = generator_write_header(fd, type, params->interleave_size)
+                    && generator_write_contents(fd, NULL, params->interleave_size - 8);
+                offset += params->interleave_size;
+            }
+            uint64_t data_length = (total_chunks - g < segment_chunks ? total_chunks - g : segment_chunks) * chunk_length;
+            uint64_t header_length = data_length + 8 > UINT32_MAX ? 16 : 8;
+            if (success) success = generator_write_header(fd, "mdat", header_length + data_length);
+            offset += header_length;
+        }
+        unsigned int track = (unsigned int)(g % params->track_count);
+        uint64_t index = g / params->track_count;
+        if (!params->co64 && offset > UINT32_MAX)
+        {
+            errno = EOVERFLOW;
+            success = false;
+        }
+        offsets[(size_t)track * params->chunk_count + index] = offset;
+        if (success) success = generator_write_contents(fd, chunk ? chunk + (size_t)track * chunk_length : NULL, chunk_length);
+        offset += chunk_length;
+    }
+    
+    if (success)
+    {
+        generator_buffer moov = {0};
+        generator_write_moov(&moov, params, offsets);
+        if (!moov.failed && params->compress_moov && !generator_compress_moov(&moov)) moov.failed = true;
+        if (moov.failed)
+        {
+            errno = ENOMEM;
+            success = false;
+        }
+        if (success) success = generator_write_all(fd, moov.data, moov.length);
+        free(moov.data);
+    }
+    
+    if (fd != -1 && close(fd) != 0) success = false;
+    free(offsets);
+    free(chunk);
+    return success;
+}
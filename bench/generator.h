@@ -0,0 +1,72 @@
+//
+//  generator.h
+//  qt-flatten
+//
+//  Copyright (c) 2012 Tom Butterworth. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  * Neither the name of qt-flatten nor the name of its contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+//  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef generator_h
+#define generator_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ Describes a synthetic movie for generator_write(). Initialise with generator_params_init() before setting any fields.
+ */
+typedef struct generator_params {
+    unsigned int track_count; // default 2
+    uint32_t chunk_count; // chunks in each track, default 1000
+    uint32_t samples_per_chunk; // default 10
+    uint32_t sample_size; // bytes, default 1000
+    bool co64; // use co64 rather than stco chunk offset tables, default false
+    bool compress_moov; // write a compressed moov atom, default false
+    uint64_t reserve; // the size of a free atom between the ftyp and mdat atoms, or 0 (the default) for none
+    uint32_t interleave_interval; // split the movie data with a free or skip atom every this many chunks, or 0 (the default)
+    uint32_t interleave_size; // the size of each such atom, default 64
+    bool sparse; // leave the movie data as a hole rather than writing it, default false
+} generator_params;
+
+/**
+ Sets every field of params to its default.
+ */
+void generator_params_init(generator_params *params);
+
+/**
+ Writes a movie to path, laid out as
+ 
+    [ftyp][free (optional)][mdat]([free or skip][mdat])...[moov]
+ 
+ Each track's samples are video samples of sample_size bytes filled with a pattern, and the tracks' chunks alternate
+ through the movie data.
+ 
+ Returns true on success, or false with errno set if the file couldn't be written, or to EOVERFLOW if a chunk offset
+ wouldn't fit in a stco atom.
+ */
+bool generator_write(const generator_params *params, const char *path);
+
+#endif
@@ -0,0 +1,313 @@
+//
+//  micro.c
+//  qt-flatten
+//
+//  Copyright (c) 2012 Tom Butterworth. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//
+//  * Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  * Neither the name of qt-flatten nor the name of its contributors
+//  may be used to endorse or promote products derived from this software
+//  without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+//  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+//  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+//  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// The kernels measured here are private to the library, so it is compiled into this file
+#include "../qt_flatten.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "generator.h"
+
+#define micro_source_name "micro-source.mov"
+#define micro_table_entries (1000000)
+
+// results are stored here so the compiler can't drop the work which produced them
+static volatile off_t micro_sink;
+
+typedef struct micro_state {
+    double min_time; // each benchmark repeats for at least this many seconds
+    bool first; // no result has been printed yet
+} micro_state;
+
+static double micro_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ prints a result as a JSON object, operation_bytes being the bytes each iteration processes, or 0
+ */
+static void micro_report(micro_state *state, const char *name, const char *parameter, uint64_t iterations, double seconds,
+                         uint64_t operation_bytes)
+{
+    printf("%s\n    {\"name\": \"%s\", \"parameter\": \"%s\", \"iterations\": %llu, \"seconds\": %.6f, \"ns_per_op\": %.3f, "
+           "\"bytes_per_op\": %llu, \"ns_per_byte\": %.6f}", state->first ? "" : ",", name, parameter,
+           (unsigned long long)iterations, seconds, seconds * 1e9 / iterations, (unsigned long long)operation_bytes,
+           operation_bytes ? seconds * 1e9 / iterations / operation_bytes : 0.0);
+    state->first = false;
+    fflush(stdout);
+}
+
+/*
+ reads the header of every top-level atom in the file at path, as the flatten functions do
+ */
+static uint64_t micro_scan_atoms(int fd)
+{
+    uint8_t header[16];
+    uint64_t count = 0;
+    off_t offset = 0;
+    for (;;) {
+        qtf_atom_size size = 0;
+        uint32_t type = 0;
+        size_t bytes_read = 0;
+        if (lseek(fd, offset, SEEK_SET) == -1) break;
+        if (qtf_read_atom_header(fd, header, sizeof(header), &type, &size, &bytes_read) != qtf_result_ok || bytes_read == 0) break;
+        if (size < bytes_read) break;
+        offset += size;
+        count++;
+    }
+    return count;
+}
+
+static void micro_atom_header_scan(micro_state *state, const char *path)
+{
+    generator_params params;
+    generator_params_init(&params);
+    // a free or skip atom between every chunk gives a long list of top-level atoms
+    params.track_count = 1;
+    params.chunk_count = 50000;
+    params.samples_per_chunk = 1;
+    params.sample_size = 100;
+    params.interleave_interval = 1;
+    params.interleave_size = 8;
+    params.sparse = true;
+    if (!generator_write(&params, path)) return;
+    
+    int fd = qtf_open_for_reading(path);
+    if (fd == -1) return;
+    uint64_t atom_count = micro_scan_atoms(fd);
+    uint64_t iterations = 0;
+    double start = micro_now();
+    double elapsed = 0;
+    do {
+        micro_scan_atoms(fd);
+        iterations++;
+        elapsed = micro_now() - start;
+    } while (elapsed < state->min_time);
+    close(fd);
+    remove(path);
+    
+    char parameter[32];
+    snprintf(parameter, sizeof(parameter), "%llu atoms", (unsigned long long)atom_count);
+    micro_report(state, "qtf_read_atom_header", parameter, iterations * atom_count, elapsed, 0);
+}
+
+static void micro_edit_list(micro_state *state)
+{
+    static const size_t edit_counts[] = {1, 16, 256, 4096};
+    for (size_t i = 0; i < sizeof(edit_counts) / sizeof(edit_counts[0]); i++) {
+        qtf_edit_list_s list;
+        qtf_edit_list_init(&list);
+        qtf_result result = qtf_result_ok;
+        for (size_t j = 0; j < edit_counts[i] && result == qtf_result_ok; j++) {
+            result = qtf_edit_list_add_edit(&list, (off_t)j * 100000, j % 2 ? 8 : -8);
+        }
+        if (result != qtf_result_ok)
+        {
+            free(list.edits);
+            return;
+        }
+        
+        uint64_t iterations = 0;
+        off_t total = 0;
+        double start = micro_now();
+        double elapsed = 0;
+        do {
+            // offsets spread over the edits
+            for (int j = 0; j < 1000; j++) {
+                total += qtf_edit_list_get_offset_change(&list, (off_t)(iterations + j) * 7919 % ((off_t)edit_counts[i] * 100000));
+            }
+            iterations += 1000;
+            elapsed = micro_now() - start;
+        } while (elapsed < state->min_time);
+        free(list.edits);
+        micro_sink = total;
+        
+        char parameter[32];
+        snprintf(parameter, sizeof(parameter), "%zu edits", edit_counts[i]);
+        micro_report(state, "qtf_edit_list_get_offset_change", parameter, iterations, elapsed, 0);
+    }
+}
+
+/*
+ generates a movie with one table of micro_table_entries chunk offsets and loads its moov atom into a new buffer
+ */
+static void *micro_load_moov(const char *path, bool co64, qtf_atom_size *out_size)
+{
+    generator_params params;
+    generator_params_init(&params);
+    params.track_count = 1;
+    params.chunk_count = micro_table_entries;
+    params.samples_per_chunk = 1;
+    params.sample_size = 100;
+    params.co64 = co64;
+    params.sparse = true;
+    if (!generator_write(&params, path)) return NULL;
+    
+    void *moov = NULL;
+    qtf_context *context = qtf_context_create();
+    int fd = qtf_open_for_reading(path);
+    void *ftyp = NULL;
+    qtf_atom_size ftyp_size = 0;
+    void *loaded = NULL;
+    if (context != NULL && fd != -1 && qtf_scan_movie(context, fd, NULL, NULL, 0, &ftyp, &ftyp_size, &loaded, out_size, NULL) == qtf_result_ok)
+    {
+        moov = malloc((size_t)*out_size);
+        if (moov != NULL) memcpy(moov, loaded, (size_t)*out_size);
+    }
+    if (fd != -1) close(fd);
+    qtf_context_destroy(context);
+    remove(path);
+    return moov;
+}
+
+static void micro_offsets_apply_list(micro_state *state, void *moov, qtf_atom_size moov_size, const char *table)
+{
+    qtf_box_tree_s tree;
+    qtf_box_tree_init(&tree);
+    if (qtf_box_tree_parse(&tree, moov, moov_size) != qtf_result_ok)
+    {
+        qtf_box_tree_destroy(&tree);
+        return;
+    }
+    // the edits of a typical flatten: removed free space and the moov atom moved to the front
+    qtf_edit_s edits[3] = {{20, -4096}, {20, (off_t)moov_size}, {(off_t)moov_size, -(off_t)moov_size}};
+    qtf_edit_list_s list = {edits, 3, 3};
+    
+    uint64_t iterations = 0;
+    double start = micro_now();
+    double elapsed = 0;
+    do {
+        qtf_offsets_apply_list(&tree, &list);
+        iterations++;
+        elapsed = micro_now() - start;
+    } while (elapsed < state->min_time);
+    qtf_box_tree_destroy(&tree);
+    
+    char parameter[32];
+    snprintf(parameter, sizeof(parameter), "%d %s entries", micro_table_entries, table);
+    micro_report(state, "qtf_offsets_apply_list", parameter, iterations, elapsed, moov_size);
+}
+
+static void micro_compression(micro_state *state, void *moov, qtf_atom_size moov_size)
+{
+    static const char *levels[] = {"fast", "default", "best"};
+    qtf_zlib_s zlib;
+    memset(&zlib, 0, sizeof(qtf_zlib_s));
+    uint8_t *compressed = malloc((size_t)moov_size);
+    uint8_t *decompressed = malloc((size_t)moov_size);
+    
+    for (int level = 0; level < 3 && compressed != NULL && decompressed != NULL; level++) {
+        size_t compressed_size = 0;
+        uint64_t iterations = 0;
+        double start = micro_now();
+        double elapsed = 0;
+        do {
+            compressed_size = qtf_compress_movie_atom(&zlib, moov, (size_t)moov_size, compressed, (size_t)moov_size,
+                                                      level == 0, level == 1, level == 2);
+            iterations++;
+            elapsed = micro_now() - start;
+        } while (elapsed < state->min_time);
+        if (compressed_size == 0) break;
+        
+        char parameter[48];
+        snprintf(parameter, sizeof(parameter), "%s, %llu to %zu bytes", levels[level], (unsigned long long)moov_size, compressed_size);
+        micro_report(state, "qtf_compress_movie_atom", parameter, iterations, elapsed, moov_size);
+        
+        // the data follows the 40 bytes of moov, cmov, dcom and cmvd headers
+        iterations = 0;
+        start = micro_now();
+        do {
+            qtf_decompress_data(&zlib, compressed + 40, compressed_size - 40, decompressed, (size_t)moov_size);
+            iterations++;
+            elapsed = micro_now() - start;
+        } while (elapsed < state->min_time);
+        snprintf(parameter, sizeof(parameter), "%s", levels[level]);
+        micro_report(state, "qtf_decompress_data", parameter, iterations, elapsed, moov_size);
+    }
+    qtf_zlib_destroy(&zlib);
+    free(compressed);
+    free(decompressed);
+}
+
+int main(int argc, const char * argv[])
+{
+    const char *directory = ".";
+    micro_state state = {0.5, true};
+    
+    // Process arguments
+    int next_arg = 1;
+    while (next_arg < argc)
+    {
+        if (strcmp(argv[next_arg], "-d") == 0 && next_arg + 1 < argc)
+        {
+            directory = argv[next_arg + 1];
+            next_arg += 2;
+        }
+        else if (strcmp(argv[next_arg], "-t") == 0 && next_arg + 1 < argc)
+        {
+            state.min_time = strtod(argv[next_arg + 1], NULL);
+            next_arg += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (next_arg != argc)
+    {
+        fprintf(stderr, "usage: %s [-d DIRECTORY] [-t SECONDS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    size_t path_length = strlen(directory) + 32;
+    char *path = malloc(path_length);
+    if (path == NULL) return EXIT_FAILURE;
+    snprintf(path, path_length, "%s/%s", directory, micro_source_name);
+    
+    printf("{\"benchmarks\": [");
+    micro_atom_header_scan(&state, path);
+    micro_edit_list(&state);
+    for (int co64 = 0; co64 < 2; co64++) {
+        qtf_atom_size moov_size = 0;
+        void *moov = micro_load_moov(path, co64, &moov_size);
+        if (moov == NULL) continue;
+        micro_offsets_apply_list(&state, moov, moov_size, co64 ? "co64" : "stco");
+        if (!co64) micro_compression(&state, moov, moov_size);
+        free(moov);
+    }
+    printf("\n]}\n");
+    free(path);
+    return state.first ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -43,30 +43,704 @@
 #include <Windows.h>
 #endif
 
+#if defined(__linux__)
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#endif
+
 #include "qt_flatten.h"
 
 #define temp_file_suffix ".temp"
+#define verify_thread_count 4
+#define watch_max_directories 16
+
+static const char *strategy_names[] = {"already flat", "in place", "in place, compressed", "rewrite", "unsupported"};
+
+static void print_fourcc(uint32_t type)
+{
+    for (int i = 3; i >= 0; i--) {
+        char c = (type >> (i * 8)) & 0xFF;
+        putchar(c >= 0x20 && c < 0x7F ? c : '?');
+    }
+}
+
+/*
+ parses a comma-separated list of the atom types to relocate into qtf_relocate flags, returning false if it is invalid
+ */
+static bool parse_relocate_atoms(const char *list, unsigned int *out_flags)
+{
+    static const struct { const char *name; unsigned int flag; } types[] = {
+        { "udta", qtf_relocate_udta },
+        { "meta", qtf_relocate_meta },
+        { "uuid", qtf_relocate_uuid },
+    };
+    unsigned int flags = 0;
+    while (*list != '\0') {
+        size_t length = strcspn(list, ",");
+        bool found = false;
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if (length == strlen(types[i].name) && strncmp(list, types[i].name, length) == 0)
+            {
+                flags |= types[i].flag;
+                found = true;
+            }
+        }
+        if (!found) return false;
+        list += length;
+        if (*list == ',') list++;
+    }
+    *out_flags = flags;
+    return flags != 0;
+}
+
+static const char *result_description(qtf_result result)
+{
+    switch (result) {
+        case qtf_result_file_not_movie:
+            return "The file was not recognised as a valid movie";
+        case qtf_result_file_read_error:
+            return "The file could not be read";
+        case qtf_result_file_too_complex:
+            return "This type of movie file is not supported";
+        case qtf_result_file_write_error:
+            return "The file could not be written";
+        case qtf_result_memory_error:
+            return "Not enough memory was available";
+        case qtf_result_file_mismatch:
+            return "The flattened file didn't match the original";
+        default:
+            return "An unexpected error occurred";
+    }
+}
+
+typedef struct file_identity {
+    unsigned long long device;
+    unsigned long long inode;
+    unsigned long long size;
+    long long modified_seconds;
+    long modified_nanoseconds;
+} file_identity;
+
+/*
+ a file with the same identity is assumed to be unchanged
+ */
+static bool file_identity_get(const char *path, file_identity *out_identity)
+{
+    struct stat status;
+    if (stat(path, &status) != 0 || (status.st_mode & S_IFMT) != S_IFREG) return false;
+    out_identity->device = status.st_dev;
+    out_identity->inode = status.st_ino;
+    out_identity->size = status.st_size;
+#if defined(__APPLE__)
+    out_identity->modified_seconds = status.st_mtimespec.tv_sec;
+    out_identity->modified_nanoseconds = status.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    out_identity->modified_seconds = status.st_mtime;
+    out_identity->modified_nanoseconds = 0;
+#else
+    out_identity->modified_seconds = status.st_mtim.tv_sec;
+    out_identity->modified_nanoseconds = status.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+static bool file_identity_equal(const file_identity *a, const file_identity *b)
+{
+    return a->device == b->device && a->inode == b->inode && a->size == b->size
+        && a->modified_seconds == b->modified_seconds && a->modified_nanoseconds == b->modified_nanoseconds;
+}
+
+/*
+ flattens the file at path in-place if possible, otherwise through a temporary file which replaces it. On success
+ *out_strategy is set to how the file was flattened: qtf_strategy_already_flat, qtf_strategy_in_place (whether or not the
+ moov atom was compressed) or qtf_strategy_rewrite
+ */
+static qtf_result flatten_replacing(qtf_context *context, const char *path, const qtf_options *options, qtf_strategy *out_strategy)
+{
+    // an in-place flatten only moves the moov atom, and doesn't write a seek index
+    qtf_result result = options->relocate_atoms == 0 && options->index_path == NULL ? qtf_flatten_movie_in_place_ex(context, path, options)
+                                                                                    : qtf_result_file_no_free_space;
+    *out_strategy = qtf_strategy_in_place;
+    if (result != qtf_result_ok && result != qtf_result_file_not_movie && result != qtf_result_already_flat)
+    {
+        size_t temp_file_path_buffer_length = strlen(path) + strlen(temp_file_suffix) + 1;
+        char *temp_file_path = malloc(temp_file_path_buffer_length);
+        if (temp_file_path == NULL) return qtf_result_memory_error;
+        snprintf(temp_file_path, temp_file_path_buffer_length, "%s%s", path, temp_file_suffix);
+        result = qtf_flatten_movie_ex(context, path, temp_file_path, options);
+        *out_strategy = qtf_strategy_rewrite;
+        // the copy of an already flat file is identical (or even the same file, if linked), so is dropped
+        if (result == qtf_result_already_flat) remove(temp_file_path);
+#if defined(_WIN32)
+        // On Windows, rename() fails if the file already exists
+        if (result == qtf_result_ok) remove(path);
+#endif
+        if (result == qtf_result_ok && rename(temp_file_path, path) != 0) result = qtf_result_file_write_error;
+        if (result != qtf_result_ok) remove(temp_file_path);
+        free(temp_file_path);
+    }
+    // an already flat file is left as it is
+    if (result == qtf_result_already_flat) *out_strategy = qtf_strategy_already_flat;
+    return result == qtf_result_already_flat ? qtf_result_ok : result;
+}
+
+/*
+ Result cache
+
+ The outcome of each file processed is appended to the cache file as a line of its identity, result and the layout the
+ file was left in (a qtf_strategy, only meaningful if the result is qtf_result_ok). Loading the file replays the lines into
+ a hash table, so later lines replace earlier ones, and the file is rewritten if most of its lines have been replaced.
+ Lines without a layout, from older cache files, are ignored. Files whose outcome would be the same if they were processed
+ again are then skipped.
+ */
+
+typedef struct cache_entry {
+    file_identity identity;
+    qtf_result result;
+    qtf_strategy strategy;
+    bool used;
+} cache_entry;
+
+typedef struct result_cache {
+    cache_entry *entries;
+    size_t capacity; // a power of two
+    size_t count;
+    size_t line_count;
+    FILE *file; // open for appending
+} result_cache;
+
+static size_t cache_hash(const file_identity *identity)
+{
+    // FNV-1a over the fields
+    unsigned long long values[5] = {identity->device, identity->inode, identity->size,
+        (unsigned long long)identity->modified_seconds, (unsigned long long)identity->modified_nanoseconds};
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 8; j++) {
+            hash ^= (values[i] >> (j * 8)) & 0xFF;
+            hash *= 1099511628211ULL;
+        }
+    }
+    return (size_t)hash;
+}
+
+static cache_entry *cache_find(result_cache *cache, const file_identity *identity)
+{
+    if (cache->capacity == 0) return NULL;
+    size_t index = cache_hash(identity) & (cache->capacity - 1);
+    while (cache->entries[index].used && !file_identity_equal(&cache->entries[index].identity, identity)) {
+        index = (index + 1) & (cache->capacity - 1);
+    }
+    return &cache->entries[index];
+}
+
+static bool cache_insert(result_cache *cache, const file_identity *identity, qtf_result result, qtf_strategy strategy)
+{
+    // keep the table at most half full
+    if ((cache->count + 1) * 2 > cache->capacity)
+    {
+        result_cache grown = *cache;
+        grown.capacity = cache->capacity ? cache->capacity * 2 : 1024;
+        grown.entries = calloc(grown.capacity, sizeof(cache_entry));
+        if (grown.entries == NULL) return false;
+        for (size_t i = 0; i < cache->capacity; i++) {
+            if (cache->entries[i].used) *cache_find(&grown, &cache->entries[i].identity) = cache->entries[i];
+        }
+        free(cache->entries);
+        *cache = grown;
+    }
+    cache_entry *entry = cache_find(cache, identity);
+    if (!entry->used) cache->count++;
+    entry->identity = *identity;
+    entry->result = result;
+    entry->strategy = strategy;
+    entry->used = true;
+    return true;
+}
+
+static void cache_write_entry(FILE *file, const cache_entry *entry)
+{
+    fprintf(file, "%llu %llu %llu %lld %ld %d %d\n", entry->identity.device, entry->identity.inode, entry->identity.size,
+            entry->identity.modified_seconds, entry->identity.modified_nanoseconds, (int)entry->result, (int)entry->strategy);
+}
+
+/*
+ rewrites the cache file with one line for each entry
+ */
+static bool cache_compact(result_cache *cache, const char *path)
+{
+    size_t temp_file_path_buffer_length = strlen(path) + strlen(temp_file_suffix) + 1;
+    char *temp_file_path = malloc(temp_file_path_buffer_length);
+    if (temp_file_path == NULL) return false;
+    snprintf(temp_file_path, temp_file_path_buffer_length, "%s%s", path, temp_file_suffix);
+    FILE *file = fopen(temp_file_path, "w");
+    bool success = file != NULL;
+    for (size_t i = 0; i < cache->capacity && success; i++) {
+        if (cache->entries[i].used) cache_write_entry(file, &cache->entries[i]);
+    }
+    if (file != NULL && fclose(file) != 0) success = false;
+#if defined(_WIN32)
+    if (success) remove(path);
+#endif
+    if (success && rename(temp_file_path, path) != 0) success = false;
+    if (!success) remove(temp_file_path);
+    free(temp_file_path);
+    if (success) cache->line_count = cache->count;
+    return success;
+}
+
+static bool cache_open(result_cache *cache, const char *path)
+{
+    memset(cache, 0, sizeof(result_cache));
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
+    {
+        file_identity identity;
+        int result;
+        int strategy;
+        char line[256];
+        while (fgets(line, sizeof(line), file) != NULL) {
+            cache->line_count++;
+            if (sscanf(line, "%llu %llu %llu %lld %ld %d %d", &identity.device, &identity.inode, &identity.size,
+                       &identity.modified_seconds, &identity.modified_nanoseconds, &result, &strategy) != 7) continue;
+            if (!cache_insert(cache, &identity, (qtf_result)result, (qtf_strategy)strategy)) break;
+        }
+        fclose(file);
+    }
+    if (cache->line_count > 1024 && cache->line_count > cache->count * 2) cache_compact(cache, path);
+    cache->file = fopen(path, "a");
+    return cache->file != NULL;
+}
+
+static void cache_close(result_cache *cache)
+{
+    if (cache->file != NULL) fclose(cache->file);
+    free(cache->entries);
+}
+
+/*
+ returns true if the file with identity was processed before with a result which wouldn't change, setting *out_result
+ */
+static bool cache_lookup(result_cache *cache, const file_identity *identity, qtf_result *out_result)
+{
+    cache_entry *entry = cache_find(cache, identity);
+    if (entry == NULL || !entry->used) return false;
+    switch (entry->result) {
+        case qtf_result_ok:
+        case qtf_result_file_not_movie:
+        case qtf_result_file_too_complex:
+            *out_result = entry->result;
+            return true;
+        default:
+            // other errors may not happen again
+            return false;
+    }
+}
+
+static void cache_record(result_cache *cache, const file_identity *identity, qtf_result result, qtf_strategy strategy)
+{
+    if (cache_insert(cache, identity, result, strategy))
+    {
+        cache_write_entry(cache->file, cache_find(cache, identity));
+        fflush(cache->file);
+        cache->line_count++;
+    }
+}
+
+/*
+ flattens each of paths in place, skipping files the cache (which may be NULL) records as done, returning EXIT_FAILURE if
+ any failed
+ */
+static int flatten_batch(const char **paths, int path_count, const qtf_options *options, result_cache *cache)
+{
+    int return_value = EXIT_SUCCESS;
+    qtf_context *context = qtf_context_create();
+    for (int i = 0; i < path_count; i++) {
+        file_identity identity;
+        qtf_result result = qtf_result_ok;
+        bool cached = cache != NULL && file_identity_get(paths[i], &identity) && cache_lookup(cache, &identity, &result);
+        if (!cached)
+        {
+            qtf_strategy strategy;
+            result = flatten_replacing(context, paths[i], options, &strategy);
+            // record the file as it is now, so it is skipped until it changes
+            if (cache != NULL && file_identity_get(paths[i], &identity)) cache_record(cache, &identity, result, strategy);
+        }
+        if (result != qtf_result_ok)
+        {
+            fprintf(stderr, "Error: %s: %s.\n", paths[i], result_description(result));
+            return_value = EXIT_FAILURE;
+        }
+    }
+    qtf_context_destroy(context);
+    return return_value;
+}
+
+/*
+ flattens the movie read from standard input to path, or to standard output if path is "-"
+ */
+static int flatten_from_stdin(const char *path, const qtf_options *options)
+{
+    bool to_stdout = strcmp(path, "-") == 0;
+#if defined(_WIN32)
+    _setmode(_fileno(stdin), _O_BINARY);
+    if (to_stdout) _setmode(_fileno(stdout), _O_BINARY);
+    int out_fd = to_stdout ? _fileno(stdout) : _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int out_fd = to_stdout ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_EXCL,
+                                                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); // RW owner, R group, R others
+#endif
+    if (out_fd == -1)
+    {
+        fprintf(stderr, "Error: %s.\n", errno == EEXIST ? "The output file already exists" : "The output file could not be created");
+        return EXIT_FAILURE;
+    }
+    qtf_result result = qtf_flatten_from_pipe(NULL, fileno(stdin), out_fd, NULL, options);
+    if (!to_stdout)
+    {
+        close(out_fd);
+        if (result != qtf_result_ok) remove(path);
+    }
+    if (result != qtf_result_ok)
+    {
+        fprintf(stderr, "Error: %s.\n", result_description(result));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#if defined(__linux__)
+
+#define watch_recent_count 64
+
+/*
+ Watching directories
+
+ Files closed after writing or moved into a watched directory are queued and flattened by a pool of workers, in-place if
+ possible, otherwise to a temporary file which then replaces the original. Flattening a file closes it after writing, so
+ the identity of each file processed is remembered and the events it causes are ignored.
+ */
+
+typedef struct watch_item {
+    struct watch_item *next;
+    char *path;
+} watch_item;
+
+typedef struct watch_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    watch_item *first;
+    watch_item *last;
+    // paths being flattened, so a file isn't flattened by two workers at once
+    char **active;
+    unsigned int worker_count;
+    // the files most recently processed
+    file_identity recent[watch_recent_count];
+    unsigned int recent_count;
+    unsigned int recent_next;
+    result_cache *cache; // NULL if there is no cache
+    const qtf_options *options;
+} watch_queue;
+
+/*
+ must be called with the queue locked
+ */
+static bool watch_queue_contains(watch_queue *queue, const char *path)
+{
+    for (watch_item *item = queue->first; item != NULL; item = item->next) {
+        if (strcmp(item->path, path) == 0) return true;
+    }
+    for (unsigned int i = 0; i < queue->worker_count; i++) {
+        if (queue->active[i] != NULL && strcmp(queue->active[i], path) == 0) return true;
+    }
+    return false;
+}
+
+static void watch_queue_add(watch_queue *queue, const char *path)
+{
+    file_identity identity;
+    if (!file_identity_get(path, &identity)) return;
+    
+    pthread_mutex_lock(&queue->lock);
+    bool skip = watch_queue_contains(queue, path);
+    for (unsigned int i = 0; i < queue->recent_count && !skip; i++) {
+        skip = file_identity_equal(&queue->recent[i], &identity);
+    }
+    qtf_result cached_result;
+    if (!skip && queue->cache != NULL) skip = cache_lookup(queue->cache, &identity, &cached_result);
+    watch_item *item = skip ? NULL : malloc(sizeof(watch_item));
+    if (item != NULL)
+    {
+        item->next = NULL;
+        item->path = strdup(path);
+        if (item->path == NULL)
+        {
+            free(item);
+        }
+        else
+        {
+            if (queue->last) queue->last->next = item;
+            else queue->first = item;
+            queue->last = item;
+            pthread_cond_signal(&queue->ready);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+typedef struct watch_worker {
+    watch_queue *queue;
+    unsigned int index;
+} watch_worker;
+
+static void *watch_worker_run(void *argument)
+{
+    watch_worker *worker = argument;
+    watch_queue *queue = worker->queue;
+    qtf_context *context = qtf_context_create();
+    
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (queue->first == NULL) pthread_cond_wait(&queue->ready, &queue->lock);
+        watch_item *item = queue->first;
+        queue->first = item->next;
+        if (queue->first == NULL) queue->last = NULL;
+        queue->active[worker->index] = item->path;
+        pthread_mutex_unlock(&queue->lock);
+        
+        qtf_strategy strategy;
+        qtf_result result = flatten_replacing(context, item->path, queue->options, &strategy);
+        if (result != qtf_result_ok) fprintf(stderr, "Error: %s: %s.\n", item->path, result_description(result));
+        
+        // a file which failed fails again until it changes, so it is remembered too
+        file_identity identity;
+        bool remember = file_identity_get(item->path, &identity);
+        
+        pthread_mutex_lock(&queue->lock);
+        if (remember)
+        {
+            queue->recent[queue->recent_next] = identity;
+            queue->recent_next = (queue->recent_next + 1) % watch_recent_count;
+            if (queue->recent_count < watch_recent_count) queue->recent_count++;
+            if (queue->cache != NULL) cache_record(queue->cache, &identity, result, strategy);
+        }
+        queue->active[worker->index] = NULL;
+        free(item->path);
+        free(item);
+    }
+    return NULL;
+}
+
+static bool watch_is_temp_file(const char *name)
+{
+    size_t length = strlen(name);
+    size_t suffix_length = strlen(temp_file_suffix);
+    return length >= suffix_length && strcmp(name + length - suffix_length, temp_file_suffix) == 0;
+}
+
+/*
+ watches directories until an error occurs, returning EXIT_FAILURE
+ */
+static int watch_directories(const char **directories, unsigned int directory_count, unsigned int worker_count, const qtf_options *options,
+                             result_cache *cache)
+{
+    watch_queue queue;
+    int watches[watch_max_directories];
+    
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: The directories could not be watched.\n");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < directory_count; i++) {
+        watches[i] = inotify_add_watch(fd, directories[i], IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+        if (watches[i] == -1)
+        {
+            fprintf(stderr, "Error: %s could not be watched.\n", directories[i]);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    memset(&queue, 0, sizeof(watch_queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+    queue.options = options;
+    queue.cache = cache;
+    queue.worker_count = worker_count;
+    queue.active = calloc(worker_count, sizeof(char *));
+    watch_worker *workers = calloc(worker_count, sizeof(watch_worker));
+    if (queue.active == NULL || workers == NULL)
+    {
+        fprintf(stderr, "Error: Not enough memory was available.\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < worker_count; i++) {
+        pthread_t thread;
+        workers[i].queue = &queue;
+        workers[i].index = i;
+        if (pthread_create(&thread, NULL, watch_worker_run, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Error: The workers could not be started.\n");
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    
+    // events are aligned to struct inotify_event
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length == -1 && errno == EINTR) continue;
+        if (length <= 0) break;
+        for (char *next = buffer; next < buffer + length; ) {
+            const struct inotify_event *event = (const struct inotify_event *)next;
+            next += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0 || watch_is_temp_file(event->name)) continue;
+            for (unsigned int i = 0; i < directory_count; i++) {
+                if (watches[i] == event->wd)
+                {
+                    char path[PATH_MAX];
+                    if (snprintf(path, sizeof(path), "%s/%s", directories[i], event->name) < (int)sizeof(path)) watch_queue_add(&queue, path);
+                    break;
+                }
+            }
+        }
+    }
+    fprintf(stderr, "Error: The directories could not be watched.\n");
+    close(fd);
+    return EXIT_FAILURE;
+}
+
+#endif
 
 int main(int argc, const char * argv[])
 {
     int return_value = EXIT_SUCCESS;
     
     bool allow_compressed_moov_atoms = false;
+    unsigned long compression_effort_ms = 0;
+    unsigned int relocate_atoms = 0;
+    bool relocate_valid = true;
+    const char *index_path = NULL;
+    bool allow_hard_link = false;
+    bool punch_holes = false;
+    bool print_checksum = false;
+    bool verify = false;
+    bool dry_run = false;
+    const char *watch_paths[watch_max_directories];
+    unsigned int watch_count = 0;
+    unsigned long worker_count = 2;
+    bool batch = false;
+    const char *cache_path = NULL;
+    double verify_fraction = 0.0;
+    bool fragment = false;
+    bool interleave = false;
+    unsigned long interleave_window_ms = 0;
+    unsigned long long memory_limit = 0;
     
     // Process arguments
     int next_arg = 1;
-    if (next_arg < argc)
+    while (next_arg < argc)
     {
     	if (strcmp(argv[next_arg], "-c") == 0)
     	{
     		allow_compressed_moov_atoms = true;
     		next_arg++;
     	}
+    	else if (strcmp(argv[next_arg], "-e") == 0 && next_arg + 1 < argc)
+    	{
+    		compression_effort_ms = strtoul(argv[next_arg + 1], NULL, 10);
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "-r") == 0 && next_arg + 1 < argc)
+    	{
+    		relocate_valid = parse_relocate_atoms(argv[next_arg + 1], &relocate_atoms);
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "-k") == 0 && next_arg + 1 < argc)
+    	{
+    		index_path = argv[next_arg + 1];
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "-l") == 0)
+    	{
+    		allow_hard_link = true;
+    		next_arg++;
+    	}
+    	else if (strcmp(argv[next_arg], "-p") == 0)
+    	{
+    		punch_holes = true;
+    		next_arg++;
+    	}
+    	else if (strcmp(argv[next_arg], "-s") == 0)
+    	{
+    		print_checksum = true;
+    		next_arg++;
+    	}
+    	else if (strcmp(argv[next_arg], "-v") == 0 && next_arg + 1 < argc)
+    	{
+    		verify = true;
+    		verify_fraction = strtod(argv[next_arg + 1], NULL);
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "--dry-run") == 0)
+    	{
+    		dry_run = true;
+    		next_arg++;
+    	}
+    	else if (strcmp(argv[next_arg], "-w") == 0 && next_arg + 1 < argc && watch_count < watch_max_directories)
+    	{
+    		watch_paths[watch_count++] = argv[next_arg + 1];
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "-b") == 0)
+    	{
+    		batch = true;
+    		next_arg++;
+    	}
+    	else if (strcmp(argv[next_arg], "-C") == 0 && next_arg + 1 < argc)
+    	{
+    		cache_path = argv[next_arg + 1];
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "-j") == 0 && next_arg + 1 < argc)
+    	{
+    		worker_count = strtoul(argv[next_arg + 1], NULL, 10);
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "-f") == 0)
+    	{
+    		fragment = true;
+    		next_arg++;
+    	}
+    	else if (strcmp(argv[next_arg], "-m") == 0 && next_arg + 1 < argc)
+    	{
+    		memory_limit = strtoull(argv[next_arg + 1], NULL, 10);
+    		next_arg += 2;
+    	}
+    	else if (strcmp(argv[next_arg], "-i") == 0 && next_arg + 1 < argc)
+    	{
+    		interleave = true;
+    		interleave_window_ms = strtoul(argv[next_arg + 1], NULL, 10);
+    		next_arg += 2;
+    	}
+    	else
+    	{
+    		break;
+    	}
     }
     
     // Get input and output paths
     const char *input_file = NULL;
     const char *output_file = NULL;
+    // a batch flattens every remaining argument
+    const char **batch_files = argv + next_arg;
+    int batch_count = argc - next_arg;
     
     if (next_arg < argc)
     {
@@ -80,10 +754,35 @@ int main(int argc, const char * argv[])
         output_file = argv[next_arg];
     }
     
-    if (!input_file)
+    if (watch_count > 0 || batch)
+    {
+        // watched directories or a batch take the place of the input and output
+        if ((watch_count > 0 && (batch || input_file || worker_count == 0)) || (batch && !input_file)
+            || fragment || interleave || print_checksum || verify || dry_run) return_value = EXIT_FAILURE;
+    }
+    else if (cache_path)
+    {
+        return_value = EXIT_FAILURE;
+    }
+    else if (input_file && strcmp(input_file, "-") == 0)
+    {
+        // standard input can only be flattened to a new file or standard output
+        if (!output_file || punch_holes || fragment || interleave || print_checksum || verify || dry_run) return_value = EXIT_FAILURE;
+    }
+    else if (!input_file || (fragment && (allow_compressed_moov_atoms || interleave)) || ((print_checksum || verify) && (fragment || interleave))
+        || (dry_run && (fragment || interleave || print_checksum || verify)))
     {
         return_value = EXIT_FAILURE;
     }
+    // only compressed moov atoms can use more compression effort
+    if (compression_effort_ms != 0 && !allow_compressed_moov_atoms) return_value = EXIT_FAILURE;
+    // atoms are relocated by flattens to a new file
+    if (!relocate_valid || (relocate_atoms != 0 && (fragment || interleave || dry_run || strcmp(input_file ? input_file : "", "-") == 0))) return_value = EXIT_FAILURE;
+    // a seek index describes a single flattened movie
+    if (index_path && (watch_count > 0 || batch || fragment || interleave || dry_run)) return_value = EXIT_FAILURE;
+    // only a separate output can be a link to the input
+    if (allow_hard_link && (watch_count > 0 || batch || !output_file || strcmp(output_file, input_file) == 0
+                            || strcmp(input_file, "-") == 0 || fragment || interleave || dry_run)) return_value = EXIT_FAILURE;
     
     // If we had bad arguments, print our usage
     if (return_value != EXIT_SUCCESS)
@@ -108,10 +807,84 @@ int main(int argc, const char * argv[])
 #else
 #error add a way to discover the program name on your platform here
 #endif
-        fprintf(stderr, "usage: %s [-c] INPUT [OUTPUT] \n", prog_name);
+        fprintf(stderr, "usage: %s [-c [-e EFFORT_MS]] [-p] [-s] [-v FRACTION] [-m MEMORY_LIMIT] [-r ATOMS] [-k INDEX] [-f | -i WINDOW_MS] INPUT [OUTPUT] \n"
+                "       %s [-c [-e EFFORT_MS]] [-s] [-v FRACTION] [-m MEMORY_LIMIT] [-r ATOMS] [-k INDEX] [-l] INPUT OUTPUT\n"
+                "       %s [-c [-e EFFORT_MS]] [-m MEMORY_LIMIT] [-k INDEX] - OUTPUT\n"
+                "       %s [-c [-e EFFORT_MS]] --dry-run INPUT\n"
+                "       %s [-c [-e EFFORT_MS]] [-p] [-m MEMORY_LIMIT] [-r ATOMS] [-C CACHE] -b INPUT ...\n"
+                "       %s [-c [-e EFFORT_MS]] [-p] [-m MEMORY_LIMIT] [-r ATOMS] [-C CACHE] [-j WORKERS] -w DIRECTORY [-w DIRECTORY ...]\n",
+                prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
     }
     else
     {
+        qtf_options options;
+        qtf_options_init(&options);
+        options.allow_compressed_moov_atom = allow_compressed_moov_atoms;
+        options.memory_limit = (size_t)memory_limit;
+        options.punch_holes = punch_holes;
+        options.checksum = print_checksum;
+        options.compression_effort_ms = (unsigned int)compression_effort_ms;
+        options.relocate_atoms = relocate_atoms;
+        options.index_path = index_path;
+        options.allow_hard_link = allow_hard_link;
+        if (watch_count > 0 || batch)
+        {
+            result_cache cache;
+            if (cache_path && !cache_open(&cache, cache_path))
+            {
+                fprintf(stderr, "Error: The cache file could not be opened.\n");
+                cache_close(&cache);
+                return EXIT_FAILURE;
+            }
+            if (batch)
+            {
+                return_value = flatten_batch(batch_files, batch_count, &options, cache_path ? &cache : NULL);
+            }
+            else
+            {
+#if defined(__linux__)
+                return_value = watch_directories(watch_paths, watch_count, (unsigned int)worker_count, &options, cache_path ? &cache : NULL);
+#else
+                fprintf(stderr, "Error: Watching directories is not supported on this platform.\n");
+                return_value = EXIT_FAILURE;
+#endif
+            }
+            if (cache_path) cache_close(&cache);
+            return return_value;
+        }
+        
+        if (strcmp(input_file, "-") == 0)
+        {
+            return flatten_from_stdin(output_file, &options);
+        }
+        
+        if (dry_run)
+        {
+            qtf_analysis analysis;
+            qtf_result result = qtf_analyze(input_file, &options, &analysis);
+            if (result != qtf_result_ok)
+            {
+                fprintf(stderr, "Error: %s.\n", result == qtf_result_file_not_movie || result == qtf_result_file_too_complex
+                        ? "The file was not recognised as a supported movie" : "The file could not be read");
+                return EXIT_FAILURE;
+            }
+            for (uint32_t i = 0; i < analysis.atom_count; i++) {
+                printf("atom ");
+                print_fourcc(analysis.atoms[i].type);
+                printf(" offset %llu size %llu\n", (unsigned long long)analysis.atoms[i].offset, (unsigned long long)analysis.atoms[i].size);
+            }
+            printf("moov size %llu%s\n", (unsigned long long)analysis.moov_size, analysis.moov_is_compressed ? " (compressed)" : "");
+            printf("moov uncompressed %llu compressed %llu\n", (unsigned long long)analysis.moov_uncompressed_size, (unsigned long long)analysis.moov_compressed_size);
+            printf("free space %llu\n", (unsigned long long)analysis.free_space);
+            printf("strategy %s\n", strategy_names[analysis.strategy]);
+            printf("bytes to write %llu\n", (unsigned long long)analysis.bytes_to_write);
+            qtf_analysis_destroy(&analysis);
+            return EXIT_SUCCESS;
+        }
+        
+        // shared by the in-place attempt and the full flatten, if this fails each uses a temporary context
+        qtf_context *context = qtf_context_create();
+        
         // If output_file is the same as input_file we treat it as if it isn't present
         if (output_file && strcmp(output_file, input_file) == 0)
         {
@@ -119,10 +892,16 @@ int main(int argc, const char * argv[])
         }
         
         // If we are to replace the input, first try doing the flatten in-place
-        if (output_file == NULL)
+        // (unless we need a checksum, which is only calculated when the whole file is written, to verify the result
+        // against the original, to relocate atoms, or to write a seek index)
+        if (output_file == NULL && !fragment && !interleave && !print_checksum && !verify && relocate_atoms == 0 && !index_path)
         {
-            qtf_result result = qtf_flatten_movie_in_place(input_file, allow_compressed_moov_atoms);
-            if (result == qtf_result_ok) return EXIT_SUCCESS;
+            qtf_result result = qtf_flatten_movie_in_place_ex(context, input_file, &options);
+            if (result == qtf_result_ok || result == qtf_result_already_flat)
+            {
+                qtf_context_destroy(context);
+                return EXIT_SUCCESS;
+            }
             // Ignore any other error here, we'll take a stab with syc_flatten_movie()
         }
         
@@ -181,38 +960,55 @@ int main(int argc, const char * argv[])
 			else
 			{
 				qtf_result result = qtf_result_ok;
+				bool already_flat = false;
 				snprintf(temp_file_path, temp_file_path_buffer_length, "%s%s", output_file, temp_file_suffix);
 
-				result = qtf_flatten_movie(input_file, temp_file_path, allow_compressed_moov_atoms);
+				if (fragment)
+				{
+					result = qtf_fragment_movie(input_file, temp_file_path, 0);
+				}
+				else if (interleave)
+				{
+					result = qtf_interleave_movie(input_file, temp_file_path, allow_compressed_moov_atoms, (uint32_t)interleave_window_ms);
+				}
+				else
+				{
+					result = qtf_flatten_movie_ex(context, input_file, temp_file_path, &options);
+					already_flat = result == qtf_result_already_flat;
+					if (already_flat) result = qtf_result_ok;
+				}
+
+				if (result == qtf_result_ok && verify)
+				{
+					result = qtf_verify(input_file, temp_file_path, verify_fraction, verify_thread_count);
+				}
 
 				if (result != qtf_result_ok)
 				{
-					fprintf(stderr, "Error: ");
-					switch (result) {
-					case qtf_result_file_not_movie:
-						fprintf(stderr, "The file was not recognised as a valid movie");
-						break;
-					case qtf_result_file_read_error:
-						fprintf(stderr, "The file could not be read");
-						break;
-					case qtf_result_file_too_complex:
-						fprintf(stderr, "This type of movie file is not supported");
-						break;
-					case qtf_result_file_write_error:
-						fprintf(stderr, "The file could not be written");
-						break;
-					case qtf_result_memory_error:
-						fprintf(stderr, "Not enough memory was available");
-						break;
-					default:
-						fprintf(stderr, "An unexpected error occurred");
-						break;
-					}
-					fprintf(stderr, ".\n");
+					fprintf(stderr, "Error: %s.\n", result_description(result));
 					return_value = EXIT_FAILURE;
 				}
 
-				if (return_value == EXIT_SUCCESS)
+				if (return_value == EXIT_SUCCESS && print_checksum)
+				{
+					// without a context the flatten used a temporary one, taking the checksum with it
+					if (context == NULL)
+					{
+						fprintf(stderr, "Error: Not enough memory was available.\n");
+						return_value = EXIT_FAILURE;
+					}
+					else
+					{
+						printf("%08lx\n", (unsigned long)qtf_flatten_checksum(context));
+					}
+				}
+
+				if (return_value == EXIT_SUCCESS && already_flat && output_file == input_file)
+				{
+					// the input is already flat, so is left as it is
+					remove(temp_file_path);
+				}
+				else if (return_value == EXIT_SUCCESS)
 				{
 #if defined(_WIN32)
 					// On Windows, rename() fails if the file already exists
@@ -229,6 +1025,7 @@ int main(int argc, const char * argv[])
 				free(temp_file_path);
 			}
         }
+        qtf_context_destroy(context);
     }
 
     return return_value;
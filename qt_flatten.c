@@ -29,15 +29,37 @@
 //  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 //  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE, fallocate
+#endif
+
 #include "qt_flatten.h"
 
 #include <stdlib.h> // malloc, free
 #include <stdint.h> // sized & signed types
+#include <limits.h> // UINT_MAX
 #include <fcntl.h> // open
 #include <sys/param.h> // MIN
 #include <string.h> // memcpy
 #include <sys/stat.h> // fstat
-#include <zlib.h> // inflate, deflate
+#include <zlib.h> // inflate, deflate, crc32
+#if defined(QTF_USE_LIBDEFLATE)
+#include <libdeflate.h> // libdeflate_zlib_compress, libdeflate_zlib_decompress
+#endif
+#include <errno.h> // EAGAIN
+#include <time.h> // clock_gettime, clock
+#include <stdio.h> // rename, snprintf
+#if !defined(_WIN32)
+#include <pthread.h> // pthread_create
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h> // sendfile
+#include <sys/ioctl.h> // ioctl
+#include <linux/fs.h> // FICLONE
+#endif
+#if defined(__APPLE__)
+#include <sys/clonefile.h> // clonefile
+#endif
 
 #define QTF_FCC_ftyp (0x66747970)
 #define QTF_FCC_moov (0x6d6f6f76)
@@ -58,6 +80,34 @@
 #define QTF_FCC_stbl (0x7374626c)
 #define QTF_FCC_stco (0x7374636f)
 #define QTF_FCC_co64 (0x636F3634)
+#define QTF_FCC_mvhd (0x6d766864)
+#define QTF_FCC_tkhd (0x746b6864)
+#define QTF_FCC_mdhd (0x6d646864)
+#define QTF_FCC_stts (0x73747473)
+#define QTF_FCC_ctts (0x63747473)
+#define QTF_FCC_stss (0x73747373)
+#define QTF_FCC_stps (0x73747073)
+#define QTF_FCC_sdtp (0x73647470)
+#define QTF_FCC_stsc (0x73747363)
+#define QTF_FCC_stsz (0x7374737a)
+#define QTF_FCC_mvex (0x6d766578)
+#define QTF_FCC_mehd (0x6d656864)
+#define QTF_FCC_trex (0x74726578)
+#define QTF_FCC_moof (0x6d6f6f66)
+#define QTF_FCC_mfhd (0x6d666864)
+#define QTF_FCC_traf (0x74726166)
+#define QTF_FCC_tfhd (0x74666864)
+#define QTF_FCC_tfdt (0x74666474)
+#define QTF_FCC_trun (0x7472756e)
+#define QTF_FCC_sidx (0x73696478)
+#define QTF_FCC_mfra (0x6d667261)
+#define QTF_FCC_tfra (0x74667261)
+#define QTF_FCC_mfro (0x6d66726f)
+#define QTF_FCC_edts (0x65647473)
+#define QTF_FCC_dinf (0x64696e66)
+#define QTF_FCC_udta (0x75647461)
+#define QTF_FCC_meta (0x6d657461)
+#define QTF_FCC_uuid (0x75756964)
 
 #if defined(__APPLE__)
 #include <libkern/OSByteOrder.h>
@@ -108,7 +158,13 @@ static __inline unsigned long long qtf_swap_64 (unsigned long long x)
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
 #endif
 
+#ifndef MAX
+#define MAX(x,y) (((x) > (y)) ? (x) : (y))
+#endif
+
 #define QTF_COPY_BUFFER_SIZE (10240)
+#define QTF_SPLICE_SIZE (1 << 20) // the most to splice or send in one call
+#define QTF_FLATTEN_BLOCK_SIZE (1 << 20) // the most an incremental flatten reads or copies at once
 
 /*
  atoms may be larger than size_t on some systems
@@ -119,31 +175,211 @@ typedef uint64_t qtf_atom_size;
  *  Compression/Decompression
  */
 
-static size_t qtf_decompress_data(void *source_buffer, size_t source_buffer_length,
+/*
+ qtf_zlib_s holds the state used to compress and decompress zlib data, which is set up on first use and reused after that.
+ Define QTF_USE_LIBDEFLATE to use libdeflate, which is faster and compresses better, rather than zlib. Either way the
+ compressed data is in zlib's format, as cmvd atoms require.
+ */
+#if defined(QTF_USE_LIBDEFLATE)
+
+#define QTF_LIBDEFLATE_MAX_LEVEL (12)
+
+typedef struct qtf_zlib_s
+{
+    struct libdeflate_compressor *compressors[QTF_LIBDEFLATE_MAX_LEVEL + 1]; // by level
+    struct libdeflate_decompressor *decompressor;
+} qtf_zlib_s;
+
+static void qtf_zlib_destroy(qtf_zlib_s *zlib)
+{
+    for (int i = 0; i <= QTF_LIBDEFLATE_MAX_LEVEL; i++) {
+        if (zlib->compressors[i]) libdeflate_free_compressor(zlib->compressors[i]);
+        zlib->compressors[i] = NULL;
+    }
+    if (zlib->decompressor) libdeflate_free_decompressor(zlib->decompressor);
+    zlib->decompressor = NULL;
+}
+
+static size_t qtf_decompress_data(qtf_zlib_s *zlib, void *source_buffer, size_t source_buffer_length,
+                                  void *decompressed_buffer, size_t decompressed_buffer_length)
+{
+    size_t decompressed_length = 0;
+    if (zlib->decompressor == NULL) zlib->decompressor = libdeflate_alloc_decompressor();
+    if (zlib->decompressor == NULL) return 0;
+    
+    enum libdeflate_result result = libdeflate_zlib_decompress(zlib->decompressor, source_buffer, source_buffer_length,
+                                                               decompressed_buffer, decompressed_buffer_length, &decompressed_length);
+    return result == LIBDEFLATE_SUCCESS ? decompressed_length : 0;
+}
+
+/*
+ compression_level is a zlib level: Z_DEFAULT_COMPRESSION is libdeflate's default and Z_BEST_COMPRESSION its best
+ */
+static size_t qtf_compress_data(qtf_zlib_s *zlib, void *source_buffer, size_t source_buffer_length,
+                                void *compressed_buffer, size_t compressed_buffer_length,
+                                int compression_level)
+{
+    int level = compression_level;
+    if (level == Z_DEFAULT_COMPRESSION) level = 6;
+    else if (level == Z_BEST_COMPRESSION) level = QTF_LIBDEFLATE_MAX_LEVEL;
+    if (level < 0 || level > QTF_LIBDEFLATE_MAX_LEVEL) return 0;
+    
+    if (zlib->compressors[level] == NULL) zlib->compressors[level] = libdeflate_alloc_compressor(level);
+    if (zlib->compressors[level] == NULL) return 0;
+    
+    // returns 0 if the data doesn't fit
+    return libdeflate_zlib_compress(zlib->compressors[level], source_buffer, source_buffer_length,
+                                    compressed_buffer, compressed_buffer_length);
+}
+
+#else
+
+typedef struct qtf_zlib_s
+{
+    z_stream deflate_stream;
+    z_stream inflate_stream;
+    bool deflate_initialized;
+    bool inflate_initialized;
+} qtf_zlib_s;
+
+static void qtf_zlib_destroy(qtf_zlib_s *zlib)
+{
+    if (zlib->deflate_initialized) deflateEnd(&zlib->deflate_stream);
+    if (zlib->inflate_initialized) inflateEnd(&zlib->inflate_stream);
+    zlib->deflate_initialized = false;
+    zlib->inflate_initialized = false;
+}
+
+static size_t qtf_decompress_data(qtf_zlib_s *zlib, void *source_buffer, size_t source_buffer_length,
                                   void *decompressed_buffer, size_t decompressed_buffer_length)
 {
-    size_t size_out = 0;
-    uLongf decompressed_length = decompressed_buffer_length;
+    z_stream *stream = &zlib->inflate_stream;
+    if (source_buffer_length > UINT_MAX || decompressed_buffer_length > UINT_MAX) return 0;
     
-    int result = uncompress(decompressed_buffer, &decompressed_length, source_buffer, source_buffer_length);
+    if (!zlib->inflate_initialized)
+    {
+        memset(stream, 0, sizeof(z_stream));
+        if (inflateInit(stream) != Z_OK) return 0;
+        zlib->inflate_initialized = true;
+    }
+    else if (inflateReset(stream) != Z_OK)
+    {
+        return 0;
+    }
+    stream->next_in = source_buffer;
+    stream->avail_in = (uInt)source_buffer_length;
+    stream->next_out = decompressed_buffer;
+    stream->avail_out = (uInt)decompressed_buffer_length;
     
-    if (result == Z_OK) size_out = decompressed_length;
+    int result = inflate(stream, Z_FINISH);
     
-    return size_out;
+    return result == Z_STREAM_END ? (size_t)stream->total_out : 0;
 }
 
-static size_t qtf_compress_data(void *source_buffer, size_t source_buffer_length,
+static size_t qtf_compress_data(qtf_zlib_s *zlib, void *source_buffer, size_t source_buffer_length,
                                 void *compressed_buffer, size_t compressed_buffer_length,
                                 int compression_level)
 {
-    size_t size_out = 0;
-    uLongf compressed_length = compressed_buffer_length;
+    z_stream *stream = &zlib->deflate_stream;
+    if (source_buffer_length > UINT_MAX || compressed_buffer_length > UINT_MAX) return 0;
+    
+    if (!zlib->deflate_initialized)
+    {
+        memset(stream, 0, sizeof(z_stream));
+        if (deflateInit(stream, compression_level) != Z_OK) return 0;
+        zlib->deflate_initialized = true;
+    }
+    else if (deflateReset(stream) != Z_OK)
+    {
+        return 0;
+    }
+    // set the output before changing level, in case zlib wants to flush
+    stream->next_out = compressed_buffer;
+    stream->avail_out = (uInt)compressed_buffer_length;
+    if (deflateParams(stream, compression_level, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+    stream->next_in = source_buffer;
+    stream->avail_in = (uInt)source_buffer_length;
+    
+    int result = deflate(stream, Z_FINISH);
     
-    int result = compress2(compressed_buffer, &compressed_length, source_buffer, source_buffer_length, compression_level);
+    return result == Z_STREAM_END ? (size_t)stream->total_out : 0;
+}
+
+#endif
+
+/*
+ returns the processor time used by the calling thread in milliseconds, so that other threads flattening at the same
+ time don't use up each other's time limits. on Windows, where clock() measures wall-clock time, that is used instead
+ */
+static double qtf_thread_time_ms(void)
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0) return (double)now.tv_sec * 1000 + (double)now.tv_nsec / 1000000;
+#endif
+    return (double)clock() * 1000 / CLOCKS_PER_SEC;
+}
+
+/*
+ compresses with zlib at its best level, but with its match search limits raised as far as they go, once for each of a
+ few strategies, returning the length of the smallest output or 0 if none fitted in compressed_buffer_length. Always
+ uses zlib, whichever backend qtf_compress_data() uses. Attempts stop once time_limit_ms of the calling thread's
+ processor time is used, as measured by qtf_thread_time_ms().
+ */
+static size_t qtf_compress_data_exhaustive(void *source_buffer, size_t source_buffer_length,
+                                           void *compressed_buffer, size_t compressed_buffer_length,
+                                           unsigned int time_limit_ms)
+{
+    static const struct { int strategy; int nice_length; } attempts[] = {
+        { Z_DEFAULT_STRATEGY, 258 },
+        { Z_FILTERED, 258 },
+        { Z_DEFAULT_STRATEGY, 128 },
+    };
+    const size_t block_length = 64 * 1024; // how much input to compress between checks of the time used
+    if (source_buffer_length > UINT_MAX || compressed_buffer_length > UINT_MAX) return 0;
     
-    if (result == Z_OK) size_out = compressed_length;
+    void *attempt_buffer = malloc(compressed_buffer_length);
+    if (attempt_buffer == NULL) return 0;
     
-    return size_out;
+    double deadline = qtf_thread_time_ms() + time_limit_ms;
+    size_t best_length = 0;
+    bool out_of_time = false;
+    for (size_t i = 0; i < sizeof(attempts) / sizeof(attempts[0]) && !out_of_time; i++) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(z_stream));
+        if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15, 9, attempts[i].strategy) != Z_OK) break;
+        // good_length, max_lazy, nice_length, max_chain
+        int status = deflateTune(&stream, 258, 258, attempts[i].nice_length, 32768);
+        // anything larger than the best so far is no use
+        stream.next_out = attempt_buffer;
+        stream.avail_out = (uInt)(best_length != 0 ? best_length - 1 : compressed_buffer_length);
+        uint8_t *input = source_buffer;
+        size_t remaining = source_buffer_length;
+        while (status == Z_OK)
+        {
+            size_t length = remaining < block_length ? remaining : block_length;
+            stream.next_in = input;
+            stream.avail_in = (uInt)length;
+            input += length;
+            remaining -= length;
+            status = deflate(&stream, remaining == 0 ? Z_FINISH : Z_NO_FLUSH);
+            // deflate only stops short of using all its input when the output is full
+            if (status == Z_OK && (stream.avail_in != 0 || remaining == 0)) status = Z_BUF_ERROR;
+            if (status == Z_OK && qtf_thread_time_ms() > deadline)
+            {
+                out_of_time = true;
+                status = Z_BUF_ERROR;
+            }
+        }
+        if (status == Z_STREAM_END)
+        {
+            best_length = (size_t)stream.total_out;
+            memcpy(compressed_buffer, attempt_buffer, best_length);
+        }
+        deflateEnd(&stream);
+    }
+    free(attempt_buffer);
+    return best_length;
 }
 
 /*
@@ -152,92 +388,226 @@ static size_t qtf_compress_data(void *source_buffer, size_t source_buffer_length
  *  qtf_edit_list maintains a list of data insertions and removals and calculates the overall change for data at given offsets
  */
 
-typedef struct qtf_edit_s **qtf_edit_list;
+#define QTF_EDIT_LIST_INITIAL_CAPACITY (16)
 
 typedef struct qtf_edit_s
 {
     off_t offset;
     off_t edit;
-    struct qtf_edit_s *next;
 } qtf_edit_s;
 
+typedef struct qtf_edit_list_s
+{
+    qtf_edit_s *edits;
+    size_t count;
+    size_t capacity;
+} qtf_edit_list_s, *qtf_edit_list;
 
-static qtf_edit_list qtf_edit_list_create()
+static void qtf_edit_list_init(qtf_edit_list list)
 {
-    qtf_edit_list list = malloc(sizeof(qtf_edit_s *));
-    if (list)
-    {
-        *list = NULL;
-    }
-    return list;
+    list->edits = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+/*
+ removes every edit, keeping the list's storage for reuse
+ */
+static void qtf_edit_list_clear(qtf_edit_list list)
+{
+    list->count = 0;
 }
 
-static void qtf_edit_list_destroy(qtf_edit_list list)
+/*
+ adds an edit to list, which may be NULL. the edit is never dropped, a failure to grow the list is returned as an error
+ */
+static qtf_result qtf_edit_list_add_edit(qtf_edit_list list, off_t offset, off_t edit)
 {
     if (list)
     {
-        qtf_edit_s *edit = *list;
-        while (edit) {
-            qtf_edit_s *next = edit->next;
-            free(edit);
-            edit = next;
+        if (list->count == list->capacity)
+        {
+            size_t capacity = list->capacity ? list->capacity * 2 : QTF_EDIT_LIST_INITIAL_CAPACITY;
+            qtf_edit_s *edits = realloc(list->edits, sizeof(qtf_edit_s) * capacity);
+            if (edits == NULL) return qtf_result_memory_error;
+            list->edits = edits;
+            list->capacity = capacity;
         }
-        free(list);
+        list->edits[list->count].offset = offset;
+        list->edits[list->count].edit = edit;
+        list->count++;
     }
+    return qtf_result_ok;
 }
 
-static void qtf_edit_list_add_edit(qtf_edit_list list, off_t offset, off_t edit)
+static off_t qtf_edit_list_get_offset_change(qtf_edit_list list, off_t offset)
 {
+    off_t change = 0;
     if (list)
     {
-        qtf_edit_s *entry = malloc(sizeof(qtf_edit_s));
-        if (entry)
-        {
-            entry->offset = offset;
-            entry->edit = edit;
-            entry->next = *list;
-            *list = entry;
+        for (size_t i = 0; i < list->count; i++) {
+            if (list->edits[i].offset <= offset)
+            {
+                change += list->edits[i].edit;
+            }
         }
     }
+    return change;
 }
 
-static off_t qtf_edit_list_get_offset_change(qtf_edit_list list, off_t offset)
+/*
+ returns the overall change in the length of the range of data from start up to (but not including) end
+ */
+static off_t qtf_edit_list_get_range_change(qtf_edit_list list, off_t start, off_t end)
 {
     off_t change = 0;
     if (list)
     {
-        qtf_edit_s *edit = *list;
-        while (edit) {
-            if (edit->offset <= offset)
+        for (size_t i = 0; i < list->count; i++) {
+            if (list->edits[i].offset >= start && list->edits[i].offset < end)
             {
-                change += edit->edit;
+                change += list->edits[i].edit;
             }
-            edit = edit->next;
         }
     }
     return change;
 }
 
+/*
+ replaces the edits in dest with those in source, returning false if there wasn't enough memory
+ */
+static bool qtf_edit_list_copy(qtf_edit_list dest, qtf_edit_list source)
+{
+    if (dest->capacity < source->count)
+    {
+        qtf_edit_s *edits = realloc(dest->edits, sizeof(qtf_edit_s) * source->count);
+        if (edits == NULL) return false;
+        dest->edits = edits;
+        dest->capacity = source->count;
+    }
+    if (source->count > 0) memcpy(dest->edits, source->edits, sizeof(qtf_edit_s) * source->count);
+    dest->count = source->count;
+    return true;
+}
+
+/*
+ *  qtf_extent_list
+ *
+ *  qtf_extent_list holds the ranges of the source which a flatten copies after the moov atom, in source order, as found by
+ *  the scan. Adjacent atoms which are copied as they are share one extent, so they are copied with as few calls as possible,
+ *  except that mdat atoms are never merged with other atoms, so writers which lay out the movie data themselves can skip it.
+ */
+
+#define QTF_EXTENT_LIST_INITIAL_CAPACITY (16)
+
+typedef enum qtf_extent_kind {
+    qtf_extent_copy = 0, // copied as it is
+    qtf_extent_relocate, // copied as it is, to follow the moov atom
+    qtf_extent_patch // a single moof, sidx or mfra atom whose offsets are updated as it is copied
+} qtf_extent_kind;
+
+typedef struct qtf_extent_s
+{
+    off_t offset;
+    qtf_atom_size length;
+    qtf_extent_kind kind;
+    uint32_t type; // of the atom, for qtf_extent_patch
+} qtf_extent_s;
+
+typedef struct qtf_extent_list_s
+{
+    qtf_extent_s *extents;
+    size_t count;
+    size_t capacity;
+} qtf_extent_list_s, *qtf_extent_list;
+
+static void qtf_extent_list_init(qtf_extent_list list)
+{
+    list->extents = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+/*
+ removes every extent, keeping the list's storage for reuse
+ */
+static void qtf_extent_list_clear(qtf_extent_list list)
+{
+    list->count = 0;
+}
+
+/*
+ adds the atom of type and length at offset, merging it into the last extent if both are copied the same way and are
+ adjacent. returns false if there wasn't enough memory
+ */
+static bool qtf_extent_list_add_atom(qtf_extent_list list, off_t offset, qtf_atom_size length, qtf_extent_kind kind, uint32_t type)
+{
+    if (list)
+    {
+        qtf_extent_s *last = list->count > 0 ? &list->extents[list->count - 1] : NULL;
+        if (last && kind != qtf_extent_patch && last->kind == kind && last->offset + (off_t)last->length == offset
+            && (last->type == QTF_FCC_mdat) == (type == QTF_FCC_mdat))
+        {
+            last->length += length;
+            return true;
+        }
+        if (list->count == list->capacity)
+        {
+            size_t capacity = list->capacity ? list->capacity * 2 : QTF_EXTENT_LIST_INITIAL_CAPACITY;
+            qtf_extent_s *extents = realloc(list->extents, sizeof(qtf_extent_s) * capacity);
+            if (extents == NULL) return false;
+            list->extents = extents;
+            list->capacity = capacity;
+        }
+        list->extents[list->count].offset = offset;
+        list->extents[list->count].length = length;
+        list->extents[list->count].kind = kind;
+        list->extents[list->count].type = type;
+        list->count++;
+    }
+    return true;
+}
+
 /*
  *  Utility
  */
 
+/*
+ reads until length bytes have been read or the end of the file is reached, as pipes may return less than was asked for
+ before then. *out_read is set to the number of bytes read
+ */
+static qtf_result qtf_read_available(int fd, void *buffer, size_t length, size_t *out_read)
+{
+    size_t done = 0;
+    
+    while (done < length) {
+        ssize_t got = read(fd, (uint8_t *)buffer + done, length - done);
+        if (got == -1 && errno == EINTR) continue;
+        if (got == -1)
+        {
+            *out_read = done;
+            return qtf_result_file_read_error;
+        }
+        if (got == 0) break;
+        done += (size_t)got;
+    }
+    *out_read = done;
+    return qtf_result_ok;
+}
+
 /*
  qtf_read is like read except it returns an error if the expected number of bytes couldn't be read
  */
 static qtf_result qtf_read(int fd, void *buffer, size_t length)
 {
-    off_t got = read(fd, buffer, length);
+    size_t got = 0;
+    qtf_result result = qtf_read_available(fd, buffer, length, &got);
     
-    if (got == -1)
-    {
-        return qtf_result_file_read_error;
-    }
-    else if (got != length)
+    if (result == qtf_result_ok && got != length)
     {
         return qtf_result_file_not_movie;
     }
-    return qtf_result_ok;
+    return result;
 }
 
 /*
@@ -253,6 +623,54 @@ static qtf_result qtf_write(int fd, const void *buffer, size_t length)
     return qtf_result_ok;
 }
 
+/*
+ big-endian integer accessors for atoms held in memory
+ */
+static inline uint32_t qtf_get_32(const void *p)
+{
+    return qtf_swap_big_to_host_int_32(*(const uint32_t *)p);
+}
+
+static inline uint64_t qtf_get_64(const void *p)
+{
+    return qtf_swap_big_to_host_int_64(*(const uint64_t *)p);
+}
+
+static inline void qtf_put_32(void *p, uint32_t value)
+{
+    *(uint32_t *)p = qtf_swap_host_to_big_int_32(value);
+}
+
+static inline void qtf_put_64(void *p, uint64_t value)
+{
+    *(uint64_t *)p = qtf_swap_host_to_big_int_64(value);
+}
+
+/*
+ copies length bytes starting at source_offset in fd_source to the current position in fd_dest
+ */
+static qtf_result qtf_copy_data(int fd_source, off_t source_offset, int fd_dest, qtf_atom_size length)
+{
+    char buffer[QTF_COPY_BUFFER_SIZE];
+    qtf_result result = qtf_result_ok;
+    
+    if (lseek(fd_source, source_offset, SEEK_SET) == -1)
+    {
+        result = qtf_result_file_read_error;
+    }
+    while (result == qtf_result_ok && length > 0)
+    {
+        size_t to_copy = (size_t)MIN(length, QTF_COPY_BUFFER_SIZE);
+        result = qtf_read(fd_source, buffer, to_copy);
+        if (result == qtf_result_ok)
+        {
+            result = qtf_write(fd_dest, buffer, to_copy);
+        }
+        length -= to_copy;
+    }
+    return result;
+}
+
 /*
  returns 0 on success or a qtf_result
  */
@@ -334,752 +752,5088 @@ static qtf_result qtf_read_atom_header(int fd, void *dest_buffer, size_t dest_bu
     return qtf_result_ok;
 }
 
-// set as many try_ flags as you want, they will be tried sequentially until one works in the given buffer size
-// returns the size of the compressed atom on success, or 0 on failure
-static size_t qtf_compress_movie_atom(void *atom_buffer, size_t atom_buffer_length,
-                                      void *compressed_atom_buffer, size_t compressed_atom_buffer_length,
-                                      bool try_fast, bool try_default, bool try_best)
+/*
+ releases the disk space of the contents of every top-level free and skip atom in fd, where the file system supports it.
+ Only whole blocks are released, the atoms keep their headers and sizes and their contents read back as zeros. This is
+ only an optimisation so failures are ignored.
+ */
+static void qtf_punch_free_atoms(int fd)
 {
-    // leave space for the compressed movie atoms (40 bytes)
-    size_t compressed_data_max_length = compressed_atom_buffer_length - 40;
-    void *compressed_data = compressed_atom_buffer + 40;
-    size_t compressed_data_length = 0;
-    if (try_fast)
-    {
-        compressed_data_length = qtf_compress_data(atom_buffer, atom_buffer_length, compressed_data, compressed_data_max_length, Z_BEST_SPEED);
+#if (defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)) || defined(F_PUNCHHOLE)
+    struct stat status;
+    if (fstat(fd, &status) == -1) return;
+    off_t block_size = status.st_blksize > 0 ? status.st_blksize : 4096;
+    off_t offset = lseek(fd, 0, SEEK_SET);
+    
+    while (offset != -1) {
+        uint32_t atom_header[4];
+        qtf_atom_size size = 0;
+        uint32_t type = 0;
+        size_t bytes_read = 0;
+        qtf_result result = qtf_read_atom_header(fd, atom_header, sizeof(atom_header), &type, &size, &bytes_read);
+        
+        if (result != qtf_result_ok || bytes_read == 0 || size < bytes_read) break;
+        
+        if (type == QTF_FCC_free || type == QTF_FCC_skip)
+        {
+            off_t start = ((offset + (off_t)bytes_read + block_size - 1) / block_size) * block_size;
+            off_t end = ((offset + (off_t)size) / block_size) * block_size;
+            if (end > start)
+            {
+#if defined(F_PUNCHHOLE)
+                fpunchhole_t punch = { .fp_offset = start, .fp_length = end - start };
+                fcntl(fd, F_PUNCHHOLE, &punch);
+#else
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+#endif
+            }
+        }
+        offset = lseek(fd, offset + (off_t)size, SEEK_SET);
     }
-    if (try_default && compressed_data_length == 0)
-    {
-        compressed_data_length = qtf_compress_data(atom_buffer, atom_buffer_length, compressed_data, compressed_data_max_length, Z_DEFAULT_COMPRESSION);
+#endif
+}
+
+/*
+ *  qtf_box_tree
+ *
+ *  qtf_box_tree parses an atom held in memory into a tree of boxes whose data stays in the original buffer. Boxes live in
+ *  a single growable arena and refer to each other by index. Fixed-size fields are edited in place in the buffer; boxes
+ *  which are replaced, removed or added mark their ancestors modified, and the sizes of modified boxes are recomputed
+ *  when needed. Unmodified boxes are written by copying their original bytes.
+ */
+
+#define QTF_BOX_NONE (UINT32_MAX)
+#define QTF_BOX_TREE_INITIAL_CAPACITY (64)
+#define QTF_BOX_TREE_MAX_DEPTH (32) // real movies nest a handful of levels, deeper trees are rejected rather than recursed into
+
+typedef uint32_t qtf_box;
+
+typedef struct qtf_box_s
+{
+    uint32_t type;
+    uint8_t *contents; // the box's data after its header, in the parsed buffer or supplied by the caller
+    uint64_t contents_length; // ignored for containers, whose contents are their children
+    uint64_t size; // valid if size_valid
+    uint8_t header_length;
+    qtf_box parent;
+    qtf_box first_child;
+    qtf_box last_child;
+    qtf_box next_sibling;
+    bool container;
+    bool modified; // the box or one of its descendants was replaced, removed or added
+    bool size_valid;
+    bool removed;
+} qtf_box_s;
+
+typedef struct qtf_box_tree_s
+{
+    qtf_box_s *boxes;
+    uint32_t box_count;
+    uint32_t box_capacity;
+} qtf_box_tree_s;
+
+static void qtf_box_tree_init(qtf_box_tree_s *tree)
+{
+    tree->boxes = NULL;
+    tree->box_count = 0;
+    tree->box_capacity = 0;
+}
+
+static void qtf_box_tree_destroy(qtf_box_tree_s *tree)
+{
+    free(tree->boxes);
+    qtf_box_tree_init(tree);
+}
+
+static bool qtf_box_is_container(uint32_t type)
+{
+    switch (type) {
+        case QTF_FCC_moov:
+        case QTF_FCC_trak:
+        case QTF_FCC_edts:
+        case QTF_FCC_mdia:
+        case QTF_FCC_minf:
+        case QTF_FCC_dinf:
+        case QTF_FCC_stbl:
+        case QTF_FCC_mvex:
+        case QTF_FCC_cmov:
+        case QTF_FCC_moof:
+        case QTF_FCC_traf:
+        case QTF_FCC_mfra:
+            return true;
+        default:
+            return false;
     }
-    if (try_best || compressed_data_length == 0)
+}
+
+/*
+ returns a new box with no children linked as the last child of parent (if parent isn't QTF_BOX_NONE), or QTF_BOX_NONE if
+ the arena couldn't grow. Pointers to boxes are invalidated by this, indices are not.
+ */
+static qtf_box qtf_box_tree_add(qtf_box_tree_s *tree, qtf_box parent, uint32_t type)
+{
+    if (tree->box_count == tree->box_capacity)
     {
-        compressed_data_length = qtf_compress_data(atom_buffer, atom_buffer_length, compressed_data, compressed_data_max_length, Z_BEST_COMPRESSION);
+        uint32_t capacity = tree->box_capacity ? tree->box_capacity * 2 : QTF_BOX_TREE_INITIAL_CAPACITY;
+        qtf_box_s *boxes = realloc(tree->boxes, sizeof(qtf_box_s) * capacity);
+        if (boxes == NULL) return QTF_BOX_NONE;
+        tree->boxes = boxes;
+        tree->box_capacity = capacity;
     }
-    if (compressed_data_length != 0)
+    qtf_box index = tree->box_count++;
+    qtf_box_s *box = &tree->boxes[index];
+    memset(box, 0, sizeof(qtf_box_s));
+    box->type = type;
+    box->parent = parent;
+    box->first_child = QTF_BOX_NONE;
+    box->last_child = QTF_BOX_NONE;
+    box->next_sibling = QTF_BOX_NONE;
+    box->container = qtf_box_is_container(type);
+    if (parent != QTF_BOX_NONE)
     {
-        // write the compressed movie atom header before the compressed data
-        *(uint32_t *)compressed_atom_buffer = qtf_swap_host_to_big_int_32(compressed_data_length + 40);
-        *(uint32_t *)(compressed_atom_buffer + 4) = qtf_swap_host_to_big_int_32(QTF_FCC_moov);
-        *(uint32_t *)(compressed_atom_buffer + 8) = qtf_swap_host_to_big_int_32(compressed_data_length + 32);
-        *(uint32_t *)(compressed_atom_buffer + 12) = qtf_swap_host_to_big_int_32(QTF_FCC_cmov);
-        *(uint32_t *)(compressed_atom_buffer + 16) = qtf_swap_host_to_big_int_32(12);
-        *(uint32_t *)(compressed_atom_buffer + 20) = qtf_swap_host_to_big_int_32(QTF_FCC_dcom);
-        *(uint32_t *)(compressed_atom_buffer + 24) = qtf_swap_host_to_big_int_32(QTF_FCC_zlib);
-        *(uint32_t *)(compressed_atom_buffer + 28) = qtf_swap_host_to_big_int_32(compressed_data_length + 12);
-        *(uint32_t *)(compressed_atom_buffer + 32) = qtf_swap_host_to_big_int_32(QTF_FCC_cmvd);
-        *(uint32_t *)(compressed_atom_buffer + 36) = qtf_swap_host_to_big_int_32(atom_buffer_length);
-        
-        compressed_data_length += 40;
+        qtf_box_s *parent_box = &tree->boxes[parent];
+        if (parent_box->last_child == QTF_BOX_NONE) parent_box->first_child = index;
+        else tree->boxes[parent_box->last_child].next_sibling = index;
+        parent_box->last_child = index;
     }
-    return compressed_data_length;
+    return index;
 }
 
-static qtf_result qtf_offsets_apply_list(void *moov_atom, qtf_atom_size moov_atom_size, qtf_edit_list edit_list)
+/*
+ parses the boxes in buffer as children of parent, which is depth levels below the root
+ */
+static qtf_result qtf_box_tree_parse_children(qtf_box_tree_s *tree, qtf_box parent, unsigned int depth, uint8_t *buffer, uint64_t length)
 {
     qtf_result result = qtf_result_ok;
-    for (int i = 8; i < moov_atom_size; ) {
-        uint32_t size = qtf_swap_big_to_host_int_32(*(uint32_t *)(moov_atom + i));
-        uint32_t type = qtf_swap_big_to_host_int_32(*(uint32_t *)(moov_atom + i + 4));
-        if (size > (moov_atom_size - i))
+    uint64_t i = 0;
+    if (depth >= QTF_BOX_TREE_MAX_DEPTH) return qtf_result_file_not_movie;
+    // fewer than 8 trailing bytes (such as a QuickTime 32-bit terminator) are ignored
+    while (result == qtf_result_ok && i + 8 <= length) {
+        uint64_t size = qtf_get_32(buffer + i);
+        uint32_t type = qtf_get_32(buffer + i + 4);
+        size_t header_length = 8;
+        if (size == 1)
         {
-            result = qtf_result_file_not_movie;
-            break;
+            if (i + 16 > length) return qtf_result_file_not_movie;
+            size = qtf_get_64(buffer + i + 8);
+            header_length = 16;
         }
-        if (type == QTF_FCC_stco)
+        else if (size == 0)
         {
-            uint32_t entry_count = qtf_swap_big_to_host_int_32(*(uint32_t *)(moov_atom + i + 12));
-            if (entry_count * 4 > size - 16)
-            {
-                result = qtf_result_file_not_movie;
-                break;
-            }
-            for (int j = 0; j < entry_count; j++) {
-                uint32_t *entry = moov_atom + i + 16 + (j * 4);
-                uint32_t current_offset = qtf_swap_big_to_host_int_32(*entry);
-                current_offset += qtf_edit_list_get_offset_change(edit_list, current_offset);
-                *entry = qtf_swap_host_to_big_int_32(current_offset);
-            }
+            size = length - i;
         }
-        else if (type == QTF_FCC_co64)
+        if (size < header_length || size > length - i) return qtf_result_file_not_movie;
+        
+        qtf_box box = qtf_box_tree_add(tree, parent, type);
+        if (box == QTF_BOX_NONE) return qtf_result_memory_error;
+        tree->boxes[box].contents = buffer + i + header_length;
+        tree->boxes[box].contents_length = size - header_length;
+        tree->boxes[box].size = size;
+        tree->boxes[box].header_length = (uint8_t)header_length;
+        tree->boxes[box].size_valid = true;
+        if (tree->boxes[box].container)
         {
-            uint32_t entry_count = qtf_swap_big_to_host_int_32(*(uint32_t *)(moov_atom + i + 12));
-            if (entry_count * 8 > size - 16)
-            {
-                result = qtf_result_file_not_movie;
-                break;
-            }
-            for (int j = 0; j < entry_count; j++) {
-                uint64_t *entry = moov_atom + i + 16 + (j * 8);
-                uint64_t current_offset = qtf_swap_big_to_host_int_64(*entry);
-                current_offset += qtf_edit_list_get_offset_change(edit_list, current_offset);
-                *entry = qtf_swap_host_to_big_int_64(current_offset);
-            }
-        }
-        switch (type) {
-            case QTF_FCC_trak:
-            case QTF_FCC_mdia:
-            case QTF_FCC_minf:
-            case QTF_FCC_stbl:
-                // enter it
-                i += 8;
-                break;
-            default:
-                // skip it
-                i += size;
-                break;
+            result = qtf_box_tree_parse_children(tree, box, depth + 1, buffer + i + header_length, size - header_length);
         }
+        i += size;
     }
     return result;
 }
 
-static qtf_result qtf_offsets_modify(void *moov_atom, qtf_atom_size moov_atom_size, ssize_t change)
-{
+/*
+ parses the atom in buffer, which becomes the tree's root box (index 0). Any previous contents of the tree are discarded
+ but its arena is reused.
+ */
+static qtf_result qtf_box_tree_parse(qtf_box_tree_s *tree, uint8_t *buffer, uint64_t length)
+{
+    tree->box_count = 0;
+    if (length < 8) return qtf_result_file_not_movie;
+    
+    uint64_t size = qtf_get_32(buffer);
+    size_t header_length = 8;
+    if (size == 1 && length >= 16)
+    {
+        size = qtf_get_64(buffer + 8);
+        header_length = 16;
+    }
+    if (size < header_length || size > length) return qtf_result_file_not_movie;
+    
+    qtf_box root = qtf_box_tree_add(tree, QTF_BOX_NONE, qtf_get_32(buffer + 4));
+    if (root == QTF_BOX_NONE) return qtf_result_memory_error;
+    tree->boxes[root].contents = buffer + header_length;
+    tree->boxes[root].contents_length = size - header_length;
+    tree->boxes[root].size = size;
+    tree->boxes[root].header_length = (uint8_t)header_length;
+    tree->boxes[root].size_valid = true;
+    // the root is always parsed as a container
+    tree->boxes[root].container = true;
+    return qtf_box_tree_parse_children(tree, root, 0, buffer + header_length, size - header_length);
+}
+
+/*
+ returns the start (header included) of an unmodified box in the parsed buffer and sets *out_size, or returns NULL for
+ QTF_BOX_NONE
+ */
+static uint8_t *qtf_box_atom(qtf_box_tree_s *tree, qtf_box box, size_t *out_size)
+{
+    if (box == QTF_BOX_NONE) return NULL;
+    *out_size = (size_t)tree->boxes[box].size;
+    return tree->boxes[box].contents - tree->boxes[box].header_length;
+}
+
+/*
+ returns the first child of parent with type, or QTF_BOX_NONE
+ */
+static qtf_box qtf_box_find(qtf_box_tree_s *tree, qtf_box parent, uint32_t type)
+{
+    if (parent == QTF_BOX_NONE) return QTF_BOX_NONE;
+    for (qtf_box child = tree->boxes[parent].first_child; child != QTF_BOX_NONE; child = tree->boxes[child].next_sibling) {
+        if (tree->boxes[child].type == type && !tree->boxes[child].removed) return child;
+    }
+    return QTF_BOX_NONE;
+}
+
+/*
+ returns the next sibling of box with the same type, or QTF_BOX_NONE
+ */
+static qtf_box qtf_box_next(qtf_box_tree_s *tree, qtf_box box)
+{
+    uint32_t type = tree->boxes[box].type;
+    for (qtf_box sibling = tree->boxes[box].next_sibling; sibling != QTF_BOX_NONE; sibling = tree->boxes[sibling].next_sibling) {
+        if (tree->boxes[sibling].type == type && !tree->boxes[sibling].removed) return sibling;
+    }
+    return QTF_BOX_NONE;
+}
+
+/*
+ follows a path of four character codes separated by '/' (eg "mdia/minf/stbl") from box, returning the first match or QTF_BOX_NONE
+ */
+static qtf_box qtf_box_find_path(qtf_box_tree_s *tree, qtf_box box, const char *path)
+{
+    while (box != QTF_BOX_NONE && *path != '\0') {
+        if (strlen(path) < 4) return QTF_BOX_NONE;
+        uint32_t type = ((uint32_t)(uint8_t)path[0] << 24) | ((uint32_t)(uint8_t)path[1] << 16) | ((uint32_t)(uint8_t)path[2] << 8) | (uint8_t)path[3];
+        box = qtf_box_find(tree, box, type);
+        path += 4;
+        if (*path == '/') path++;
+    }
+    return box;
+}
+
+static void qtf_box_mark_modified(qtf_box_tree_s *tree, qtf_box box)
+{
+    for (; box != QTF_BOX_NONE && (tree->boxes[box].size_valid || !tree->boxes[box].modified); box = tree->boxes[box].parent) {
+        tree->boxes[box].modified = true;
+        tree->boxes[box].size_valid = false;
+    }
+}
+
+/*
+ replaces the contents of a leaf box, contents must remain valid until the tree is written
+ */
+static void qtf_box_set_contents(qtf_box_tree_s *tree, qtf_box box, uint8_t *contents, uint64_t contents_length)
+{
+    tree->boxes[box].contents = contents;
+    tree->boxes[box].contents_length = contents_length;
+    qtf_box_mark_modified(tree, box);
+}
+
+static void qtf_box_remove(qtf_box_tree_s *tree, qtf_box box)
+{
+    tree->boxes[box].removed = true;
+    qtf_box_mark_modified(tree, tree->boxes[box].parent);
+}
+
+/*
+ adds a leaf box as the last child of parent, contents must remain valid until the tree is written
+ */
+static qtf_box qtf_box_append(qtf_box_tree_s *tree, qtf_box parent, uint32_t type, uint8_t *contents, uint64_t contents_length)
+{
+    qtf_box box = qtf_box_tree_add(tree, parent, type);
+    if (box != QTF_BOX_NONE)
+    {
+        tree->boxes[box].container = false;
+        qtf_box_set_contents(tree, box, contents, contents_length);
+    }
+    return box;
+}
+
+/*
+ adds an empty container box as the last child of parent
+ */
+static qtf_box qtf_box_append_container(qtf_box_tree_s *tree, qtf_box parent, uint32_t type)
+{
+    qtf_box box = qtf_box_tree_add(tree, parent, type);
+    if (box != QTF_BOX_NONE)
+    {
+        tree->boxes[box].container = true;
+        qtf_box_mark_modified(tree, box);
+    }
+    return box;
+}
+
+/*
+ returns the size of a box as it will be written, recomputing it if it was edited
+ */
+static uint64_t qtf_box_size(qtf_box_tree_s *tree, qtf_box box)
+{
+    qtf_box_s *b = &tree->boxes[box];
+    if (!b->size_valid)
+    {
+        uint64_t contents_length = 0;
+        if (b->container)
+        {
+            for (qtf_box child = b->first_child; child != QTF_BOX_NONE; child = tree->boxes[child].next_sibling) {
+                if (!tree->boxes[child].removed) contents_length += qtf_box_size(tree, child);
+            }
+        }
+        else
+        {
+            contents_length = b->contents_length;
+        }
+        b = &tree->boxes[box];
+        b->header_length = (contents_length + 8 > UINT32_MAX) ? 16 : 8;
+        b->size = contents_length + b->header_length;
+        b->size_valid = true;
+    }
+    return b->size;
+}
+
+/*
+ writes a box and its children to dest, which must have space for qtf_box_size() bytes
+ returns the number of bytes written
+ */
+static uint64_t qtf_box_write(qtf_box_tree_s *tree, qtf_box box, uint8_t *dest)
+{
+    uint64_t size = qtf_box_size(tree, box);
+    const qtf_box_s *b = &tree->boxes[box];
+    
+    if (!b->modified)
+    {
+        // the original box, header and all
+        memmove(dest, b->contents - b->header_length, (size_t)size);
+        return size;
+    }
+    if (b->header_length == 16)
+    {
+        qtf_put_32(dest, 1);
+        qtf_put_64(dest + 8, size);
+    }
+    else
+    {
+        qtf_put_32(dest, (uint32_t)size);
+    }
+    qtf_put_32(dest + 4, b->type);
+    
+    uint64_t written = b->header_length;
+    if (b->container)
+    {
+        for (qtf_box child = b->first_child; child != QTF_BOX_NONE; child = tree->boxes[child].next_sibling) {
+            if (!tree->boxes[child].removed) written += qtf_box_write(tree, child, dest + written);
+        }
+    }
+    else
+    {
+        memmove(dest + written, b->contents, (size_t)b->contents_length);
+        written += b->contents_length;
+    }
+    return written;
+}
+
+/*
+ *  qtf_context
+ *
+ *  qtf_context keeps the buffers, edit list, box trees and zlib streams used to flatten a movie so they can be reused
+ *  for the next. Buffers only ever grow.
+ */
+
+typedef struct qtf_buffer_s
+{
+    uint8_t *data;
+    size_t capacity;
+} qtf_buffer_s;
+
+/*
+ returns the buffer's data with room for at least length bytes, or NULL if it couldn't grow. The contents are not kept
+ when the buffer grows.
+ */
+static uint8_t *qtf_buffer_reserve(qtf_buffer_s *buffer, size_t length)
+{
+    if (buffer->capacity < length)
+    {
+        free(buffer->data);
+        buffer->data = malloc(length);
+        buffer->capacity = buffer->data ? length : 0;
+    }
+    return buffer->data;
+}
+
+static void qtf_buffer_swap(qtf_buffer_s *a, qtf_buffer_s *b)
+{
+    qtf_buffer_s temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+struct qtf_context
+{
+    qtf_buffer_s ftyp_buffer;
+    qtf_buffer_s moov_buffer; // the moov atom, as it will be written once prepared
+    qtf_buffer_s spare_buffer; // compressed moov atoms are built here before being swapped with moov_buffer
+    qtf_buffer_s atom_buffer; // other atoms being patched, and blocks of streamed atoms
+    qtf_edit_list_s edit_list;
+    qtf_extent_list_s extent_list; // the ranges of the source to copy, found by the last scan
+    qtf_box_tree_s moov_tree;
+    qtf_box_tree_s atom_tree;
+    qtf_zlib_s zlib;
+    struct qtf_flatten_s *flatten; // the flatten begun with qtf_flatten_begin(), if any
+    struct qtf_recorder_s *recorder; // the recording begun with qtf_record_begin(), if any
+};
+
+qtf_context *qtf_context_create(void)
+{
+    qtf_context *context = calloc(1, sizeof(qtf_context));
+    if (context)
+    {
+        qtf_edit_list_init(&context->edit_list);
+        qtf_extent_list_init(&context->extent_list);
+        qtf_box_tree_init(&context->moov_tree);
+        qtf_box_tree_init(&context->atom_tree);
+    }
+    return context;
+}
+
+void qtf_context_destroy(qtf_context *context)
+{
+    if (context)
+    {
+        free(context->ftyp_buffer.data);
+        free(context->moov_buffer.data);
+        free(context->spare_buffer.data);
+        free(context->atom_buffer.data);
+        free(context->edit_list.edits);
+        free(context->extent_list.extents);
+        qtf_box_tree_destroy(&context->moov_tree);
+        qtf_box_tree_destroy(&context->atom_tree);
+        qtf_zlib_destroy(&context->zlib);
+        free(context->flatten);
+        free(context->recorder);
+        free(context);
+    }
+}
+
+/*
+ writes the moov, cmov, dcom and cmvd headers (40 bytes) which precede compressed_data_length bytes of compressed data
+ */
+static void qtf_compressed_movie_atom_write_header(void *compressed_atom_buffer, size_t compressed_data_length, size_t atom_buffer_length)
+{
+    *(uint32_t *)compressed_atom_buffer = qtf_swap_host_to_big_int_32(compressed_data_length + 40);
+    *(uint32_t *)(compressed_atom_buffer + 4) = qtf_swap_host_to_big_int_32(QTF_FCC_moov);
+    *(uint32_t *)(compressed_atom_buffer + 8) = qtf_swap_host_to_big_int_32(compressed_data_length + 32);
+    *(uint32_t *)(compressed_atom_buffer + 12) = qtf_swap_host_to_big_int_32(QTF_FCC_cmov);
+    *(uint32_t *)(compressed_atom_buffer + 16) = qtf_swap_host_to_big_int_32(12);
+    *(uint32_t *)(compressed_atom_buffer + 20) = qtf_swap_host_to_big_int_32(QTF_FCC_dcom);
+    *(uint32_t *)(compressed_atom_buffer + 24) = qtf_swap_host_to_big_int_32(QTF_FCC_zlib);
+    *(uint32_t *)(compressed_atom_buffer + 28) = qtf_swap_host_to_big_int_32(compressed_data_length + 12);
+    *(uint32_t *)(compressed_atom_buffer + 32) = qtf_swap_host_to_big_int_32(QTF_FCC_cmvd);
+    *(uint32_t *)(compressed_atom_buffer + 36) = qtf_swap_host_to_big_int_32(atom_buffer_length);
+}
+
+// set as many try_ flags as you want, they will be tried sequentially until one works in the given buffer size
+// returns the size of the compressed atom on success, or 0 on failure
+static size_t qtf_compress_movie_atom(qtf_zlib_s *zlib, void *atom_buffer, size_t atom_buffer_length,
+                                      void *compressed_atom_buffer, size_t compressed_atom_buffer_length,
+                                      bool try_fast, bool try_default, bool try_best)
+{
+    // leave space for the compressed movie atoms (40 bytes)
+    size_t compressed_data_max_length = compressed_atom_buffer_length - 40;
+    void *compressed_data = compressed_atom_buffer + 40;
+    size_t compressed_data_length = 0;
+    if (try_fast)
+    {
+        compressed_data_length = qtf_compress_data(zlib, atom_buffer, atom_buffer_length, compressed_data, compressed_data_max_length, Z_BEST_SPEED);
+    }
+    if (try_default && compressed_data_length == 0)
+    {
+        compressed_data_length = qtf_compress_data(zlib, atom_buffer, atom_buffer_length, compressed_data, compressed_data_max_length, Z_DEFAULT_COMPRESSION);
+    }
+    if (try_best || compressed_data_length == 0)
+    {
+        compressed_data_length = qtf_compress_data(zlib, atom_buffer, atom_buffer_length, compressed_data, compressed_data_max_length, Z_BEST_COMPRESSION);
+    }
+    if (compressed_data_length != 0)
+    {
+        qtf_compressed_movie_atom_write_header(compressed_atom_buffer, compressed_data_length, atom_buffer_length);
+        compressed_data_length += 40;
+    }
+    return compressed_data_length;
+}
+
+/*
+ as qtf_compress_movie_atom(), compressing with qtf_compress_data_exhaustive() for up to time_limit_ms
+ */
+static size_t qtf_compress_movie_atom_exhaustive(void *atom_buffer, size_t atom_buffer_length,
+                                                 void *compressed_atom_buffer, size_t compressed_atom_buffer_length,
+                                                 unsigned int time_limit_ms)
+{
+    size_t compressed_data_length = qtf_compress_data_exhaustive(atom_buffer, atom_buffer_length,
+                                                                 compressed_atom_buffer + 40, compressed_atom_buffer_length - 40,
+                                                                 time_limit_ms);
+    if (compressed_data_length != 0)
+    {
+        qtf_compressed_movie_atom_write_header(compressed_atom_buffer, compressed_data_length, atom_buffer_length);
+        compressed_data_length += 40;
+    }
+    return compressed_data_length;
+}
+
+/*
+ returns true if an atom of size bytes can be written to space bytes, either filling it exactly or leaving room for the
+ header of a free atom after it
+ */
+static bool qtf_atom_fits(uint64_t size, uint64_t space)
+{
+    return space >= size + 8 || space == size;
+}
+
+/*
+ compresses the moov atom in atom_buffer into the context's spare buffer to fit space bytes, as an in-place flatten does:
+ with the fastest of the usual compression levels which fits, then if none does and effort_ms isn't 0, with up to
+ effort_ms of qtf_compress_data_exhaustive(). *out_compressed_size is set to the size of the compressed atom, or 0 if it
+ doesn't fit or the atom is already compressed. *out_compressed is left in the spare buffer
+ */
+static qtf_result qtf_compress_movie_atom_to_fit(qtf_context *context, void *atom_buffer, size_t atom_buffer_length, uint64_t space,
+                                                 unsigned int effort_ms, void **out_compressed, size_t *out_compressed_size)
+{
+    *out_compressed = NULL;
+    *out_compressed_size = 0;
+    // the space must hold the compressed atom's headers, and an atom is never compressed twice
+    if (space <= 40 || space > SIZE_MAX) return qtf_result_ok;
+    if (atom_buffer_length >= 16 && qtf_get_32((uint8_t *)atom_buffer + 12) == QTF_FCC_cmov) return qtf_result_ok;
+    
+    void *compressed = qtf_buffer_reserve(&context->spare_buffer, (size_t)space);
+    if (compressed == NULL) return qtf_result_memory_error;
+    size_t compressed_size = qtf_compress_movie_atom(&context->zlib, atom_buffer, atom_buffer_length, compressed, (size_t)space,
+                                                     true, true, true);
+    if (!(compressed_size != 0 && qtf_atom_fits(compressed_size, space)) && effort_ms != 0)
+    {
+        compressed_size = qtf_compress_movie_atom_exhaustive(atom_buffer, atom_buffer_length, compressed, (size_t)space, effort_ms);
+    }
+    if (compressed_size != 0 && qtf_atom_fits(compressed_size, space))
+    {
+        *out_compressed = compressed;
+        *out_compressed_size = compressed_size;
+    }
+    return qtf_result_ok;
+}
+
+/*
+ updates entry_count stco (entry_length 4) or co64 (entry_length 8) entries for the edits in edit_list. fails with
+ qtf_result_file_too_complex if a stco entry would no longer fit in 32 bits, as qtf_offsets_check_list() predicts
+ */
+static qtf_result qtf_offsets_apply_list_entries(uint8_t *entries, uint32_t entry_count, size_t entry_length, qtf_edit_list edit_list)
+{
+    if (entry_length == 4)
+    {
+        for (uint32_t j = 0; j < entry_count; j++) {
+            uint32_t *entry = (uint32_t *)(entries + (j * 4));
+            uint32_t current_offset = qtf_swap_big_to_host_int_32(*entry);
+            int64_t new_offset = (int64_t)current_offset + qtf_edit_list_get_offset_change(edit_list, current_offset);
+            if (new_offset < 0 || new_offset > UINT32_MAX) return qtf_result_file_too_complex;
+            *entry = qtf_swap_host_to_big_int_32((uint32_t)new_offset);
+        }
+    }
+    else
+    {
+        for (uint32_t j = 0; j < entry_count; j++) {
+            uint64_t *entry = (uint64_t *)(entries + (j * 8));
+            uint64_t current_offset = qtf_swap_big_to_host_int_64(*entry);
+            current_offset += qtf_edit_list_get_offset_change(edit_list, current_offset);
+            *entry = qtf_swap_host_to_big_int_64(current_offset);
+        }
+    }
+    return qtf_result_ok;
+}
+
+static qtf_result qtf_offsets_apply_list(qtf_box_tree_s *moov_tree, qtf_edit_list edit_list)
+{
+    qtf_result result = qtf_result_ok;
+    for (qtf_box trak = qtf_box_find(moov_tree, 0, QTF_FCC_trak); trak != QTF_BOX_NONE && result == qtf_result_ok; trak = qtf_box_next(moov_tree, trak)) {
+        qtf_box stbl = qtf_box_find_path(moov_tree, trak, "mdia/minf/stbl");
+        qtf_box stco = qtf_box_find(moov_tree, stbl, QTF_FCC_stco);
+        qtf_box co64 = qtf_box_find(moov_tree, stbl, QTF_FCC_co64);
+        if (stco != QTF_BOX_NONE)
+        {
+            uint8_t *contents = moov_tree->boxes[stco].contents;
+            uint64_t length = moov_tree->boxes[stco].contents_length;
+            uint32_t entry_count = length >= 8 ? qtf_get_32(contents + 4) : 0;
+            if (length < 8 || (uint64_t)entry_count * 4 > length - 8)
+            {
+                result = qtf_result_file_not_movie;
+                break;
+            }
+            result = qtf_offsets_apply_list_entries(contents + 8, entry_count, 4, edit_list);
+        }
+        if (co64 != QTF_BOX_NONE && result == qtf_result_ok)
+        {
+            uint8_t *contents = moov_tree->boxes[co64].contents;
+            uint64_t length = moov_tree->boxes[co64].contents_length;
+            uint32_t entry_count = length >= 8 ? qtf_get_32(contents + 4) : 0;
+            if (length < 8 || (uint64_t)entry_count * 8 > length - 8)
+            {
+                result = qtf_result_file_not_movie;
+                break;
+            }
+            result = qtf_offsets_apply_list_entries(contents + 8, entry_count, 8, edit_list);
+        }
+    }
+    return result;
+}
+
+static qtf_result qtf_offsets_modify(qtf_box_tree_s *moov_tree, ssize_t change)
+{
     // fake a qtf_edit_list with one edit at offset 0
-    qtf_edit_s edit = {0, change, NULL};
-    qtf_edit_s *edit_ptr = &edit;
+    qtf_edit_s edit = {0, change};
+    qtf_edit_list_s list = {&edit, 1, 1};
+    
+    return qtf_offsets_apply_list(moov_tree, &list);
+}
+
+/*
+ sets *out_overflow if applying the edits in edit_list would take any stco entry beyond 32 bits
+ */
+static qtf_result qtf_offsets_check_list(qtf_box_tree_s *moov_tree, qtf_edit_list edit_list, bool *out_overflow)
+{
+    *out_overflow = false;
+    for (qtf_box trak = qtf_box_find(moov_tree, 0, QTF_FCC_trak); trak != QTF_BOX_NONE; trak = qtf_box_next(moov_tree, trak)) {
+        qtf_box stco = qtf_box_find(moov_tree, qtf_box_find_path(moov_tree, trak, "mdia/minf/stbl"), QTF_FCC_stco);
+        if (stco == QTF_BOX_NONE) continue;
+        
+        uint8_t *contents = moov_tree->boxes[stco].contents;
+        uint64_t length = moov_tree->boxes[stco].contents_length;
+        uint32_t entry_count = length >= 8 ? qtf_get_32(contents + 4) : 0;
+        if (length < 8 || (uint64_t)entry_count * 4 > length - 8) return qtf_result_file_not_movie;
+        
+        for (uint32_t j = 0; j < entry_count; j++) {
+            uint32_t offset = qtf_get_32(contents + 8 + (j * 4));
+            int64_t new_offset = (int64_t)offset + qtf_edit_list_get_offset_change(edit_list, offset);
+            if (new_offset < 0 || new_offset > UINT32_MAX)
+            {
+                *out_overflow = true;
+                return qtf_result_ok;
+            }
+        }
+    }
+    return qtf_result_ok;
+}
+
+/*
+ *  Sample tables
+ *
+ *  qtf_track_s holds the sample tables of a track expanded to one entry per sample or chunk
+ */
+
+typedef struct qtf_track_s
+{
+    uint32_t track_id;
+    uint32_t timescale;
+    uint32_t sample_count;
+    uint32_t chunk_count;
+    uint32_t sample_description_index; // 0 if it varies between chunks
+    uint32_t *sample_sizes;
+    uint64_t *sample_offsets;
+    uint64_t *sample_decode_times; // sample_count + 1 entries, the last being the track's total duration
+    int32_t *sample_composition_offsets; // NULL if the track has no ctts atom
+    bool *sample_is_sync; // NULL if every sample is a sync sample
+    uint64_t *chunk_offsets;
+    uint32_t *chunk_first_samples; // chunk_count + 1 entries
+    uint8_t *chunk_offset_atom; // the stco or co64 atom in the moov atom the track was loaded from
+} qtf_track_s;
+
+/*
+ returns the entry count of a full atom table with entries of entry_length bytes, or -1 if the atom is too small for its count
+ */
+static int64_t qtf_table_entry_count(const uint8_t *atom, size_t atom_size, size_t header_length, size_t entry_length)
+{
+    if (atom_size < header_length) return -1;
+    uint32_t count = qtf_get_32(atom + header_length - 4);
+    if ((uint64_t)count * entry_length > atom_size - header_length) return -1;
+    return count;
+}
+
+static void qtf_track_destroy(qtf_track_s *track)
+{
+    free(track->sample_sizes);
+    free(track->sample_offsets);
+    free(track->sample_decode_times);
+    free(track->sample_composition_offsets);
+    free(track->sample_is_sync);
+    free(track->chunk_offsets);
+    free(track->chunk_first_samples);
+    memset(track, 0, sizeof(qtf_track_s));
+}
+
+static qtf_result qtf_track_load(qtf_box_tree_s *moov_tree, qtf_box trak, qtf_track_s *track)
+{
+    qtf_result result = qtf_result_ok;
+    size_t size = 0;
+    uint8_t *tkhd = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, trak, QTF_FCC_tkhd), &size);
+    uint8_t *mdhd = NULL;
+    qtf_box stbl = qtf_box_find_path(moov_tree, trak, "mdia/minf/stbl");
+    
+    memset(track, 0, sizeof(qtf_track_s));
+    
+    if (tkhd && size >= 32)
+    {
+        track->track_id = qtf_get_32(tkhd + (tkhd[8] == 1 ? 28 : 20));
+    }
+    mdhd = qtf_box_atom(moov_tree, qtf_box_find_path(moov_tree, trak, "mdia/mdhd"), &size);
+    if (mdhd && size >= 32)
+    {
+        track->timescale = qtf_get_32(mdhd + (mdhd[8] == 1 ? 28 : 20));
+    }
+    
+    if (tkhd == NULL || mdhd == NULL || stbl == QTF_BOX_NONE || track->timescale == 0)
+    {
+        return qtf_result_file_not_movie;
+    }
+    
+    size_t stsz_size = 0, stsc_size = 0, stco_size = 0, stts_size = 0, ctts_size = 0, stss_size = 0;
+    uint8_t *stsz = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, stbl, QTF_FCC_stsz), &stsz_size);
+    uint8_t *stsc = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, stbl, QTF_FCC_stsc), &stsc_size);
+    uint8_t *stts = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, stbl, QTF_FCC_stts), &stts_size);
+    uint8_t *ctts = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, stbl, QTF_FCC_ctts), &ctts_size);
+    uint8_t *stss = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, stbl, QTF_FCC_stss), &stss_size);
+    size_t chunk_offset_length = 4;
+    uint8_t *stco = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, stbl, QTF_FCC_stco), &stco_size);
+    if (stco == NULL)
+    {
+        stco = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, stbl, QTF_FCC_co64), &stco_size);
+        chunk_offset_length = 8;
+    }
+    
+    if (stsz == NULL || stsc == NULL || stts == NULL || stco == NULL)
+    {
+        // compact sample sizes (stz2) would land here too
+        return qtf_result_file_too_complex;
+    }
+    
+    // sample sizes
+    if (stsz_size < 20) return qtf_result_file_not_movie;
+    uint32_t constant_size = qtf_get_32(stsz + 12);
+    track->sample_count = qtf_get_32(stsz + 16);
+    if (constant_size == 0 && qtf_table_entry_count(stsz, stsz_size, 20, 4) == -1) return qtf_result_file_not_movie;
+    
+    int64_t chunk_count = qtf_table_entry_count(stco, stco_size, 16, chunk_offset_length);
+    int64_t stsc_count = qtf_table_entry_count(stsc, stsc_size, 16, 12);
+    int64_t stts_count = qtf_table_entry_count(stts, stts_size, 16, 8);
+    int64_t ctts_count = ctts ? qtf_table_entry_count(ctts, ctts_size, 16, 8) : 0;
+    int64_t stss_count = stss ? qtf_table_entry_count(stss, stss_size, 16, 4) : 0;
+    if (chunk_count == -1 || stsc_count == -1 || stts_count == -1 || ctts_count == -1 || stss_count == -1)
+    {
+        return qtf_result_file_not_movie;
+    }
+    track->chunk_count = (uint32_t)chunk_count;
+    track->chunk_offset_atom = stco;
+    
+    track->sample_sizes = malloc(sizeof(uint32_t) * ((size_t)track->sample_count + 1));
+    track->sample_offsets = malloc(sizeof(uint64_t) * ((size_t)track->sample_count + 1));
+    track->sample_decode_times = malloc(sizeof(uint64_t) * ((size_t)track->sample_count + 1));
+    track->chunk_offsets = malloc(sizeof(uint64_t) * ((size_t)track->chunk_count + 1));
+    track->chunk_first_samples = malloc(sizeof(uint32_t) * ((size_t)track->chunk_count + 1));
+    if (ctts) track->sample_composition_offsets = malloc(sizeof(int32_t) * ((size_t)track->sample_count + 1));
+    if (stss) track->sample_is_sync = calloc((size_t)track->sample_count + 1, sizeof(bool));
+    
+    if (track->sample_sizes == NULL || track->sample_offsets == NULL || track->sample_decode_times == NULL
+        || track->chunk_offsets == NULL || track->chunk_first_samples == NULL
+        || (ctts && track->sample_composition_offsets == NULL) || (stss && track->sample_is_sync == NULL))
+    {
+        result = qtf_result_memory_error;
+    }
+    
+    if (result == qtf_result_ok)
+    {
+        for (uint32_t i = 0; i < track->sample_count; i++) {
+            track->sample_sizes[i] = constant_size ? constant_size : qtf_get_32(stsz + 20 + (i * 4));
+        }
+        for (uint32_t i = 0; i < track->chunk_count; i++) {
+            if (chunk_offset_length == 4) track->chunk_offsets[i] = qtf_get_32(stco + 16 + (i * 4));
+            else track->chunk_offsets[i] = qtf_get_64(stco + 16 + (i * 8));
+        }
+        
+        // expand the sample-to-chunk runs to the first sample of each chunk
+        uint32_t sample = 0;
+        uint32_t chunk = 0;
+        for (uint32_t i = 0; i < stsc_count && result == qtf_result_ok; i++) {
+            uint32_t first_chunk = qtf_get_32(stsc + 16 + (i * 12));
+            uint32_t samples_per_chunk = qtf_get_32(stsc + 20 + (i * 12));
+            uint32_t description_index = qtf_get_32(stsc + 24 + (i * 12));
+            uint32_t last_chunk = (i + 1 < stsc_count) ? qtf_get_32(stsc + 28 + (i * 12)) - 1 : track->chunk_count;
+            if (first_chunk != chunk + 1 || last_chunk < chunk || last_chunk > track->chunk_count)
+            {
+                result = qtf_result_file_not_movie;
+            }
+            if (i == 0) track->sample_description_index = description_index;
+            else if (description_index != track->sample_description_index) track->sample_description_index = 0;
+            for (; chunk < last_chunk && result == qtf_result_ok; chunk++) {
+                if ((uint64_t)sample + samples_per_chunk > track->sample_count)
+                {
+                    result = qtf_result_file_not_movie;
+                    break;
+                }
+                track->chunk_first_samples[chunk] = sample;
+                uint64_t offset = track->chunk_offsets[chunk];
+                for (uint32_t j = 0; j < samples_per_chunk; j++) {
+                    track->sample_offsets[sample] = offset;
+                    offset += track->sample_sizes[sample];
+                    sample++;
+                }
+            }
+        }
+        if (result == qtf_result_ok && (chunk != track->chunk_count || sample != track->sample_count))
+        {
+            result = qtf_result_file_not_movie;
+        }
+        track->chunk_first_samples[track->chunk_count] = sample;
+    }
+    if (result == qtf_result_ok)
+    {
+        // expand the time-to-sample runs
+        uint32_t sample = 0;
+        uint64_t time = 0;
+        for (uint32_t i = 0; i < stts_count; i++) {
+            uint32_t count = qtf_get_32(stts + 16 + (i * 8));
+            uint32_t duration = qtf_get_32(stts + 20 + (i * 8));
+            for (uint32_t j = 0; j < count && sample < track->sample_count; j++) {
+                track->sample_decode_times[sample++] = time;
+                time += duration;
+            }
+        }
+        if (sample != track->sample_count) result = qtf_result_file_not_movie;
+        track->sample_decode_times[track->sample_count] = time;
+    }
+    if (result == qtf_result_ok && ctts)
+    {
+        uint32_t sample = 0;
+        for (uint32_t i = 0; i < ctts_count; i++) {
+            uint32_t count = qtf_get_32(ctts + 16 + (i * 8));
+            int32_t composition_offset = (int32_t)qtf_get_32(ctts + 20 + (i * 8));
+            for (uint32_t j = 0; j < count && sample < track->sample_count; j++) {
+                track->sample_composition_offsets[sample++] = composition_offset;
+            }
+        }
+        if (sample != track->sample_count) result = qtf_result_file_not_movie;
+    }
+    if (result == qtf_result_ok && stss)
+    {
+        for (uint32_t i = 0; i < stss_count; i++) {
+            uint32_t sample_number = qtf_get_32(stss + 16 + (i * 4));
+            if (sample_number == 0 || sample_number > track->sample_count)
+            {
+                result = qtf_result_file_not_movie;
+                break;
+            }
+            track->sample_is_sync[sample_number - 1] = true;
+        }
+    }
+    if (result != qtf_result_ok)
+    {
+        qtf_track_destroy(track);
+    }
+    return result;
+}
+
+static void qtf_tracks_destroy(qtf_track_s *tracks, uint32_t track_count)
+{
+    if (tracks)
+    {
+        for (uint32_t i = 0; i < track_count; i++) {
+            qtf_track_destroy(&tracks[i]);
+        }
+        free(tracks);
+    }
+}
+
+/*
+ loads the sample tables of every track in a parsed moov atom
+ */
+static qtf_result qtf_tracks_load(qtf_box_tree_s *moov_tree, qtf_track_s **out_tracks, uint32_t *out_track_count)
+{
+    qtf_result result = qtf_result_ok;
+    uint32_t track_count = 0;
+    qtf_track_s *tracks = NULL;
+    
+    for (qtf_box trak = qtf_box_find(moov_tree, 0, QTF_FCC_trak); trak != QTF_BOX_NONE; trak = qtf_box_next(moov_tree, trak)) {
+        track_count++;
+    }
+    if (track_count == 0) return qtf_result_file_too_complex;
+    
+    tracks = calloc(track_count, sizeof(qtf_track_s));
+    if (tracks == NULL) return qtf_result_memory_error;
+    
+    uint32_t loaded = 0;
+    for (qtf_box trak = qtf_box_find(moov_tree, 0, QTF_FCC_trak); trak != QTF_BOX_NONE && result == qtf_result_ok; trak = qtf_box_next(moov_tree, trak)) {
+        result = qtf_track_load(moov_tree, trak, &tracks[loaded]);
+        if (result == qtf_result_ok) loaded++;
+    }
+    if (result == qtf_result_ok)
+    {
+        *out_tracks = tracks;
+        *out_track_count = track_count;
+    }
+    else
+    {
+        qtf_tracks_destroy(tracks, loaded);
+    }
+    return result;
+}
+
+/*
+ fragmented movies carry absolute offsets outside the moov atom: the base_data_offset of tfhd atoms in moof atoms and the
+ moof_offset of tfra entries in the mfra atom. sidx atoms hold sizes and an offset relative to their own end, which change
+ if atoms inside the ranges they describe are removed.
+ */
+
+// ISO IEC 14496-12 Section 8.8.7, Track Fragment Header Box
+#define QTF_TFHD_BASE_DATA_OFFSET_PRESENT (0x000001)
+#define QTF_TFHD_SAMPLE_DESCRIPTION_INDEX_PRESENT (0x000002)
+#define QTF_TFHD_DEFAULT_SAMPLE_DURATION_PRESENT (0x000008)
+#define QTF_TFHD_DEFAULT_SAMPLE_SIZE_PRESENT (0x000010)
+#define QTF_TFHD_DEFAULT_BASE_IS_MOOF (0x020000)
+// ISO IEC 14496-12 Section 8.8.8, Track Fragment Run Box
+#define QTF_TRUN_DATA_OFFSET_PRESENT (0x000001)
+#define QTF_TRUN_FIRST_SAMPLE_FLAGS_PRESENT (0x000004)
+#define QTF_TRUN_SAMPLE_DURATION_PRESENT (0x000100)
+#define QTF_TRUN_SAMPLE_SIZE_PRESENT (0x000200)
+#define QTF_TRUN_SAMPLE_FLAGS_PRESENT (0x000400)
+#define QTF_TRUN_SAMPLE_COMPOSITION_TIME_OFFSETS_PRESENT (0x000800)
+
+typedef struct qtf_trex_s
+{
+    uint32_t track_id;
+    uint32_t default_sample_size;
+} qtf_trex_s;
+
+/*
+ loads the track extends defaults from an mvex box, setting *out_trex to NULL if there are none
+ */
+static qtf_result qtf_trex_load(qtf_box_tree_s *moov_tree, qtf_box mvex, qtf_trex_s **out_trex, uint32_t *out_trex_count)
+{
+    uint32_t count = 0;
+    
+    *out_trex = NULL;
+    *out_trex_count = 0;
+    if (mvex == QTF_BOX_NONE) return qtf_result_ok;
+    
+    for (qtf_box trex = qtf_box_find(moov_tree, mvex, QTF_FCC_trex); trex != QTF_BOX_NONE; trex = qtf_box_next(moov_tree, trex)) {
+        count++;
+    }
+    qtf_trex_s *trex_defaults = malloc(sizeof(qtf_trex_s) * (count + 1));
+    if (trex_defaults == NULL) return qtf_result_memory_error;
+    
+    count = 0;
+    for (qtf_box trex = qtf_box_find(moov_tree, mvex, QTF_FCC_trex); trex != QTF_BOX_NONE; trex = qtf_box_next(moov_tree, trex)) {
+        size_t size = 0;
+        uint8_t *atom = qtf_box_atom(moov_tree, trex, &size);
+        if (size >= 32)
+        {
+            trex_defaults[count].track_id = qtf_get_32(atom + 12);
+            trex_defaults[count].default_sample_size = qtf_get_32(atom + 24);
+            count++;
+        }
+    }
+    *out_trex = trex_defaults;
+    *out_trex_count = count;
+    return qtf_result_ok;
+}
+
+/*
+ moof_tree is used to parse the moof atom, so one tree can be reused for every moof atom of a movie
+ */
+static qtf_result qtf_offsets_apply_list_moof(qtf_box_tree_s *moof_tree, uint8_t *moof_atom, size_t moof_atom_size, off_t moof_offset,
+                                              qtf_edit_list edit_list, const qtf_trex_s *trex, uint32_t trex_count)
+{
+    // where the data described by the previous run ended, for runs and trafs which continue from it
+    uint64_t data_end = moof_offset;
+    bool first_traf = true;
+    
+    qtf_result result = qtf_box_tree_parse(moof_tree, moof_atom, moof_atom_size);
+    if (result != qtf_result_ok) return result;
+    
+    for (qtf_box traf = qtf_box_find(moof_tree, 0, QTF_FCC_traf); traf != QTF_BOX_NONE; traf = qtf_box_next(moof_tree, traf)) {
+        size_t tfhd_size = 0;
+        uint8_t *tfhd = qtf_box_atom(moof_tree, qtf_box_find(moof_tree, traf, QTF_FCC_tfhd), &tfhd_size);
+        if (tfhd == NULL || tfhd_size < 16) return qtf_result_file_not_movie;
+        
+        uint32_t tfhd_flags = qtf_get_32(tfhd + 8) & 0xFFFFFF;
+        uint32_t track_id = qtf_get_32(tfhd + 12);
+        size_t field = 16;
+        uint64_t base;
+        uint32_t default_sample_size = 0;
+        
+        for (uint32_t t = 0; t < trex_count; t++) {
+            if (trex[t].track_id == track_id) default_sample_size = trex[t].default_sample_size;
+        }
+        if (tfhd_flags & QTF_TFHD_BASE_DATA_OFFSET_PRESENT)
+        {
+            if (tfhd_size < field + 8) return qtf_result_file_not_movie;
+            base = qtf_get_64(tfhd + field);
+            qtf_put_64(tfhd + field, base + qtf_edit_list_get_offset_change(edit_list, base));
+            field += 8;
+        }
+        else if ((tfhd_flags & QTF_TFHD_DEFAULT_BASE_IS_MOOF) || first_traf)
+        {
+            base = moof_offset;
+        }
+        else
+        {
+            base = data_end;
+        }
+        if (tfhd_flags & QTF_TFHD_SAMPLE_DESCRIPTION_INDEX_PRESENT) field += 4;
+        if (tfhd_flags & QTF_TFHD_DEFAULT_SAMPLE_DURATION_PRESENT) field += 4;
+        if (tfhd_flags & QTF_TFHD_DEFAULT_SAMPLE_SIZE_PRESENT)
+        {
+            if (tfhd_size < field + 4) return qtf_result_file_not_movie;
+            default_sample_size = qtf_get_32(tfhd + field);
+        }
+        
+        data_end = base;
+        for (qtf_box trun_box = qtf_box_find(moof_tree, traf, QTF_FCC_trun); trun_box != QTF_BOX_NONE; trun_box = qtf_box_next(moof_tree, trun_box)) {
+            size_t size = 0;
+            uint8_t *trun = qtf_box_atom(moof_tree, trun_box, &size);
+            if (size < 16) return qtf_result_file_not_movie;
+            uint32_t trun_flags = qtf_get_32(trun + 8) & 0xFFFFFF;
+            uint32_t sample_count = qtf_get_32(trun + 12);
+            size_t entry_length = 0;
+            size_t entries_start = 16;
+            uint64_t run_start = data_end;
+            
+            if (trun_flags & QTF_TRUN_DATA_OFFSET_PRESENT)
+            {
+                if (size < 20) return qtf_result_file_not_movie;
+                int32_t data_offset = (int32_t)qtf_get_32(trun + 16);
+                run_start = base + data_offset;
+                int64_t new_data_offset = (int64_t)data_offset
+                    + qtf_edit_list_get_offset_change(edit_list, run_start)
+                    - qtf_edit_list_get_offset_change(edit_list, base);
+                if (new_data_offset > INT32_MAX || new_data_offset < INT32_MIN) return qtf_result_file_too_complex;
+                qtf_put_32(trun + 16, (uint32_t)(int32_t)new_data_offset);
+                entries_start += 4;
+            }
+            if (trun_flags & QTF_TRUN_FIRST_SAMPLE_FLAGS_PRESENT) entries_start += 4;
+            if (trun_flags & QTF_TRUN_SAMPLE_DURATION_PRESENT) entry_length += 4;
+            size_t size_field = entry_length;
+            if (trun_flags & QTF_TRUN_SAMPLE_SIZE_PRESENT) entry_length += 4;
+            if (trun_flags & QTF_TRUN_SAMPLE_FLAGS_PRESENT) entry_length += 4;
+            if (trun_flags & QTF_TRUN_SAMPLE_COMPOSITION_TIME_OFFSETS_PRESENT) entry_length += 4;
+            if (entries_start > size || (uint64_t)sample_count * entry_length > size - entries_start) return qtf_result_file_not_movie;
+            
+            // find the end of the run's data, for any following run or traf which continues from it
+            uint64_t run_length = 0;
+            if (trun_flags & QTF_TRUN_SAMPLE_SIZE_PRESENT)
+            {
+                for (uint32_t s = 0; s < sample_count; s++) {
+                    run_length += qtf_get_32(trun + entries_start + (s * entry_length) + size_field);
+                }
+            }
+            else
+            {
+                run_length = (uint64_t)sample_count * default_sample_size;
+            }
+            data_end = run_start + run_length;
+        }
+        first_traf = false;
+    }
+    return qtf_result_ok;
+}
+
+static qtf_result qtf_offsets_apply_list_sidx(uint8_t *sidx_atom, size_t sidx_atom_size, off_t sidx_offset, qtf_edit_list edit_list)
+{
+    if (sidx_atom_size < 32) return qtf_result_file_not_movie;
+    
+    uint8_t *sidx = sidx_atom;
+    bool version_1 = sidx[8] == 1;
+    size_t field = version_1 ? 28 : 24; // first_offset
+    size_t references_start = field + (version_1 ? 8 : 4) + 4;
+    if (references_start > sidx_atom_size) return qtf_result_file_not_movie;
+    
+    uint64_t first_offset = version_1 ? qtf_get_64(sidx + field) : qtf_get_32(sidx + field);
+    uint32_t reference_count = qtf_get_32(sidx + references_start - 4) & 0xFFFF;
+    if ((uint64_t)reference_count * 12 > sidx_atom_size - references_start) return qtf_result_file_not_movie;
+    
+    // offsets are relative to the first byte after the sidx atom
+    uint64_t anchor = sidx_offset + sidx_atom_size;
+    uint64_t new_first_offset = first_offset + qtf_edit_list_get_range_change(edit_list, anchor, anchor + first_offset);
+    if (version_1)
+    {
+        qtf_put_64(sidx + field, new_first_offset);
+    }
+    else if (new_first_offset > UINT32_MAX)
+    {
+        return qtf_result_file_too_complex;
+    }
+    else
+    {
+        qtf_put_32(sidx + field, (uint32_t)new_first_offset);
+    }
+    
+    // the referenced ranges are consecutive, each loses whatever is removed from inside it
+    uint64_t start = anchor + first_offset;
+    for (uint32_t i = 0; i < reference_count; i++) {
+        uint8_t *reference = sidx + references_start + (i * 12);
+        uint32_t value = qtf_get_32(reference);
+        uint64_t referenced_size = value & 0x7FFFFFFF;
+        int64_t new_referenced_size = referenced_size + qtf_edit_list_get_range_change(edit_list, start, start + referenced_size);
+        if (new_referenced_size < 0 || new_referenced_size > 0x7FFFFFFF) return qtf_result_file_too_complex;
+        qtf_put_32(reference, (value & 0x80000000) | (uint32_t)new_referenced_size);
+        start += referenced_size;
+    }
+    return qtf_result_ok;
+}
+
+static qtf_result qtf_offsets_apply_list_mfra(qtf_box_tree_s *mfra_tree, uint8_t *mfra_atom, size_t mfra_atom_size, qtf_edit_list edit_list)
+{
+    qtf_result result = qtf_box_tree_parse(mfra_tree, mfra_atom, mfra_atom_size);
+    if (result != qtf_result_ok) return result;
+    
+    for (qtf_box tfra_box = qtf_box_find(mfra_tree, 0, QTF_FCC_tfra); tfra_box != QTF_BOX_NONE; tfra_box = qtf_box_next(mfra_tree, tfra_box)) {
+        size_t size = 0;
+        uint8_t *tfra = qtf_box_atom(mfra_tree, tfra_box, &size);
+        if (size < 24) return qtf_result_file_not_movie;
+        bool version_1 = tfra[8] == 1;
+        uint32_t lengths = qtf_get_32(tfra + 16);
+        uint32_t entry_count = qtf_get_32(tfra + 20);
+        size_t time_length = version_1 ? 8 : 4;
+        size_t entry_length = (time_length * 2) + ((lengths >> 4) & 3) + ((lengths >> 2) & 3) + (lengths & 3) + 3;
+        if ((uint64_t)entry_count * entry_length > size - 24) return qtf_result_file_not_movie;
+        for (uint32_t j = 0; j < entry_count; j++) {
+            uint8_t *moof_offset = tfra + 24 + (j * entry_length) + time_length;
+            if (version_1)
+            {
+                uint64_t offset = qtf_get_64(moof_offset);
+                qtf_put_64(moof_offset, offset + qtf_edit_list_get_offset_change(edit_list, offset));
+            }
+            else
+            {
+                uint64_t offset = qtf_get_32(moof_offset);
+                offset += qtf_edit_list_get_offset_change(edit_list, offset);
+                if (offset > UINT32_MAX) return qtf_result_file_too_complex;
+                qtf_put_32(moof_offset, (uint32_t)offset);
+            }
+        }
+    }
+    return qtf_result_ok;
+}
+
+/*
+ *  Movie loading
+ */
+
+static int qtf_open_for_reading(const char *path)
+{
+#if defined(_WIN32)
+    return _open(path, _O_RDONLY | _O_BINARY);
+#else
+    return open(path, O_RDONLY);
+#endif
+}
+
+/*
+ creates a new file, failing if the file already exists
+ */
+static int qtf_open_for_writing(const char *path)
+{
+#if defined(_WIN32)
+    return _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_EXCL,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); // RW owner, R group, R others
+#endif
+}
+
+/*
+ reads the remainder of an ftyp atom whose header has already been read into atom_header and checks it is compatible
+ on success *out_ftyp is the entire atom, held in buffer
+ */
+static qtf_result qtf_load_ftyp_atom(int fd, const void *atom_header, size_t bytes_read, qtf_atom_size size, qtf_buffer_s *buffer, void **out_ftyp)
+{
+    qtf_result result = qtf_result_ok;
+    void *atom_ftyp = NULL;
+    qtf_atom_size atom_ftyp_size = 0;
+    
+    if (bytes_read != 8 || size < 20) result = qtf_result_file_not_movie; // minimally useful size 20 bytes: atom header(8) + major brand(4) + version(4) + 1 compatible brand(4)
+    
+    if (result == qtf_result_ok)
+    {
+        // We can only work with the atom if we can load it all in memory, fail otherwise
+        if (size <= SIZE_MAX)
+        {
+            atom_ftyp_size = size;
+            atom_ftyp = qtf_buffer_reserve(buffer, (size_t)atom_ftyp_size);
+        }
+        if (atom_ftyp == NULL)
+        {
+            result = qtf_result_memory_error;
+        }
+    }
+    if (result == qtf_result_ok)
+    {
+        // copy what we already read
+        memcpy(atom_ftyp, atom_header, bytes_read);
+        // read the rest
+        result = qtf_read(fd, atom_ftyp + bytes_read, (size_t)atom_ftyp_size - bytes_read);
+    }
+    if (result == qtf_result_ok)
+    {
+        // Check for compatibility
+        unsigned long brand_count = ((size_t)atom_ftyp_size - 16) / 4;
+        bool has_qt_or_mp4 = false;
+        for (unsigned long i = 0; i < brand_count; i++) {
+            uint32_t brand = qtf_swap_big_to_host_int_32(*(uint32_t *)(atom_ftyp + 16 + (i * 4)));
+            if (brand == QTF_FCC_qt__ || brand == QTF_FCC_mp41 || brand == QTF_FCC_mp42)
+            {
+                has_qt_or_mp4 = true;
+                break;
+            }
+        }
+        if (!has_qt_or_mp4) result = qtf_result_file_not_movie;
+    }
+    if (result == qtf_result_ok)
+    {
+        *out_ftyp = atom_ftyp;
+    }
+    return result;
+}
+
+/*
+ decompresses the moov atom in the context's moov buffer if it holds a cmov atom, in which case *io_moov and
+ *io_moov_size are updated for the decompressed atom, which is left in the context's moov buffer. if size_limit is not
+ 0 and the decompressed atom would be larger, fails with qtf_result_file_too_complex before allocating any memory for it
+ */
+static qtf_result qtf_decompress_movie_atom(qtf_context *context, void **io_moov, qtf_atom_size *io_moov_size,
+                                            qtf_atom_size size_limit)
+{
+    qtf_result result = qtf_result_ok;
+    uint8_t *atom_moov = *io_moov;
+    qtf_atom_size atom_moov_size = *io_moov_size;
+    size_t header_length = (atom_moov_size >= 16 && qtf_get_32(atom_moov) == 1) ? 16 : 8;
+    
+    // check if the atom is compressed
+    // QTFF Chapter 2, Compressed Movie Resources
+    if (atom_moov_size < header_length + 8 || qtf_get_32(atom_moov + header_length + 4) != QTF_FCC_cmov) return qtf_result_ok;
+    
+    qtf_box_tree_s *moov_tree = &context->moov_tree;
+    qtf_box dcom = QTF_BOX_NONE;
+    qtf_box cmvd = QTF_BOX_NONE;
+    uint32_t decompressed_size = 0;
+    
+    result = qtf_box_tree_parse(moov_tree, atom_moov, atom_moov_size);
+    if (result == qtf_result_ok)
+    {
+        // a dcom atom with the 4 byte compression type, followed by a cmvd atom with the 4 byte decompressed size
+        dcom = moov_tree->boxes[moov_tree->boxes[0].first_child].first_child;
+        if (dcom != QTF_BOX_NONE) cmvd = moov_tree->boxes[dcom].next_sibling;
+        if (dcom == QTF_BOX_NONE || moov_tree->boxes[dcom].type != QTF_FCC_dcom || moov_tree->boxes[dcom].contents_length != 4
+            || cmvd == QTF_BOX_NONE || moov_tree->boxes[cmvd].type != QTF_FCC_cmvd || moov_tree->boxes[cmvd].contents_length < 4)
+        {
+            result = qtf_result_file_not_movie;
+        }
+    }
+    if (result == qtf_result_ok && qtf_get_32(moov_tree->boxes[dcom].contents) != QTF_FCC_zlib)
+    {
+        result = qtf_result_file_too_complex;
+    }
+    if (result == qtf_result_ok)
+    {
+        decompressed_size = qtf_get_32(moov_tree->boxes[cmvd].contents);
+        if (decompressed_size == 0) result = qtf_result_file_not_movie;
+        else if (size_limit != 0 && decompressed_size > size_limit) result = qtf_result_file_too_complex;
+    }
+    if (result == qtf_result_ok)
+    {
+        void *atom_moov_decompressed = qtf_buffer_reserve(&context->spare_buffer, decompressed_size);
+        if (atom_moov_decompressed == NULL) result = qtf_result_memory_error;
+        if (result == qtf_result_ok)
+        {
+            size_t actuallly_decompressed = qtf_decompress_data(&context->zlib, moov_tree->boxes[cmvd].contents + 4,
+                                                                (size_t)moov_tree->boxes[cmvd].contents_length - 4,
+                                                                atom_moov_decompressed, decompressed_size);
+            
+            if (actuallly_decompressed != decompressed_size) result = qtf_result_file_not_movie;
+            else
+            {
+                qtf_buffer_swap(&context->moov_buffer, &context->spare_buffer);
+                *io_moov = atom_moov_decompressed;
+                *io_moov_size = decompressed_size;
+            }
+        }
+    }
+    return result;
+}
+
+/*
+ reads the size byte moov atom at offset in fd into the context's moov buffer, decompressing it if it is compressed
+ */
+static qtf_result qtf_load_movie_atom(qtf_context *context, int fd, off_t offset, qtf_atom_size size, void **out_moov, qtf_atom_size *out_moov_size)
+{
+    qtf_result result = qtf_result_ok;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = size;
+    
+    // We can only work with the atom if we can load it all in memory, fail otherwise
+    if (size <= SIZE_MAX) atom_moov = qtf_buffer_reserve(&context->moov_buffer, (size_t)size);
+    if (atom_moov == NULL) result = qtf_result_memory_error;
+    
+    if (result == qtf_result_ok && lseek(fd, offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+    if (result == qtf_result_ok) result = qtf_read(fd, atom_moov, (size_t)size);
+    if (result == qtf_result_ok) result = qtf_decompress_movie_atom(context, &atom_moov, &atom_moov_size, 0);
+    if (result == qtf_result_ok)
+    {
+        *out_moov = atom_moov;
+        *out_moov_size = atom_moov_size;
+    }
+    return result;
+}
+
+/*
+ qtf_scan_s holds the progress of a scan of the top-level atoms of a movie, which is done one atom at a time
+ */
+typedef struct qtf_scan_s
+{
+    off_t offset; // of the next atom
+    qtf_atom_size moov_memory_limit;
+    void *ftyp; // in the context's ftyp buffer, or NULL
+    qtf_atom_size ftyp_size;
+    off_t moov_offset; // of the first moov atom
+    qtf_atom_size moov_size; // 0 until a moov atom is found
+    qtf_atom_size moov_padding; // the size of a free atom directly following the first moov atom, or 0
+    bool moov_streamed; // the moov atom is uncompressed and larger than moov_memory_limit (if it isn't 0)
+    bool mdat_present;
+    unsigned int relocate_atoms; // qtf_relocate flags for the atoms to move to follow the moov atom
+    qtf_atom_size relocated_size; // the total size of the atoms to move
+    bool done;
+} qtf_scan_s;
+
+static void qtf_scan_init(qtf_scan_s *scan, qtf_atom_size moov_memory_limit)
+{
+    memset(scan, 0, sizeof(qtf_scan_s));
+    scan->moov_memory_limit = moov_memory_limit;
+}
+
+/*
+ returns true if relocate_atoms (qtf_relocate flags) selects top-level atoms of type
+ */
+static bool qtf_relocates(unsigned int relocate_atoms, uint32_t type)
+{
+    return (type == QTF_FCC_udta && (relocate_atoms & qtf_relocate_udta))
+        || (type == QTF_FCC_meta && (relocate_atoms & qtf_relocate_meta))
+        || (type == QTF_FCC_uuid && (relocate_atoms & qtf_relocate_uuid));
+}
+
+/*
+ reads the top-level atom at scan->offset in fd, loading it into the context's ftyp buffer if it is the ftyp atom. edits are
+ added to edit_list (which may be NULL) to remove the moov atom(s), any free, skip or wide atoms and any atoms selected by
+ scan->relocate_atoms, and every other atom after the ftyp atom is added to extent_list (which may also be NULL). The number
+ of bytes read is added to *io_bytes_read. scan->done is set once the end of the file is reached and the movie found usable.
+ */
+static qtf_result qtf_scan_next_atom(qtf_context *context, qtf_scan_s *scan, int fd, qtf_edit_list edit_list, qtf_extent_list extent_list,
+                                     size_t *io_bytes_read)
+{
+    qtf_result result = qtf_result_ok;
+    uint32_t atom_header[4];
+    qtf_atom_size size = 0;
+    uint32_t type = 0;
+    size_t bytes_read = 0;
+    
+    if (lseek(fd, scan->offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+    if (result == qtf_result_ok) result = qtf_read_atom_header(fd, atom_header, sizeof(atom_header), &type, &size, &bytes_read);
+    if (result != qtf_result_ok) return result;
+    *io_bytes_read += bytes_read;
+    
+    if (bytes_read == 0)
+    {
+        // check we can do something with this file
+        if (scan->mdat_present == false || scan->moov_size == 0) result = qtf_result_file_too_complex;
+        scan->done = true;
+        return result;
+    }
+    
+    switch (type) {
+        case QTF_FCC_ftyp:
+            // QTFF Chapter 1, The File Type Compatibility Atom
+            // ISO IEC 14496-14 Section 4, File Identification
+            // TODO: could drop 0x0 compatibility atoms (save 3 bytes from QT-built files, woo)
+            if (scan->ftyp_size != 0)
+            {
+                result = qtf_result_file_not_movie; // there must be only one ftyp atom
+            }
+            else if (scan->offset != 0)
+            {
+                // This is lazy but most files have their ftyp atom first
+                result = qtf_result_file_too_complex;
+            }
+            else if (scan->mdat_present == true || scan->moov_size != 0)
+            {
+                // The ftyp atom must precede the moov atom and movie data
+                result = qtf_result_file_not_movie;
+            }
+            else
+            {
+                result = qtf_load_ftyp_atom(fd, atom_header, bytes_read, size, &context->ftyp_buffer, &scan->ftyp);
+                if (result == qtf_result_ok)
+                {
+                    scan->ftyp_size = size;
+                    *io_bytes_read += (size_t)size - bytes_read;
+                }
+            }
+            break;
+        case QTF_FCC_moov:
+            // remove the atom from the file in its current location, we will add it again later
+            result = qtf_edit_list_add_edit(edit_list, scan->offset, -(ssize_t)size);
+            // there should only be one of these, we discard any others
+            if (result == qtf_result_ok && scan->moov_size == 0 && scan->moov_memory_limit != 0 && size > scan->moov_memory_limit)
+            {
+                // check the first child to see if the atom is compressed, compressed atoms are always loaded
+                uint32_t child_header[4];
+                qtf_atom_size child_size = 0;
+                uint32_t child_type = 0;
+                size_t child_bytes_read = 0;
+                result = qtf_read_atom_header(fd, child_header, sizeof(child_header), &child_type, &child_size, &child_bytes_read);
+                *io_bytes_read += child_bytes_read;
+                if (result == qtf_result_ok && child_type != QTF_FCC_cmov) scan->moov_streamed = true;
+            }
+            if (result == qtf_result_ok && scan->moov_size == 0)
+            {
+                scan->moov_offset = scan->offset;
+                scan->moov_size = size;
+            }
+            break;
+        case QTF_FCC_free:
+        case QTF_FCC_skip:
+        case QTF_FCC_wide:
+            result = qtf_edit_list_add_edit(edit_list, scan->offset, -size);
+            if (type == QTF_FCC_free && scan->moov_size != 0 && scan->offset == scan->moov_offset + (off_t)scan->moov_size)
+            {
+                scan->moov_padding = size;
+            }
+            break;
+        case QTF_FCC_mdat:
+            scan->mdat_present = true;
+            if (!qtf_extent_list_add_atom(extent_list, scan->offset, size, qtf_extent_copy, type)) result = qtf_result_memory_error;
+            break;
+        case QTF_FCC_moof:
+        case QTF_FCC_sidx:
+        case QTF_FCC_mfra:
+            if (!qtf_extent_list_add_atom(extent_list, scan->offset, size, qtf_extent_patch, type)) result = qtf_result_memory_error;
+            break;
+        default:
+            if (qtf_relocates(scan->relocate_atoms, type))
+            {
+                // removed here and added again after the moov atom
+                result = qtf_edit_list_add_edit(edit_list, scan->offset, -size);
+                scan->relocated_size += size;
+                if (result == qtf_result_ok && !qtf_extent_list_add_atom(extent_list, scan->offset, size, qtf_extent_relocate, type))
+                {
+                    result = qtf_result_memory_error;
+                }
+            }
+            else if (!qtf_extent_list_add_atom(extent_list, scan->offset, size, qtf_extent_copy, type))
+            {
+                result = qtf_result_memory_error;
+            }
+            break;
+    }
+    if (result == qtf_result_ok) scan->offset += size;
+    return result;
+}
+
+/*
+ scans the top-level atoms of the movie in fd from the start of the file, loading the ftyp atom (if present) and the first
+ moov atom into the context's buffers. edits are added to edit_list (which may be NULL) to remove the moov atom(s) and any
+ free, skip or wide atoms, and the atoms to copy are added to extent_list (which may also be NULL).
+ on success *out_moov is set unless the moov atom is uncompressed and larger than moov_memory_limit (if it isn't 0), in
+ which case it is left in the file at *out_moov_offset (which may be NULL otherwise). *out_ftyp may be NULL
+ */
+static qtf_result qtf_scan_movie(qtf_context *context, int fd, qtf_edit_list edit_list, qtf_extent_list extent_list,
+                                 qtf_atom_size moov_memory_limit,
+                                 void **out_ftyp, qtf_atom_size *out_ftyp_size,
+                                 void **out_moov, qtf_atom_size *out_moov_size, off_t *out_moov_offset)
+{
+    qtf_result result = qtf_result_ok;
+    qtf_scan_s scan;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = 0;
+    size_t bytes_read = 0;
+    
+    qtf_scan_init(&scan, moov_memory_limit);
+    while (result == qtf_result_ok && scan.done == false) {
+        result = qtf_scan_next_atom(context, &scan, fd, edit_list, extent_list, &bytes_read);
+    }
+    if (result == qtf_result_ok)
+    {
+        atom_moov_size = scan.moov_size;
+        if (!scan.moov_streamed)
+        {
+            result = qtf_load_movie_atom(context, fd, scan.moov_offset, scan.moov_size, &atom_moov, &atom_moov_size);
+        }
+    }
+    if (result == qtf_result_ok)
+    {
+        *out_ftyp = scan.ftyp;
+        *out_ftyp_size = scan.ftyp_size;
+        *out_moov = atom_moov;
+        *out_moov_size = atom_moov_size;
+        if (out_moov_offset) *out_moov_offset = scan.moov_offset;
+    }
+    return result;
+}
+
+/*
+ *  Streaming
+ *
+ *  Movie atoms too large to hold in memory are rewritten from the source to the destination one atom at a time (see
+ *  qtf_flatten_step_stream()). The atom keeps its size, so the offsets of the data which follows it are known before it is
+ *  written.
+ */
+
+#define QTF_STREAM_BUFFER_SIZE (1024 * 1024)
+
+/*
+ returns the size of the buffer to use when streaming with memory_limit, a multiple of 8 so blocks hold whole entries
+ */
+static size_t qtf_stream_buffer_length(size_t memory_limit)
+{
+    size_t length = MIN(memory_limit, QTF_STREAM_BUFFER_SIZE) & ~(size_t)7;
+    return MAX(length, 16);
+}
+
+/*
+ copies length bytes within fd from source_offset to an earlier dest_offset a block at a time, leaving the file position
+ at the end of the copied data
+ */
+static qtf_result qtf_move_data_backward(int fd, off_t source_offset, off_t dest_offset, qtf_atom_size length, uint8_t *buffer, size_t buffer_length)
+{
+    qtf_result result = qtf_result_ok;
+    while (result == qtf_result_ok && length > 0) {
+        size_t block_length = (size_t)MIN(length, buffer_length);
+        if (lseek(fd, source_offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+        if (result == qtf_result_ok) result = qtf_read(fd, buffer, block_length);
+        if (result == qtf_result_ok && lseek(fd, dest_offset, SEEK_SET) == -1) result = qtf_result_file_write_error;
+        if (result == qtf_result_ok) result = qtf_write(fd, buffer, block_length);
+        source_offset += block_length;
+        dest_offset += block_length;
+        length -= block_length;
+    }
+    return result;
+}
+
+/*
+ *  Fragmentation
+ *
+ *  A fragmented movie is written as
+ *
+ *     [ftyp (optional)][moov (with mvex, sample tables emptied)][sidx]([moof][mdat])...[mfra]
+ *
+ *  Each fragment starts on a sync sample of the reference track (the first track with a stss atom, or the first track) and
+ *  holds a trun per track with explicit durations, sizes and flags, so none of the trex defaults are relied on.
+ */
+
+#define QTF_DEFAULT_FRAGMENT_DURATION_MS (2000)
+#define QTF_SAMPLE_FLAGS_SYNC (0x02000000) // sample_depends_on 2 (does not depend on others)
+#define QTF_SAMPLE_FLAGS_NON_SYNC (0x01010000) // sample_depends_on 1, sample_is_non_sync_sample
+
+typedef struct qtf_fragment_plan_s
+{
+    qtf_track_s *tracks;
+    uint32_t track_count;
+    uint32_t reference_track;
+    uint32_t fragment_count;
+    uint32_t *first_samples; // (fragment_count + 1) rows of track_count entries
+} qtf_fragment_plan_s;
+
+static uint32_t qtf_fragment_first_sample(const qtf_fragment_plan_s *plan, uint32_t fragment, uint32_t track)
+{
+    return plan->first_samples[((size_t)fragment * plan->track_count) + track];
+}
+
+static qtf_result qtf_fragment_plan_create(qtf_track_s *tracks, uint32_t track_count, uint32_t fragment_duration_ms, qtf_fragment_plan_s *plan)
+{
+    memset(plan, 0, sizeof(qtf_fragment_plan_s));
+    plan->tracks = tracks;
+    plan->track_count = track_count;
+    
+    // pick the track fragments are aligned to
+    bool found = false;
+    for (uint32_t i = 0; i < track_count && !found; i++) {
+        if (tracks[i].sample_count > 0 && tracks[i].sample_is_sync != NULL)
+        {
+            plan->reference_track = i;
+            found = true;
+        }
+    }
+    for (uint32_t i = 0; i < track_count && !found; i++) {
+        if (tracks[i].sample_count > 0)
+        {
+            plan->reference_track = i;
+            found = true;
+        }
+    }
+    if (!found) return qtf_result_file_too_complex;
+    
+    for (uint32_t i = 0; i < track_count; i++) {
+        // every fragment's traf shares one set of defaults from trex
+        if (tracks[i].sample_count > 0 && tracks[i].sample_description_index == 0) return qtf_result_file_too_complex;
+    }
+    
+    const qtf_track_s *reference = &tracks[plan->reference_track];
+    uint64_t fragment_duration = ((uint64_t)fragment_duration_ms * reference->timescale) / 1000;
+    
+    // find the reference track sample each fragment starts on
+    uint32_t *starts = malloc(sizeof(uint32_t) * ((size_t)reference->sample_count + 1));
+    if (starts == NULL) return qtf_result_memory_error;
+    
+    uint32_t fragment_count = 1;
+    starts[0] = 0;
+    for (uint32_t i = 1; i < reference->sample_count; i++) {
+        bool sync = reference->sample_is_sync ? reference->sample_is_sync[i] : true;
+        if (sync && reference->sample_decode_times[i] - reference->sample_decode_times[starts[fragment_count - 1]] >= fragment_duration)
+        {
+            starts[fragment_count++] = i;
+        }
+    }
+    
+    plan->first_samples = malloc(sizeof(uint32_t) * ((size_t)fragment_count + 1) * track_count);
+    if (plan->first_samples == NULL)
+    {
+        free(starts);
+        return qtf_result_memory_error;
+    }
+    plan->fragment_count = fragment_count;
+    
+    // assign the samples of every track to the fragment covering their decode time
+    for (uint32_t t = 0; t < track_count; t++) {
+        const qtf_track_s *track = &tracks[t];
+        uint32_t sample = 0;
+        for (uint32_t f = 0; f < fragment_count; f++) {
+            if (f > 0)
+            {
+                double fragment_start = (double)reference->sample_decode_times[starts[f]] / reference->timescale;
+                while (sample < track->sample_count && ((double)track->sample_decode_times[sample] / track->timescale) < fragment_start) {
+                    sample++;
+                }
+            }
+            plan->first_samples[((size_t)f * track_count) + t] = (t == plan->reference_track) ? starts[f] : sample;
+        }
+        plan->first_samples[((size_t)fragment_count * track_count) + t] = track->sample_count;
+    }
+    free(starts);
+    return qtf_result_ok;
+}
+
+static void qtf_fragment_plan_destroy(qtf_fragment_plan_s *plan)
+{
+    free(plan->first_samples);
+    plan->first_samples = NULL;
+}
+
+static size_t qtf_fragment_moof_size(const qtf_fragment_plan_s *plan, uint32_t fragment)
+{
+    size_t size = 8 + 16; // moof, mfhd
+    for (uint32_t t = 0; t < plan->track_count; t++) {
+        size_t count = qtf_fragment_first_sample(plan, fragment + 1, t) - qtf_fragment_first_sample(plan, fragment, t);
+        if (count > 0)
+        {
+            size_t entry_size = plan->tracks[t].sample_composition_offsets ? 16 : 12;
+            size += 8 + 16 + 20 + 20 + (count * entry_size); // traf, tfhd, tfdt, trun
+        }
+    }
+    return size;
+}
+
+static qtf_atom_size qtf_fragment_data_size(const qtf_fragment_plan_s *plan, uint32_t fragment)
+{
+    qtf_atom_size size = 0;
+    for (uint32_t t = 0; t < plan->track_count; t++) {
+        const qtf_track_s *track = &plan->tracks[t];
+        for (uint32_t s = qtf_fragment_first_sample(plan, fragment, t); s < qtf_fragment_first_sample(plan, fragment + 1, t); s++) {
+            size += track->sample_sizes[s];
+        }
+    }
+    return size;
+}
+
+static size_t qtf_fragment_mdat_header_size(qtf_atom_size data_size)
+{
+    return (data_size + 8 > UINT32_MAX) ? 16 : 8;
+}
+
+/*
+ writes the header of an mdat atom holding data_size bytes to header, returning its length
+ */
+static size_t qtf_fragment_write_mdat_header(qtf_atom_size data_size, uint32_t header[4])
+{
+    size_t header_size = qtf_fragment_mdat_header_size(data_size);
+    if (header_size == 16)
+    {
+        qtf_put_32(&header[0], 1);
+        qtf_put_64(&header[2], data_size + 16);
+    }
+    else
+    {
+        qtf_put_32(&header[0], (uint32_t)(data_size + 8));
+    }
+    qtf_put_32(&header[1], QTF_FCC_mdat);
+    return header_size;
+}
+
+/*
+ writes the moof atom for a fragment to dest, which must have space for qtf_fragment_moof_size() bytes
+ */
+static qtf_result qtf_fragment_write_moof(const qtf_fragment_plan_s *plan, uint32_t fragment, uint8_t *dest)
+{
+    size_t moof_size = qtf_fragment_moof_size(plan, fragment);
+    qtf_atom_size data_size = qtf_fragment_data_size(plan, fragment);
+    qtf_atom_size data_offset = moof_size + qtf_fragment_mdat_header_size(data_size);
+    uint8_t *p = dest;
+    
+    // trun data offsets are signed 32 bit values relative to the moof
+    if (data_offset + data_size > INT32_MAX)
+    {
+        return qtf_result_file_too_complex;
+    }
+    
+    qtf_put_32(p, (uint32_t)moof_size);
+    qtf_put_32(p + 4, QTF_FCC_moof);
+    qtf_put_32(p + 8, 16);
+    qtf_put_32(p + 12, QTF_FCC_mfhd);
+    qtf_put_32(p + 16, 0);
+    qtf_put_32(p + 20, fragment + 1); // sequence numbers start at 1
+    p += 24;
+    
+    for (uint32_t t = 0; t < plan->track_count; t++) {
+        const qtf_track_s *track = &plan->tracks[t];
+        uint32_t first = qtf_fragment_first_sample(plan, fragment, t);
+        uint32_t end = qtf_fragment_first_sample(plan, fragment + 1, t);
+        if (end == first) continue;
+        
+        uint32_t count = end - first;
+        bool has_composition_offsets = track->sample_composition_offsets != NULL;
+        size_t entry_size = has_composition_offsets ? 16 : 12;
+        size_t trun_size = 20 + (count * entry_size);
+        bool negative_composition_offsets = false;
+        
+        qtf_put_32(p, (uint32_t)(8 + 16 + 20 + trun_size));
+        qtf_put_32(p + 4, QTF_FCC_traf);
+        // tfhd
+        qtf_put_32(p + 8, 16);
+        qtf_put_32(p + 12, QTF_FCC_tfhd);
+        qtf_put_32(p + 16, QTF_TFHD_DEFAULT_BASE_IS_MOOF);
+        qtf_put_32(p + 20, track->track_id);
+        // tfdt
+        qtf_put_32(p + 24, 20);
+        qtf_put_32(p + 28, QTF_FCC_tfdt);
+        qtf_put_32(p + 32, 1 << 24); // version 1
+        qtf_put_64(p + 36, track->sample_decode_times[first]);
+        // trun
+        uint32_t trun_flags = QTF_TRUN_DATA_OFFSET_PRESENT | QTF_TRUN_SAMPLE_DURATION_PRESENT | QTF_TRUN_SAMPLE_SIZE_PRESENT | QTF_TRUN_SAMPLE_FLAGS_PRESENT;
+        if (has_composition_offsets) trun_flags |= QTF_TRUN_SAMPLE_COMPOSITION_TIME_OFFSETS_PRESENT;
+        qtf_put_32(p + 44, (uint32_t)trun_size);
+        qtf_put_32(p + 48, QTF_FCC_trun);
+        qtf_put_32(p + 56, count);
+        qtf_put_32(p + 60, (uint32_t)data_offset);
+        uint8_t *entry = p + 64;
+        for (uint32_t s = first; s < end; s++) {
+            bool sync = track->sample_is_sync ? track->sample_is_sync[s] : true;
+            qtf_put_32(entry, (uint32_t)(track->sample_decode_times[s + 1] - track->sample_decode_times[s]));
+            qtf_put_32(entry + 4, track->sample_sizes[s]);
+            qtf_put_32(entry + 8, sync ? QTF_SAMPLE_FLAGS_SYNC : QTF_SAMPLE_FLAGS_NON_SYNC);
+            if (has_composition_offsets)
+            {
+                qtf_put_32(entry + 12, (uint32_t)track->sample_composition_offsets[s]);
+                if (track->sample_composition_offsets[s] < 0) negative_composition_offsets = true;
+            }
+            data_offset += track->sample_sizes[s];
+            entry += entry_size;
+        }
+        // version 1 truns have signed composition offsets
+        qtf_put_32(p + 52, ((negative_composition_offsets ? 1 : 0) << 24) | trun_flags);
+        p = entry;
+    }
+    return qtf_result_ok;
+}
+
+/*
+ builds the initial moov atom for a fragmented movie in a malloced buffer, replacing the sample tables in moov_tree with
+ empty ones and adding an mvex atom. moov_tree is edited and can't be used to write the original moov afterwards.
+ */
+static qtf_result qtf_fragment_create_init_movie_atom(qtf_box_tree_s *moov_tree, const qtf_fragment_plan_s *plan,
+                                                      uint8_t **out_atom, size_t *out_atom_size)
+{
+    // version, flags, and a zero sample size and entry count
+    static uint8_t empty_table[12];
+    
+    for (qtf_box trak = qtf_box_find(moov_tree, 0, QTF_FCC_trak); trak != QTF_BOX_NONE; trak = qtf_box_next(moov_tree, trak)) {
+        qtf_box stbl = qtf_box_find_path(moov_tree, trak, "mdia/minf/stbl");
+        if (stbl == QTF_BOX_NONE) continue;
+        for (qtf_box box = moov_tree->boxes[stbl].first_child; box != QTF_BOX_NONE; box = moov_tree->boxes[box].next_sibling) {
+            switch (moov_tree->boxes[box].type) {
+                case QTF_FCC_stts:
+                case QTF_FCC_stsc:
+                case QTF_FCC_stco:
+                case QTF_FCC_co64:
+                    qtf_box_set_contents(moov_tree, box, empty_table, 8);
+                    break;
+                case QTF_FCC_stsz:
+                    qtf_box_set_contents(moov_tree, box, empty_table, 12);
+                    break;
+                case QTF_FCC_stss:
+                case QTF_FCC_ctts:
+                case QTF_FCC_stps:
+                case QTF_FCC_sdtp:
+                    // optional tables which are described by the fragments
+                    qtf_box_remove(moov_tree, box);
+                    break;
+            }
+        }
+    }
+    
+    // the movie's duration moves into mehd
+    uint64_t duration = 0;
+    size_t mvhd_size = 0;
+    uint8_t *mvhd = qtf_box_atom(moov_tree, qtf_box_find(moov_tree, 0, QTF_FCC_mvhd), &mvhd_size);
+    if (mvhd && mvhd[8] == 1 && mvhd_size >= 40) duration = qtf_get_64(mvhd + 32);
+    else if (mvhd && mvhd_size >= 28) duration = qtf_get_32(mvhd + 24);
+    
+    // mehd and trex contents, which must outlive the tree's edits
+    uint8_t *mvex_contents = malloc(12 + (24 * (size_t)plan->track_count));
+    if (mvex_contents == NULL) return qtf_result_memory_error;
+    
+    qtf_result result = qtf_result_ok;
+    qtf_box mvex = qtf_box_append_container(moov_tree, 0, QTF_FCC_mvex);
+    if (mvex == QTF_BOX_NONE) result = qtf_result_memory_error;
+    
+    uint8_t *p = mvex_contents;
+    qtf_put_32(p, 1 << 24); // version 1
+    qtf_put_64(p + 4, duration);
+    if (result == qtf_result_ok && qtf_box_append(moov_tree, mvex, QTF_FCC_mehd, p, 12) == QTF_BOX_NONE) result = qtf_result_memory_error;
+    p += 12;
+    for (uint32_t t = 0; t < plan->track_count && result == qtf_result_ok; t++) {
+        qtf_put_32(p, 0);
+        qtf_put_32(p + 4, plan->tracks[t].track_id);
+        qtf_put_32(p + 8, plan->tracks[t].sample_description_index ? plan->tracks[t].sample_description_index : 1);
+        qtf_put_32(p + 12, 0); // default_sample_duration
+        qtf_put_32(p + 16, 0); // default_sample_size
+        qtf_put_32(p + 20, 0); // default_sample_flags
+        if (qtf_box_append(moov_tree, mvex, QTF_FCC_trex, p, 24) == QTF_BOX_NONE) result = qtf_result_memory_error;
+        p += 24;
+    }
+    
+    if (result == qtf_result_ok)
+    {
+        size_t size = (size_t)qtf_box_size(moov_tree, 0);
+        uint8_t *atom = malloc(size);
+        if (atom != NULL)
+        {
+            qtf_box_write(moov_tree, 0, atom);
+            *out_atom = atom;
+            *out_atom_size = size;
+        }
+        else
+        {
+            result = qtf_result_memory_error;
+        }
+    }
+    free(mvex_contents);
+    return result;
+}
+
+/*
+ builds a sidx atom indexing every fragment in a malloced buffer, or sets *out_atom to NULL if the fragments can't be
+ described by a single sidx atom
+ */
+static qtf_result qtf_fragment_create_sidx_atom(const qtf_fragment_plan_s *plan, uint8_t **out_atom, size_t *out_atom_size)
+{
+    const qtf_track_s *reference = &plan->tracks[plan->reference_track];
+    *out_atom = NULL;
+    *out_atom_size = 0;
+    if (plan->fragment_count > UINT16_MAX) return qtf_result_ok;
+    
+    size_t size = 40 + (12 * (size_t)plan->fragment_count);
+    uint8_t *atom = malloc(size);
+    if (atom == NULL) return qtf_result_memory_error;
+    
+    uint64_t earliest_presentation_time = reference->sample_decode_times[0];
+    if (reference->sample_composition_offsets) earliest_presentation_time += reference->sample_composition_offsets[0];
+    
+    qtf_put_32(atom, (uint32_t)size);
+    qtf_put_32(atom + 4, QTF_FCC_sidx);
+    qtf_put_32(atom + 8, 1 << 24); // version 1
+    qtf_put_32(atom + 12, reference->track_id);
+    qtf_put_32(atom + 16, reference->timescale);
+    qtf_put_64(atom + 20, earliest_presentation_time);
+    qtf_put_64(atom + 28, 0); // first_offset, the first moof follows immediately
+    qtf_put_32(atom + 36, plan->fragment_count); // reserved (16 bits) + reference_count (16 bits)
+    
+    for (uint32_t f = 0; f < plan->fragment_count; f++) {
+        qtf_atom_size data_size = qtf_fragment_data_size(plan, f);
+        qtf_atom_size referenced_size = qtf_fragment_moof_size(plan, f) + qtf_fragment_mdat_header_size(data_size) + data_size;
+        uint32_t start = qtf_fragment_first_sample(plan, f, plan->reference_track);
+        uint32_t end = qtf_fragment_first_sample(plan, f + 1, plan->reference_track);
+        if (referenced_size > INT32_MAX)
+        {
+            // referenced_size is only 31 bits
+            free(atom);
+            return qtf_result_ok;
+        }
+        uint8_t *entry = atom + 40 + (f * 12);
+        qtf_put_32(entry, (uint32_t)referenced_size); // reference_type 0 (media)
+        qtf_put_32(entry + 4, (uint32_t)(reference->sample_decode_times[end] - reference->sample_decode_times[start]));
+        qtf_put_32(entry + 8, 0x90000000); // starts_with_SAP, SAP_type 1
+    }
+    *out_atom = atom;
+    *out_atom_size = size;
+    return qtf_result_ok;
+}
+
+/*
+ builds an mfra atom with a tfra per track in a malloced buffer
+ */
+static qtf_result qtf_fragment_create_mfra_atom(const qtf_fragment_plan_s *plan, const qtf_atom_size *moof_offsets,
+                                                uint8_t **out_atom, size_t *out_atom_size)
+{
+    size_t size = 8 + 16; // mfra, mfro
+    for (uint32_t t = 0; t < plan->track_count; t++) {
+        size += 24;
+        for (uint32_t f = 0; f < plan->fragment_count; f++) {
+            uint32_t first = qtf_fragment_first_sample(plan, f, t);
+            if (first < qtf_fragment_first_sample(plan, f + 1, t)
+                && (plan->tracks[t].sample_is_sync == NULL || plan->tracks[t].sample_is_sync[first]))
+            {
+                size += 28;
+            }
+        }
+    }
+    uint8_t *atom = malloc(size);
+    if (atom == NULL) return qtf_result_memory_error;
+    
+    qtf_put_32(atom, (uint32_t)size);
+    qtf_put_32(atom + 4, QTF_FCC_mfra);
+    uint8_t *p = atom + 8;
+    for (uint32_t t = 0; t < plan->track_count; t++) {
+        const qtf_track_s *track = &plan->tracks[t];
+        uint8_t *tfra = p;
+        uint32_t entry_count = 0;
+        p += 24;
+        for (uint32_t f = 0; f < plan->fragment_count; f++) {
+            uint32_t first = qtf_fragment_first_sample(plan, f, t);
+            if (first == qtf_fragment_first_sample(plan, f + 1, t)) continue;
+            if (track->sample_is_sync != NULL && !track->sample_is_sync[first]) continue;
+            // the track's traf number is its index among the tracks with samples in this fragment
+            uint32_t traf_number = 1;
+            for (uint32_t i = 0; i < t; i++) {
+                if (qtf_fragment_first_sample(plan, f, i) != qtf_fragment_first_sample(plan, f + 1, i)) traf_number++;
+            }
+            qtf_put_64(p, track->sample_decode_times[first]);
+            qtf_put_64(p + 8, moof_offsets[f]);
+            qtf_put_32(p + 16, traf_number);
+            qtf_put_32(p + 20, 1); // trun_number
+            qtf_put_32(p + 24, 1); // sample_number
+            p += 28;
+            entry_count++;
+        }
+        qtf_put_32(tfra, (uint32_t)(p - tfra));
+        qtf_put_32(tfra + 4, QTF_FCC_tfra);
+        qtf_put_32(tfra + 8, 1 << 24); // version 1
+        qtf_put_32(tfra + 12, track->track_id);
+        qtf_put_32(tfra + 16, 0x3F); // 4 byte traf, trun and sample numbers
+        qtf_put_32(tfra + 20, entry_count);
+    }
+    qtf_put_32(p, 16);
+    qtf_put_32(p + 4, QTF_FCC_mfro);
+    qtf_put_32(p + 8, 0);
+    qtf_put_32(p + 12, (uint32_t)size);
+    
+    *out_atom = atom;
+    *out_atom_size = size;
+    return qtf_result_ok;
+}
+
+/*
+ copies the sample data for a fragment from fd_source to the current position in fd_dest, merging runs of samples which are
+ contiguous in the source
+ */
+static qtf_result qtf_fragment_copy_data(const qtf_fragment_plan_s *plan, uint32_t fragment, int fd_source, int fd_dest)
+{
+    qtf_result result = qtf_result_ok;
+    uint64_t run_start = 0;
+    qtf_atom_size run_length = 0;
+    for (uint32_t t = 0; t < plan->track_count && result == qtf_result_ok; t++) {
+        const qtf_track_s *track = &plan->tracks[t];
+        uint32_t end = qtf_fragment_first_sample(plan, fragment + 1, t);
+        for (uint32_t s = qtf_fragment_first_sample(plan, fragment, t); s < end && result == qtf_result_ok; s++) {
+            if (run_length != 0 && track->sample_offsets[s] != run_start + run_length)
+            {
+                result = qtf_copy_data(fd_source, run_start, fd_dest, run_length);
+                run_length = 0;
+            }
+            if (run_length == 0) run_start = track->sample_offsets[s];
+            run_length += track->sample_sizes[s];
+        }
+    }
+    if (result == qtf_result_ok && run_length != 0)
+    {
+        result = qtf_copy_data(fd_source, run_start, fd_dest, run_length);
+    }
+    return result;
+}
+
+/*
+ *  Interleaving
+ *
+ *  Chunks are ordered by the window their decode time falls in, and within each window by track then decode time, so each
+ *  track's data for a window is contiguous. With a window of 0 chunks are in strict decode order.
+ */
+
+typedef struct qtf_interleave_chunk_s
+{
+    uint64_t window;
+    uint64_t time_us;
+    uint32_t track;
+    uint32_t chunk;
+} qtf_interleave_chunk_s;
+
+static int qtf_interleave_chunk_compare(const void *a, const void *b)
+{
+    const qtf_interleave_chunk_s *chunk_a = a;
+    const qtf_interleave_chunk_s *chunk_b = b;
+    if (chunk_a->window != chunk_b->window) return chunk_a->window < chunk_b->window ? -1 : 1;
+    if (chunk_a->track != chunk_b->track) return chunk_a->track < chunk_b->track ? -1 : 1;
+    if (chunk_a->time_us != chunk_b->time_us) return chunk_a->time_us < chunk_b->time_us ? -1 : 1;
+    return chunk_a->chunk < chunk_b->chunk ? -1 : (chunk_a->chunk > chunk_b->chunk ? 1 : 0);
+}
+
+static qtf_atom_size qtf_track_chunk_length(const qtf_track_s *track, uint32_t chunk)
+{
+    qtf_atom_size length = 0;
+    for (uint32_t s = track->chunk_first_samples[chunk]; s < track->chunk_first_samples[chunk + 1]; s++) {
+        length += track->sample_sizes[s];
+    }
+    return length;
+}
+
+/*
+ writes a chunk offset to the stco or co64 atom of the moov atom the track was loaded from
+ */
+static qtf_result qtf_track_set_chunk_offset(qtf_track_s *track, uint32_t chunk, uint64_t offset)
+{
+    if (qtf_get_32(track->chunk_offset_atom + 4) == QTF_FCC_co64)
+    {
+        qtf_put_64(track->chunk_offset_atom + 16 + (chunk * 8), offset);
+    }
+    else if (offset > UINT32_MAX)
+    {
+        return qtf_result_file_too_complex;
+    }
+    else
+    {
+        qtf_put_32(track->chunk_offset_atom + 16 + (chunk * 4), (uint32_t)offset);
+    }
+    track->chunk_offsets[chunk] = offset;
+    return qtf_result_ok;
+}
+
+/*
+ orders every chunk of every track for interleaving, returning a malloced array
+ */
+static qtf_result qtf_interleave_plan_create(const qtf_track_s *tracks, uint32_t track_count, uint32_t window_ms,
+                                             qtf_interleave_chunk_s **out_chunks, size_t *out_chunk_count)
+{
+    size_t chunk_count = 0;
+    for (uint32_t t = 0; t < track_count; t++) {
+        chunk_count += tracks[t].chunk_count;
+    }
+    qtf_interleave_chunk_s *chunks = malloc(sizeof(qtf_interleave_chunk_s) * (chunk_count + 1));
+    if (chunks == NULL) return qtf_result_memory_error;
+    
+    size_t i = 0;
+    for (uint32_t t = 0; t < track_count; t++) {
+        const qtf_track_s *track = &tracks[t];
+        for (uint32_t c = 0; c < track->chunk_count; c++) {
+            uint64_t time = track->sample_decode_times[track->chunk_first_samples[c]];
+            chunks[i].time_us = (uint64_t)(((double)time / track->timescale) * 1000000.0);
+            chunks[i].window = window_ms ? (chunks[i].time_us / ((uint64_t)window_ms * 1000)) : chunks[i].time_us;
+            chunks[i].track = t;
+            chunks[i].chunk = c;
+            i++;
+        }
+    }
+    qsort(chunks, chunk_count, sizeof(qtf_interleave_chunk_s), qtf_interleave_chunk_compare);
+    
+    *out_chunks = chunks;
+    *out_chunk_count = chunk_count;
+    return qtf_result_ok;
+}
+
+/*
+ *  Verification
+ *
+ *  A flattened movie is checked against its source by comparing the sample tables of their moov atoms, checking every
+ *  chunk lies within an mdat atom and comparing the data of a sample of the chunks, which is shared between threads.
+ */
+
+typedef struct qtf_range_s
+{
+    uint64_t start;
+    uint64_t end;
+} qtf_range_s;
+
+/*
+ loads the data ranges of the top-level mdat atoms in fd, in file order
+ */
+static qtf_result qtf_mdat_ranges_load(int fd, qtf_range_s **out_ranges, uint32_t *out_range_count)
+{
+    qtf_result result = qtf_result_ok;
+    qtf_range_s *ranges = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    off_t offset = lseek(fd, 0, SEEK_SET);
+    
+    if (offset == -1) result = qtf_result_file_read_error;
+    while (result == qtf_result_ok) {
+        uint32_t atom_header[4];
+        qtf_atom_size size = 0;
+        uint32_t type = 0;
+        size_t bytes_read;
+        result = qtf_read_atom_header(fd, atom_header, sizeof(atom_header), &type, &size, &bytes_read);
+        
+        if (result != qtf_result_ok || bytes_read == 0) break;
+        if (size < bytes_read) result = qtf_result_file_not_movie;
+        
+        if (result == qtf_result_ok && type == QTF_FCC_mdat)
+        {
+            if (count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 4;
+                qtf_range_s *grown = realloc(ranges, sizeof(qtf_range_s) * capacity);
+                if (grown == NULL) result = qtf_result_memory_error;
+                else ranges = grown;
+            }
+            if (result == qtf_result_ok)
+            {
+                ranges[count].start = offset + bytes_read;
+                ranges[count].end = offset + size;
+                count++;
+            }
+        }
+        offset += size;
+        if (result == qtf_result_ok && lseek(fd, offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+    }
+    if (result == qtf_result_ok)
+    {
+        *out_ranges = ranges;
+        *out_range_count = count;
+    }
+    else
+    {
+        free(ranges);
+    }
+    return result;
+}
+
+/*
+ returns the range which contains start, or NULL
+ */
+static const qtf_range_s *qtf_range_find(const qtf_range_s *ranges, uint32_t range_count, uint64_t start)
+{
+    uint32_t low = 0;
+    uint32_t high = range_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (start < ranges[middle].start) high = middle;
+        else if (start > ranges[middle].end) low = middle + 1;
+        else return &ranges[middle];
+    }
+    return NULL;
+}
+
+/*
+ returns true if every chunk of the tracks lies within one of the mdat data ranges
+ */
+static bool qtf_tracks_within_ranges(const qtf_track_s *tracks, uint32_t track_count, const qtf_range_s *ranges, uint32_t range_count)
+{
+    for (uint32_t t = 0; t < track_count; t++) {
+        const qtf_track_s *track = &tracks[t];
+        if (track->chunk_count == 0) continue;
+        
+        // find the lowest chunk start and highest sample end, these loops are simple enough for the compiler to vectorise
+        uint64_t lowest = UINT64_MAX;
+        uint64_t highest = 0;
+        for (uint32_t c = 0; c < track->chunk_count; c++) {
+            lowest = MIN(lowest, track->chunk_offsets[c]);
+        }
+        for (uint32_t s = 0; s < track->sample_count; s++) {
+            highest = MAX(highest, track->sample_offsets[s] + track->sample_sizes[s]);
+        }
+        // usually the whole track is within one mdat atom, otherwise check each chunk
+        const qtf_range_s *range = qtf_range_find(ranges, range_count, lowest);
+        if (range != NULL && highest <= range->end) continue;
+        
+        for (uint32_t c = 0; c < track->chunk_count; c++) {
+            uint64_t start = track->chunk_offsets[c];
+            range = qtf_range_find(ranges, range_count, start);
+            if (range == NULL || start + qtf_track_chunk_length(track, c) > range->end) return false;
+        }
+    }
+    return true;
+}
+
+/*
+ returns true if the tracks have identical samples, whatever their offsets
+ */
+static bool qtf_tracks_equal(const qtf_track_s *a, const qtf_track_s *b)
+{
+    if (a->track_id != b->track_id
+        || a->timescale != b->timescale
+        || a->sample_count != b->sample_count
+        || a->chunk_count != b->chunk_count
+        || a->sample_description_index != b->sample_description_index
+        || (a->sample_composition_offsets == NULL) != (b->sample_composition_offsets == NULL)
+        || (a->sample_is_sync == NULL) != (b->sample_is_sync == NULL))
+    {
+        return false;
+    }
+    if (a->sample_count > 0
+        && (memcmp(a->sample_sizes, b->sample_sizes, sizeof(uint32_t) * a->sample_count) != 0
+            || (a->sample_composition_offsets && memcmp(a->sample_composition_offsets, b->sample_composition_offsets, sizeof(int32_t) * a->sample_count) != 0)
+            || (a->sample_is_sync && memcmp(a->sample_is_sync, b->sample_is_sync, sizeof(bool) * a->sample_count) != 0)))
+    {
+        return false;
+    }
+    return memcmp(a->sample_decode_times, b->sample_decode_times, sizeof(uint64_t) * (a->sample_count + 1)) == 0
+        && memcmp(a->chunk_first_samples, b->chunk_first_samples, sizeof(uint32_t) * (a->chunk_count + 1)) == 0;
+}
+
+typedef struct qtf_verify_chunk_s
+{
+    uint64_t source_offset;
+    uint64_t dest_offset;
+    qtf_atom_size length;
+} qtf_verify_chunk_s;
+
+typedef struct qtf_verify_job_s
+{
+    int fd_source;
+    int fd_dest;
+    const qtf_verify_chunk_s *chunks;
+    size_t chunk_count;
+    size_t first; // the job compares every stride-th chunk starting with first
+    size_t stride;
+    qtf_result result;
+} qtf_verify_job_s;
+
+/*
+ reads length bytes at offset without using the file position, which is shared between threads
+ */
+static qtf_result qtf_read_at(int fd, uint64_t offset, void *buffer, size_t length)
+{
+#if defined(_WIN32)
+    // jobs run one at a time on Windows
+    if (lseek(fd, (off_t)offset, SEEK_SET) == -1) return qtf_result_file_read_error;
+    return qtf_read(fd, buffer, length);
+#else
+    ssize_t got = pread(fd, buffer, length, (off_t)offset);
+    if (got == -1) return qtf_result_file_read_error;
+    if ((size_t)got != length) return qtf_result_file_not_movie;
+    return qtf_result_ok;
+#endif
+}
+
+static void *qtf_verify_job_run(void *argument)
+{
+    qtf_verify_job_s *job = argument;
+    uint8_t source_buffer[QTF_COPY_BUFFER_SIZE];
+    uint8_t dest_buffer[QTF_COPY_BUFFER_SIZE];
+    qtf_result result = qtf_result_ok;
+    
+    for (size_t i = job->first; i < job->chunk_count && result == qtf_result_ok; i += job->stride) {
+        const qtf_verify_chunk_s *chunk = &job->chunks[i];
+        qtf_atom_size compared = 0;
+        while (result == qtf_result_ok && compared < chunk->length) {
+            size_t block_length = (size_t)MIN(chunk->length - compared, QTF_COPY_BUFFER_SIZE);
+            result = qtf_read_at(job->fd_source, chunk->source_offset + compared, source_buffer, block_length);
+            if (result == qtf_result_ok) result = qtf_read_at(job->fd_dest, chunk->dest_offset + compared, dest_buffer, block_length);
+            if (result == qtf_result_ok && memcmp(source_buffer, dest_buffer, block_length) != 0) result = qtf_result_file_mismatch;
+            compared += block_length;
+        }
+    }
+    job->result = result;
+    return NULL;
+}
+
+/*
+ compares the chunks using up to thread_count threads, including the calling thread
+ */
+static qtf_result qtf_verify_chunks(int fd_source, int fd_dest, const qtf_verify_chunk_s *chunks, size_t chunk_count, unsigned int thread_count)
+{
+    qtf_result result = qtf_result_ok;
+#if defined(_WIN32)
+    thread_count = 1;
+#endif
+    thread_count = (unsigned int)MAX(MIN(thread_count, chunk_count), 1);
+    
+    qtf_verify_job_s *jobs = calloc(thread_count, sizeof(qtf_verify_job_s));
+    if (jobs == NULL) return qtf_result_memory_error;
+    
+    for (unsigned int i = 0; i < thread_count; i++) {
+        jobs[i].fd_source = fd_source;
+        jobs[i].fd_dest = fd_dest;
+        jobs[i].chunks = chunks;
+        jobs[i].chunk_count = chunk_count;
+        jobs[i].first = i;
+        jobs[i].stride = thread_count;
+    }
+#if defined(_WIN32)
+    qtf_verify_job_run(&jobs[0]);
+#else
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    bool *started = calloc(thread_count, sizeof(bool));
+    if (threads && started)
+    {
+        for (unsigned int i = 1; i < thread_count; i++) {
+            started[i] = pthread_create(&threads[i], NULL, qtf_verify_job_run, &jobs[i]) == 0;
+        }
+    }
+    // the calling thread does the first job, and any whose thread couldn't be started
+    for (unsigned int i = 0; i < thread_count; i++) {
+        if (!(started && started[i])) qtf_verify_job_run(&jobs[i]);
+    }
+    for (unsigned int i = 1; i < thread_count; i++) {
+        if (started && started[i]) pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(started);
+#endif
+    for (unsigned int i = 0; i < thread_count && result == qtf_result_ok; i++) {
+        result = jobs[i].result;
+    }
+    free(jobs);
+    return result;
+}
+
+/*
+ opens the movie at path and loads its tracks and mdat ranges
+ */
+static qtf_result qtf_verify_load(qtf_context *context, const char *path, int *out_fd, qtf_track_s **out_tracks, uint32_t *out_track_count,
+                                  qtf_range_s **out_ranges, uint32_t *out_range_count)
+{
+    qtf_result result = qtf_result_ok;
+    void *atom_ftyp = NULL;
+    qtf_atom_size atom_ftyp_size = 0;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = 0;
+    qtf_box_tree_s *moov_tree = &context->moov_tree;
+    
+    *out_fd = qtf_open_for_reading(path);
+    if (*out_fd == -1) return qtf_result_file_read_error;
+    
+    result = qtf_scan_movie(context, *out_fd, NULL, NULL, 0, &atom_ftyp, &atom_ftyp_size, &atom_moov, &atom_moov_size, NULL);
+    if (result == qtf_result_ok) result = qtf_box_tree_parse(moov_tree, atom_moov, atom_moov_size);
+    if (result == qtf_result_ok && qtf_box_find(moov_tree, 0, QTF_FCC_mvex) != QTF_BOX_NONE)
+    {
+        // fragmented movies keep their data in their fragments
+        result = qtf_result_file_too_complex;
+    }
+    if (result == qtf_result_ok) result = qtf_tracks_load(moov_tree, out_tracks, out_track_count);
+    if (result == qtf_result_ok)
+    {
+        result = qtf_mdat_ranges_load(*out_fd, out_ranges, out_range_count);
+        if (result != qtf_result_ok) qtf_tracks_destroy(*out_tracks, *out_track_count);
+    }
+    return result;
+}
+
+/*
+ returns the space qtf_prepare_movie_atom() reserves for a moov_size byte moov atom which compresses to compressed_size
+ bytes: an estimate grown in steps of about a sixteenth of moov_size until the compressed atom fills it exactly or leaves
+ room for the header of the free atom which pads it out
+ */
+static qtf_atom_size qtf_compressed_movie_atom_reserve(qtf_atom_size moov_size, qtf_atom_size compressed_size)
+{
+    qtf_atom_size increments = ((moov_size / 16) + (16 - 1)) & ~(qtf_atom_size)(16 - 1);
+    qtf_atom_size reserve = increments * 3;
+    while (compressed_size != reserve && compressed_size + 8 > reserve) reserve += increments;
+    return reserve;
+}
+
+/*
+ updates the sample offsets in the moov atom in the context's moov buffer for the edits in edit_list and for the moov atom
+ being inserted at moov_offset, compressing it if allow_compressed_moov_atom is true. An edit for the inserted atom is
+ added to edit_list. On success the context's moov buffer holds the atom(s) to write.
+ */
+static qtf_result qtf_prepare_movie_atom(qtf_context *context, qtf_edit_list edit_list, off_t moov_offset,
+                                         void **out_atom_moov, qtf_atom_size *out_atom_moov_size, bool allow_compressed_moov_atom)
+{
+    qtf_result result = qtf_result_ok;
+    void *atom_moov = *out_atom_moov;
+    qtf_atom_size atom_moov_size = *out_atom_moov_size;
+    qtf_box_tree_s *moov_tree = &context->moov_tree;
+    
+    result = qtf_box_tree_parse(moov_tree, atom_moov, atom_moov_size);
+    
+    if (result == qtf_result_ok && allow_compressed_moov_atom)
+    {
+        void *atom_moov_compressed = NULL;
+        qtf_atom_size atom_moov_compressed_size = 0;
+        qtf_atom_size atom_moov_compressed_expected_size = 0;
+        qtf_atom_size atom_moov_compressed_actual_size = 0;
+        
+        if (atom_moov_size < 20) result = qtf_result_file_not_movie;
+        
+        if (result == qtf_result_ok)
+        {
+            if (result == qtf_result_ok)
+            {
+                atom_moov_compressed_size = atom_moov_size;
+                atom_moov_compressed = qtf_buffer_reserve(&context->spare_buffer, (size_t)atom_moov_compressed_size);
+                if (atom_moov_compressed == NULL)
+                {
+                    result = qtf_result_memory_error;
+                }
+            }
+            if (result == qtf_result_ok)
+            {
+                // We have to estimate a compressed size, modify the sample data offsets for that estimated size, then compress
+                // the modified atom and see if we met our target. If not, repeat the process, allowing a little more space until
+                // we succeed or arrive at the original atom size. qtf_compressed_movie_atom_reserve() mirrors this for estimates
+                size_t increments = (((size_t)atom_moov_size / 16) + (16 - 1)) & ~(16 - 1);
+                atom_moov_compressed_expected_size = increments * 3;
+                off_t total_offset_change = atom_moov_compressed_expected_size;
+                bool can_store_atoms = false;
+                
+                // add an edit for our estimated size
+                result = qtf_edit_list_add_edit(edit_list, moov_offset, atom_moov_compressed_expected_size);
+                // apply all the edits to date
+                if (result == qtf_result_ok) result = qtf_offsets_apply_list(moov_tree, edit_list);
+                                
+                do {
+                    // This is skipped the first pass, then expands the space we reserve on subsequent passes
+                    if (result == qtf_result_ok && atom_moov_compressed_actual_size > (atom_moov_compressed_expected_size - 8))
+                    {
+                        atom_moov_compressed_expected_size += increments;
+                        total_offset_change += increments;
+                        
+                        qtf_edit_list_add_edit(edit_list, moov_offset, increments);
+                        result = qtf_offsets_modify(moov_tree, increments);
+                    }
+                    
+                    if (result == qtf_result_ok)
+                    {
+                        atom_moov_compressed_actual_size = qtf_compress_movie_atom(&context->zlib, atom_moov, (size_t)atom_moov_size,
+                                                                                   atom_moov_compressed, (size_t)atom_moov_compressed_size,
+                                                                                   false, true, false);
+                    }
+                    if (result == qtf_result_ok
+                        &&
+                        (atom_moov_compressed_actual_size == atom_moov_compressed_expected_size
+                         || atom_moov_compressed_actual_size < (atom_moov_compressed_expected_size - 8))
+                        )
+                    {
+                        // atom_moov_compressed_actual_size will be zero if we couldn't compress it in the buffer space
+                        // or if an error occurred in compression, so we use the uncompressed atom in those cases
+                        if (atom_moov_compressed_actual_size != 0)
+                        {
+                            // we substitute the existing atom_moov with the an "atom" which is usually two atoms:
+                            // the compressed moov atom plus a free atom for the extra space we estimated when
+                            // calculating the offset
+                            qtf_buffer_swap(&context->moov_buffer, &context->spare_buffer);
+                            atom_moov = atom_moov_compressed;
+                            atom_moov_size = atom_moov_compressed_expected_size; // The total size we'll write to the file
+                            size_t free_size = (size_t)(atom_moov_compressed_expected_size - atom_moov_compressed_actual_size);
+                            if (free_size > 0 && free_size < 8)
+                            {
+                                result = qtf_result_memory_error; // this shouldn't happen but it's fatal so check
+                            }
+                            else
+                            {
+                                uint32_t *size = atom_moov + atom_moov_compressed_actual_size;
+                                uint32_t *type = atom_moov + atom_moov_compressed_actual_size + 4;
+                                *size = qtf_swap_host_to_big_int_32(free_size);
+                                *type = qtf_swap_host_to_big_int_32(QTF_FCC_free);
+                            }
+                            
+                        }
+                        else
+                        {
+                            // we failed to compress the atom, set the offsets for the uncompressed atom size
+                            result = qtf_edit_list_add_edit(edit_list, moov_offset, (ssize_t)atom_moov_size - (ssize_t)total_offset_change);
+                            if (result == qtf_result_ok)
+                            {
+                                result = qtf_offsets_modify(moov_tree, (ssize_t)atom_moov_size - (ssize_t)total_offset_change);
+                            }
+                        }
+                        can_store_atoms = true;
+                    }
+                } while (result == qtf_result_ok && can_store_atoms == false);
+            }
+        }
+    }
+    else
+    {
+        if (result == qtf_result_ok)
+        {
+            // add the movie back in its new position
+            result = qtf_edit_list_add_edit(edit_list, moov_offset, atom_moov_size);
+            // update the moov atom with the new offsets
+            if (result == qtf_result_ok) result = qtf_offsets_apply_list(moov_tree, edit_list);
+        }
+    }
+    *out_atom_moov = atom_moov;
+    *out_atom_moov_size = atom_moov_size;
+    return result;
+}
+
+/*
+ *  Seek indexes
+ *
+ *  A seek index maps the sync samples of every track of a flattened movie to their offsets in it, so a seek is a binary
+ *  search rather than a walk of the sample tables. It is built from the prepared moov atom, whose chunk offsets are those
+ *  of the destination, and written once the flatten has succeeded. The layout is described in qt_flatten.h.
+ */
+
+#define QTF_INDEX_MAGIC "QTFI"
+#define QTF_INDEX_VERSION (1)
+#define QTF_INDEX_HEADER_LENGTH (16)
+#define QTF_INDEX_TRACK_LENGTH (32)
+#define QTF_INDEX_ENTRY_LENGTH (16)
+
+// the index is little-endian, so it can be used in place on most hosts
+static void qtf_index_put_32(uint8_t *p, uint32_t value)
+{
+    for (unsigned int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+static void qtf_index_put_64(uint8_t *p, uint64_t value)
+{
+    for (unsigned int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+/*
+ builds the seek index of a parsed and prepared moov atom, on success *out_index is malloced
+ */
+static qtf_result qtf_index_build(qtf_box_tree_s *moov_tree, uint8_t **out_index, size_t *out_index_length)
+{
+    qtf_track_s *tracks = NULL;
+    uint32_t track_count = 0;
+    uint64_t entry_count = 0;
+    uint8_t *index = NULL;
+    size_t index_length = 0;
+    qtf_result result = qtf_tracks_load(moov_tree, &tracks, &track_count);
+    
+    if (result == qtf_result_ok)
+    {
+        for (uint32_t i = 0; i < track_count; i++) {
+            for (uint32_t j = 0; j < tracks[i].sample_count; j++) {
+                if (tracks[i].sample_is_sync == NULL || tracks[i].sample_is_sync[j]) entry_count++;
+            }
+        }
+        uint64_t length = QTF_INDEX_HEADER_LENGTH + ((uint64_t)track_count * QTF_INDEX_TRACK_LENGTH) + (entry_count * QTF_INDEX_ENTRY_LENGTH);
+        if (length <= SIZE_MAX) index_length = (size_t)length;
+        if (index_length != 0) index = malloc(index_length);
+        if (index == NULL) result = qtf_result_memory_error;
+    }
+    if (result == qtf_result_ok)
+    {
+        memcpy(index, QTF_INDEX_MAGIC, 4);
+        qtf_index_put_32(index + 4, QTF_INDEX_VERSION);
+        qtf_index_put_32(index + 8, track_count);
+        qtf_index_put_32(index + 12, QTF_INDEX_ENTRY_LENGTH);
+        
+        uint8_t *track_entry = index + QTF_INDEX_HEADER_LENGTH;
+        uint8_t *entry = track_entry + ((size_t)track_count * QTF_INDEX_TRACK_LENGTH);
+        uint64_t first_entry = 0;
+        for (uint32_t i = 0; i < track_count; i++) {
+            qtf_track_s *track = &tracks[i];
+            uint64_t track_entry_count = 0;
+            // decode times never decrease, so the entries are in time order
+            for (uint32_t j = 0; j < track->sample_count; j++) {
+                if (track->sample_is_sync != NULL && !track->sample_is_sync[j]) continue;
+                qtf_index_put_64(entry, track->sample_decode_times[j]);
+                qtf_index_put_64(entry + 8, track->sample_offsets[j]);
+                entry += QTF_INDEX_ENTRY_LENGTH;
+                track_entry_count++;
+            }
+            qtf_index_put_32(track_entry, track->track_id);
+            qtf_index_put_32(track_entry + 4, track->timescale);
+            qtf_index_put_64(track_entry + 8, track->sample_decode_times[track->sample_count]);
+            qtf_index_put_64(track_entry + 16, first_entry);
+            qtf_index_put_64(track_entry + 24, track_entry_count);
+            track_entry += QTF_INDEX_TRACK_LENGTH;
+            first_entry += track_entry_count;
+        }
+        *out_index = index;
+        *out_index_length = index_length;
+    }
+    qtf_tracks_destroy(tracks, track_count);
+    return result;
+}
+
+/*
+ writes a seek index to a temporary file beside path which then replaces path, so readers never see part of an index
+ */
+static qtf_result qtf_index_write(const char *path, const uint8_t *index, size_t index_length)
+{
+    static const char temp_suffix[] = ".tmp";
+    qtf_result result = qtf_result_ok;
+    size_t temp_path_length = strlen(path) + sizeof(temp_suffix);
+    char *temp_path = malloc(temp_path_length);
+    if (temp_path == NULL) return qtf_result_memory_error;
+    snprintf(temp_path, temp_path_length, "%s%s", path, temp_suffix);
+    
+    // a temporary file left by an earlier failure is replaced
+    remove(temp_path);
+    int fd = qtf_open_for_writing(temp_path);
+    if (fd == -1) result = qtf_result_file_write_error;
+    if (result == qtf_result_ok)
+    {
+        result = qtf_write(fd, index, index_length);
+        if (close(fd) != 0 && result == qtf_result_ok) result = qtf_result_file_write_error;
+    }
+#if defined(_WIN32)
+    // On Windows, rename() fails if the file already exists
+    if (result == qtf_result_ok) remove(path);
+#endif
+    if (result == qtf_result_ok && rename(temp_path, path) != 0) result = qtf_result_file_write_error;
+    if (result != qtf_result_ok) remove(temp_path);
+    free(temp_path);
+    return result;
+}
+
+/*
+ *  Incremental flattening
+ *
+ *  A flatten begun with qtf_flatten_begin() is held by its context and advanced by qtf_flatten_step(), which works through
+ *  the states below a unit at a time until its budget is spent: one top-level atom header is scanned, or a block of the
+ *  moov atom or the remaining atoms is read. Output waits in pending until the destination takes it, so a destination
+ *  which would block only pauses the flatten.
+ */
+
+#define QTF_STREAM_MAX_DEPTH (16)
+
+typedef enum qtf_flatten_state {
+    qtf_flatten_state_idle = 0, // no flatten has begun
+    qtf_flatten_state_scan,
+    qtf_flatten_state_load, // reading the moov atom into memory
+    qtf_flatten_state_prepare,
+    qtf_flatten_state_write, // writing the ftyp atom and the prepared moov atom
+    qtf_flatten_state_stream, // rewriting a moov atom too large to load
+    qtf_flatten_state_relocate, // copying the atoms moved to follow the moov atom
+    qtf_flatten_state_copy, // copying every other atom
+    qtf_flatten_state_done
+} qtf_flatten_state;
+
+typedef struct qtf_flatten_s
+{
+    qtf_flatten_state state;
+    qtf_result result;
+    qtf_options options;
+    int fd_source;
+    int fd_dest; // -1 until opened
+    bool close_source; // the files were opened by the flatten
+    bool close_dest;
+    char *dst_path;
+    qtf_scan_s scan;
+    void *moov; // NULL if the moov atom is streamed
+    qtf_atom_size moov_size;
+    qtf_atom_size moov_loaded;
+    bool moov_written;
+    // defaults needed to follow the data of fragmented movies
+    qtf_trex_s *trex;
+    uint32_t trex_count;
+    // output waiting to be written
+    const uint8_t *pending;
+    size_t pending_length;
+    // a range of the source to copy as it is
+    off_t copy_offset;
+    qtf_atom_size copy_length;
+    // the next atom of a streamed moov atom, the ends of the containers it is in and any chunk offsets left to update
+    off_t stream_offset;
+    off_t stream_ends[QTF_STREAM_MAX_DEPTH];
+    unsigned int stream_depth;
+    off_t stream_atom_end;
+    uint32_t stream_entry_count;
+    size_t stream_entry_length;
+    uint8_t *stream_buffer;
+    size_t stream_buffer_length;
+    // holes in the source are recreated by seeking the destination, if it is a regular file
+    bool sparse;
+    bool dest_in_hole; // the destination was last seeked rather than written, so must be extended if the flatten ends
+    bool copy_between_files; // the source and destination are files and the output isn't checksummed, so may be copied by the kernel
+    off_t data_end; // the end of the data extent of the source last found
+    uint32_t checksum; // the CRC-32 of the output so far, if options.checksum is set
+    // the next extent of the context's extent list to copy
+    size_t extent_index;
+    // the seek index, if options.index_path is set, written once the flatten has succeeded
+    uint8_t *index;
+    size_t index_length;
+    uint8_t copy_buffer[QTF_FLATTEN_BLOCK_SIZE];
+} qtf_flatten_s;
+
+/*
+ writes as much of the pending output as the destination takes, up to limit bytes. *out_would_block is set if it took none
+ */
+static qtf_result qtf_flatten_write_pending(qtf_flatten_s *job, size_t limit, size_t *io_used, bool *out_would_block)
+{
+    ssize_t written = write(job->fd_dest, job->pending, MIN(job->pending_length, limit));
+    if (written == -1)
+    {
+        if (errno == EINTR) return qtf_result_ok;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            *out_would_block = true;
+            return qtf_result_ok;
+        }
+        return qtf_result_file_write_error;
+    }
+    else if (written == 0)
+    {
+        return qtf_result_file_write_error;
+    }
+    if (job->options.checksum) job->checksum = (uint32_t)crc32(job->checksum, job->pending, (uInt)written);
+    job->pending += written;
+    job->pending_length -= written;
+    job->dest_in_hole = false;
+    *io_used += written;
+    return qtf_result_ok;
+}
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+/*
+ continues crc with length zero bytes, for holes which are seeked over rather than written
+ */
+static uint32_t qtf_crc32_zeros(uint32_t crc, qtf_atom_size length)
+{
+    static const uint8_t zeros[QTF_COPY_BUFFER_SIZE];
+    while (length > 0) {
+        size_t block_length = (size_t)MIN(length, QTF_COPY_BUFFER_SIZE);
+        crc = (uint32_t)crc32(crc, zeros, (uInt)block_length);
+        length -= block_length;
+    }
+    return crc;
+}
+#endif
+
+/*
+ reads the next block of the range being copied into the pending output
+ */
+static qtf_result qtf_flatten_copy_block(qtf_flatten_s *job, size_t limit, size_t *io_used)
+{
+    qtf_result result = qtf_result_ok;
+    size_t length = (size_t)MIN(MIN(job->copy_length, QTF_FLATTEN_BLOCK_SIZE), limit);
+    
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if (job->sparse && job->copy_offset >= job->data_end)
+    {
+        // find the extent the range starts in
+        qtf_atom_size hole_length = 0;
+        off_t data = lseek(job->fd_source, job->copy_offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) hole_length = job->copy_length; // a hole to the end of the file
+        else if (data == -1) job->sparse = false; // the file system can't tell us
+        else if (data > job->copy_offset) hole_length = MIN((qtf_atom_size)(data - job->copy_offset), job->copy_length);
+        
+        if (hole_length > 0)
+        {
+            // skip the hole in both files
+            if (lseek(job->fd_dest, (off_t)hole_length, SEEK_CUR) == -1) return qtf_result_file_write_error;
+            if (job->options.checksum) job->checksum = qtf_crc32_zeros(job->checksum, hole_length);
+            job->copy_offset += hole_length;
+            job->copy_length -= hole_length;
+            job->dest_in_hole = true;
+            return qtf_result_ok;
+        }
+        if (job->sparse)
+        {
+            off_t hole = lseek(job->fd_source, job->copy_offset, SEEK_HOLE);
+            job->data_end = hole == -1 ? job->copy_offset + (off_t)job->copy_length : hole;
+        }
+    }
+    if (job->sparse) length = (size_t)MIN(length, (qtf_atom_size)(job->data_end - job->copy_offset));
+#endif
+#if defined(__linux__)
+    if (job->copy_between_files)
+    {
+        // the kernel copies (or shares) the blocks itself, without them passing through the copy buffer
+        loff_t range_offset = job->copy_offset;
+        ssize_t copied = copy_file_range(job->fd_source, &range_offset, job->fd_dest, NULL, length, 0);
+        if (copied == -1 && errno == EINTR) return qtf_result_ok;
+        if (copied > 0)
+        {
+            job->copy_offset += copied;
+            job->copy_length -= (qtf_atom_size)copied;
+            job->dest_in_hole = false;
+            *io_used += (size_t)copied;
+            return qtf_result_ok;
+        }
+        // the file systems can't, so read and write
+        job->copy_between_files = false;
+    }
+#endif
+    if (lseek(job->fd_source, job->copy_offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+    if (result == qtf_result_ok) result = qtf_read(job->fd_source, job->copy_buffer, length);
+    if (result == qtf_result_ok)
+    {
+        job->pending = job->copy_buffer;
+        job->pending_length = length;
+        job->copy_offset += length;
+        job->copy_length -= length;
+        *io_used += length;
+    }
+    return result;
+}
+
+/*
+ opens the destination if necessary and queues the ftyp atom, if there is one
+ */
+static qtf_result qtf_flatten_begin_write(qtf_flatten_s *job)
+{
+    if (job->fd_dest == -1)
+    {
+        job->fd_dest = qtf_open_for_writing(job->dst_path);
+        if (job->fd_dest == -1) return qtf_result_file_write_error;
+    }
+    struct stat dest_status;
+    bool dest_is_file = fstat(job->fd_dest, &dest_status) == 0 && S_ISREG(dest_status.st_mode);
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    job->sparse = dest_is_file;
+#endif
+#if defined(__linux__)
+    // output which must pass through memory to be checksummed is read and written
+    job->copy_between_files = dest_is_file && !job->options.checksum;
+#endif
+    if (job->scan.ftyp != NULL)
+    {
+        job->pending = job->scan.ftyp;
+        job->pending_length = (size_t)job->scan.ftyp_size;
+    }
+    job->state = qtf_flatten_state_write;
+    return qtf_result_ok;
+}
+
+static qtf_result qtf_flatten_step_scan(qtf_context *context, qtf_flatten_s *job, size_t *io_used)
+{
+    qtf_result result = qtf_scan_next_atom(context, &job->scan, job->fd_source, &context->edit_list, &context->extent_list, io_used);
+    
+    if (result == qtf_result_ok && job->scan.done)
+    {
+        // any relocated atoms follow the moov atom
+        if (job->scan.relocated_size > 0)
+        {
+            result = qtf_edit_list_add_edit(&context->edit_list, job->scan.ftyp_size, job->scan.relocated_size);
+        }
+        job->moov_size = job->scan.moov_size;
+        if (result == qtf_result_ok && job->scan.moov_streamed && job->options.index_path != NULL)
+        {
+            // a seek index is built from the whole moov atom
+            result = qtf_result_file_too_complex;
+        }
+        else if (result == qtf_result_ok && job->scan.moov_streamed)
+        {
+            // the moov atom will be streamed to its new position unchanged in size
+            result = qtf_edit_list_add_edit(&context->edit_list, job->scan.ftyp_size, job->moov_size);
+            job->stream_buffer_length = qtf_stream_buffer_length(job->options.memory_limit);
+            job->stream_buffer = qtf_buffer_reserve(&context->atom_buffer, job->stream_buffer_length);
+            if (job->stream_buffer == NULL) result = qtf_result_memory_error;
+            // the moov atom is treated as a container holding only itself
+            job->stream_offset = job->scan.moov_offset;
+            job->stream_ends[0] = job->scan.moov_offset + job->moov_size;
+            job->stream_depth = 1;
+            if (result == qtf_result_ok) result = qtf_flatten_begin_write(job);
+        }
+        else if (result == qtf_result_ok)
+        {
+            // We can only work with the atom if we can load it all in memory, fail otherwise
+            if (job->moov_size <= SIZE_MAX) job->moov = qtf_buffer_reserve(&context->moov_buffer, (size_t)job->moov_size);
+            if (job->moov == NULL) result = qtf_result_memory_error;
+            job->state = qtf_flatten_state_load;
+        }
+    }
+    return result;
+}
+
+static qtf_result qtf_flatten_step_load(qtf_flatten_s *job, size_t limit, size_t *io_used)
+{
+    qtf_result result = qtf_result_ok;
+    size_t length = (size_t)MIN(job->moov_size - job->moov_loaded, limit);
+    
+    if (lseek(job->fd_source, job->scan.moov_offset + job->moov_loaded, SEEK_SET) == -1) result = qtf_result_file_read_error;
+    if (result == qtf_result_ok) result = qtf_read(job->fd_source, (uint8_t *)job->moov + job->moov_loaded, length);
+    if (result == qtf_result_ok)
+    {
+        job->moov_loaded += length;
+        *io_used += length;
+        if (job->moov_loaded == job->moov_size) job->state = qtf_flatten_state_prepare;
+    }
+    return result;
+}
+
+/*
+ decompresses and prepares the moov atom in one go, counting the whole atom against the budget
+ */
+static qtf_result qtf_flatten_step_prepare(qtf_context *context, qtf_flatten_s *job, size_t *io_used)
+{
+    qtf_box_tree_s *atom_tree = &context->atom_tree;
+    qtf_result result = qtf_decompress_movie_atom(context, &job->moov, &job->moov_size, 0);
+    
+    if (result == qtf_result_ok) result = qtf_box_tree_parse(atom_tree, job->moov, job->moov_size);
+    if (result == qtf_result_ok) result = qtf_trex_load(atom_tree, qtf_box_find(atom_tree, 0, QTF_FCC_mvex), &job->trex, &job->trex_count);
+    if (result == qtf_result_ok)
+    {
+        *io_used += (size_t)MIN(job->moov_size, SIZE_MAX);
+        result = qtf_prepare_movie_atom(context, &context->edit_list, job->scan.ftyp_size, &job->moov, &job->moov_size,
+                                        job->options.allow_compressed_moov_atom);
+    }
+    // the moov tree holds the prepared atom, before any compression
+    if (result == qtf_result_ok && job->options.index_path != NULL)
+    {
+        result = qtf_index_build(&context->moov_tree, &job->index, &job->index_length);
+    }
+    if (result == qtf_result_ok) result = qtf_flatten_begin_write(job);
+    return result;
+}
+
+static qtf_result qtf_flatten_step_write(qtf_flatten_s *job)
+{
+    if (!job->moov_written)
+    {
+        job->moov_written = true;
+        if (job->moov != NULL)
+        {
+            job->pending = job->moov;
+            job->pending_length = (size_t)job->moov_size;
+        }
+    }
+    else if (job->moov != NULL)
+    {
+        job->state = job->scan.relocated_size > 0 ? qtf_flatten_state_relocate : qtf_flatten_state_copy;
+    }
+    else
+    {
+        job->state = qtf_flatten_state_stream;
+    }
+    return qtf_result_ok;
+}
+
+/*
+ rewrites the next part of a streamed moov atom: container headers are written as they are before their children, chunk
+ offsets are updated a block at a time and other atoms are copied
+ */
+static qtf_result qtf_flatten_step_stream(qtf_context *context, qtf_flatten_s *job, size_t limit, size_t *io_used)
+{
+    qtf_result result = qtf_result_ok;
+    uint8_t *atom_header = job->copy_buffer;
+    qtf_atom_size size = 0;
+    uint32_t type = 0;
+    size_t bytes_read = 0;
+    
+    if (job->copy_length > 0) return qtf_flatten_copy_block(job, limit, io_used);
+    
+    if (job->stream_entry_count > 0)
+    {
+        uint32_t block_count = (uint32_t)MIN(job->stream_entry_count, MAX(MIN(job->stream_buffer_length, limit) / job->stream_entry_length, 1));
+        size_t block_length = block_count * job->stream_entry_length;
+        if (lseek(job->fd_source, job->stream_offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+        if (result == qtf_result_ok) result = qtf_read(job->fd_source, job->stream_buffer, block_length);
+        if (result == qtf_result_ok)
+        {
+            result = qtf_offsets_apply_list_entries(job->stream_buffer, block_count, job->stream_entry_length, &context->edit_list);
+        }
+        if (result == qtf_result_ok)
+        {
+            job->pending = job->stream_buffer;
+            job->pending_length = block_length;
+            job->stream_offset += block_length;
+            job->stream_entry_count -= block_count;
+            *io_used += block_length;
+            if (job->stream_entry_count == 0)
+            {
+                // anything following the entries is copied as it is
+                job->copy_offset = job->stream_offset;
+                job->copy_length = job->stream_atom_end - job->stream_offset;
+                job->stream_offset = job->stream_atom_end;
+            }
+        }
+        return result;
+    }
+    
+    off_t end = job->stream_ends[job->stream_depth - 1];
+    if (job->stream_offset + 8 > end)
+    {
+        // fewer than 8 trailing bytes (such as a QuickTime 32-bit terminator) are copied as they are
+        job->copy_offset = job->stream_offset;
+        job->copy_length = end - job->stream_offset;
+        job->stream_offset = end;
+        job->stream_depth--;
+        if (job->stream_depth == 0)
+        {
+            job->state = job->scan.relocated_size > 0 ? qtf_flatten_state_relocate : qtf_flatten_state_copy;
+        }
+        return result;
+    }
+    
+    if (lseek(job->fd_source, job->stream_offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+    if (result == qtf_result_ok) result = qtf_read_atom_header(job->fd_source, atom_header, QTF_COPY_BUFFER_SIZE, &type, &size, &bytes_read);
+    if (result == qtf_result_ok && size == 0) size = end - job->stream_offset;
+    if (result == qtf_result_ok && (size < bytes_read || size > (qtf_atom_size)(end - job->stream_offset))) result = qtf_result_file_not_movie;
+    if (result != qtf_result_ok) return result;
+    *io_used += bytes_read;
+    
+    if (type == QTF_FCC_mvex && job->trex == NULL && size <= SIZE_MAX)
+    {
+        // mvex atoms are small, load it to read the defaults for any fragments
+        uint8_t *mvex = qtf_buffer_reserve(&context->spare_buffer, (size_t)size);
+        if (mvex == NULL) result = qtf_result_memory_error;
+        if (result == qtf_result_ok)
+        {
+            memcpy(mvex, atom_header, bytes_read);
+            result = qtf_read(job->fd_source, mvex + bytes_read, (size_t)size - bytes_read);
+        }
+        if (result == qtf_result_ok) result = qtf_box_tree_parse(&context->atom_tree, mvex, size);
+        if (result == qtf_result_ok) result = qtf_trex_load(&context->atom_tree, 0, &job->trex, &job->trex_count);
+        if (result == qtf_result_ok)
+        {
+            job->pending = mvex;
+            job->pending_length = (size_t)size;
+            job->stream_offset += size;
+            *io_used += (size_t)size - bytes_read;
+        }
+    }
+    else if (qtf_box_is_container(type) && type != QTF_FCC_cmov)
+    {
+        if (job->stream_depth == QTF_STREAM_MAX_DEPTH) return qtf_result_file_too_complex;
+        job->pending = atom_header;
+        job->pending_length = bytes_read;
+        job->stream_ends[job->stream_depth++] = job->stream_offset + size;
+        job->stream_offset += bytes_read;
+    }
+    else if (type == QTF_FCC_stco || type == QTF_FCC_co64)
+    {
+        // the header, version, flags and entry count
+        size_t entry_length = type == QTF_FCC_stco ? 4 : 8;
+        if (size < bytes_read + 8) result = qtf_result_file_not_movie;
+        if (result == qtf_result_ok) result = qtf_read(job->fd_source, atom_header + bytes_read, 8);
+        if (result == qtf_result_ok)
+        {
+            uint32_t entry_count = qtf_get_32(atom_header + bytes_read + 4);
+            if ((qtf_atom_size)entry_count * entry_length > size - bytes_read - 8) result = qtf_result_file_not_movie;
+            if (result == qtf_result_ok)
+            {
+                job->pending = atom_header;
+                job->pending_length = bytes_read + 8;
+                job->stream_entry_count = entry_count;
+                job->stream_entry_length = entry_length;
+                job->stream_atom_end = job->stream_offset + size;
+                job->stream_offset += bytes_read + 8;
+                *io_used += 8;
+                if (entry_count == 0)
+                {
+                    job->copy_offset = job->stream_offset;
+                    job->copy_length = job->stream_atom_end - job->stream_offset;
+                    job->stream_offset = job->stream_atom_end;
+                }
+            }
+        }
+    }
+    else
+    {
+        job->copy_offset = job->stream_offset;
+        job->copy_length = size;
+        job->stream_offset += size;
+    }
+    return result;
+}
+
+/*
+ copies the next part of the atoms selected by options.relocate_atoms, from the relocated extents found by the scan
+ */
+static qtf_result qtf_flatten_step_relocate(qtf_context *context, qtf_flatten_s *job, size_t limit, size_t *io_used)
+{
+    qtf_extent_list extent_list = &context->extent_list;
+    
+    if (job->copy_length > 0) return qtf_flatten_copy_block(job, limit, io_used);
+    
+    while (job->extent_index < extent_list->count && extent_list->extents[job->extent_index].kind != qtf_extent_relocate) {
+        job->extent_index++;
+    }
+    if (job->extent_index == extent_list->count)
+    {
+        // copy the other extents, from the start again
+        job->extent_index = 0;
+        job->data_end = 0;
+        job->state = qtf_flatten_state_copy;
+        return qtf_result_ok;
+    }
+    qtf_extent_s *extent = &extent_list->extents[job->extent_index++];
+    job->copy_offset = extent->offset;
+    job->copy_length = extent->length;
+    return qtf_result_ok;
+}
+
+/*
+ updates the offsets in a moof, sidx or mfra atom which was at source_offset in the source
+ */
+static qtf_result qtf_patch_atom(qtf_context *context, uint8_t *atom, size_t size, uint32_t type, off_t source_offset,
+                                 const qtf_trex_s *trex, uint32_t trex_count)
+{
+    if (type == QTF_FCC_moof) return qtf_offsets_apply_list_moof(&context->atom_tree, atom, size, source_offset, &context->edit_list, trex, trex_count);
+    if (type == QTF_FCC_sidx) return qtf_offsets_apply_list_sidx(atom, size, source_offset, &context->edit_list);
+    return qtf_offsets_apply_list_mfra(&context->atom_tree, atom, size, &context->edit_list);
+}
+
+/*
+ copies the next part of the extents found by the scan, other than relocated ones, patching the offsets in the atoms of
+ fragmented movies. The moov atom(s) and any free, skip or wide atoms aren't in any extent, so are dropped.
+ */
+static qtf_result qtf_flatten_step_copy(qtf_context *context, qtf_flatten_s *job, size_t limit, size_t *io_used)
+{
+    qtf_result result = qtf_result_ok;
+    qtf_extent_list extent_list = &context->extent_list;
+    
+    if (job->copy_length > 0) return qtf_flatten_copy_block(job, limit, io_used);
+    
+    if (job->extent_index == extent_list->count)
+    {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        // a hole at the end of the destination needs the file extended over it
+        if (job->dest_in_hole)
+        {
+            off_t dest_end = lseek(job->fd_dest, 0, SEEK_CUR);
+            if (dest_end == -1 || ftruncate(job->fd_dest, dest_end) == -1) return qtf_result_file_write_error;
+        }
+#endif
+        job->state = qtf_flatten_state_done;
+        return result;
+    }
+    
+    qtf_extent_s *extent = &extent_list->extents[job->extent_index++];
+    switch (extent->kind) {
+        case qtf_extent_relocate:
+            // relocated atoms have already been written
+            break;
+        case qtf_extent_patch:
+        {
+            // Load the atom, update its offsets and write it to the new file
+            uint8_t *atom = NULL;
+            if (extent->length <= SIZE_MAX) atom = qtf_buffer_reserve(&context->atom_buffer, (size_t)extent->length);
+            if (atom == NULL) result = qtf_result_memory_error;
+            if (result == qtf_result_ok && lseek(job->fd_source, extent->offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+            if (result == qtf_result_ok) result = qtf_read(job->fd_source, atom, (size_t)extent->length);
+            if (result == qtf_result_ok)
+            {
+                result = qtf_patch_atom(context, atom, (size_t)extent->length, extent->type, extent->offset, job->trex, job->trex_count);
+            }
+            if (result == qtf_result_ok)
+            {
+                job->pending = atom;
+                job->pending_length = (size_t)extent->length;
+                *io_used += (size_t)extent->length;
+            }
+            break;
+        }
+        default:
+            job->copy_offset = extent->offset;
+            job->copy_length = extent->length;
+            break;
+    }
+    return result;
+}
+
+/*
+ the flatten is kept by the context so its copy buffer is reused
+ */
+static qtf_result qtf_flatten_begin_job(qtf_context *context, int fd_source, bool close_source, int fd_dest, char *dst_path,
+                                        const qtf_options *options)
+{
+    qtf_flatten_s *job = context->flatten;
+    if (job == NULL) job = context->flatten = malloc(sizeof(qtf_flatten_s));
+    if (job == NULL)
+    {
+        if (close_source) close(fd_source);
+        free(dst_path);
+        return qtf_result_memory_error;
+    }
+    memset(job, 0, offsetof(qtf_flatten_s, copy_buffer));
+    job->state = qtf_flatten_state_scan;
+    job->result = qtf_result_ok;
+    job->options = *options;
+    job->fd_source = fd_source;
+    job->close_source = close_source;
+    job->fd_dest = fd_dest;
+    job->close_dest = dst_path != NULL;
+    job->checksum = (uint32_t)crc32(0, Z_NULL, 0);
+    job->dst_path = dst_path;
+    qtf_scan_init(&job->scan, options->memory_limit);
+    job->scan.relocate_atoms = options->relocate_atoms;
+    qtf_edit_list_clear(&context->edit_list);
+    qtf_extent_list_clear(&context->extent_list);
+    return qtf_result_ok;
+}
+
+/*
+ *  Fan-out
+ *
+ *  qtf_flatten_movie_multi() scans the source and loads its moov atom once, then prepares a moov atom for each variant
+ *  and copies the remaining atoms to every destination as they are read. Destinations whose options would produce the
+ *  same moov atom share one variant.
+ */
+
+typedef struct qtf_variant_s
+{
+    bool allow_compressed_moov_atom;
+    void *moov;
+    qtf_atom_size moov_size;
+    qtf_edit_list_s edit_list; // the edits for this variant's layout, to update the offsets of fragments
+} qtf_variant_s;
+
+typedef struct qtf_fan_out_s
+{
+    int *fds; // one for each destination
+    unsigned int *fd_variants; // the variant written to each destination
+    size_t fd_count;
+    qtf_variant_s *variants;
+    size_t variant_count;
+} qtf_fan_out_s;
+
+static qtf_result qtf_fan_out_write(qtf_fan_out_s *fan_out, const void *buffer, size_t length)
+{
+    qtf_result result = qtf_result_ok;
+    for (size_t i = 0; i < fan_out->fd_count && result == qtf_result_ok; i++) {
+        result = qtf_write(fan_out->fds[i], buffer, length);
+    }
+    return result;
+}
+
+/*
+ prepares a moov atom for each variant from the loaded atom, which is left unchanged in original
+ */
+static qtf_result qtf_fan_out_prepare(qtf_context *context, qtf_fan_out_s *fan_out, const void *original, qtf_atom_size original_size,
+                                      off_t moov_offset)
+{
+    qtf_result result = qtf_result_ok;
+    qtf_edit_list_s removals;
+    qtf_edit_list_init(&removals);
+    // qtf_prepare_movie_atom() adds to the edits made by the scan, so each variant starts from a copy of them
+    if (!qtf_edit_list_copy(&removals, &context->edit_list)) result = qtf_result_memory_error;
+    
+    for (size_t i = 0; i < fan_out->variant_count && result == qtf_result_ok; i++) {
+        qtf_variant_s *variant = &fan_out->variants[i];
+        void *moov = NULL;
+        qtf_atom_size moov_size = original_size;
+        
+        if (!qtf_edit_list_copy(&context->edit_list, &removals)) result = qtf_result_memory_error;
+        if (result == qtf_result_ok)
+        {
+            moov = qtf_buffer_reserve(&context->moov_buffer, (size_t)original_size);
+            if (moov == NULL) result = qtf_result_memory_error;
+            else memcpy(moov, original, (size_t)original_size);
+        }
+        if (result == qtf_result_ok)
+        {
+            result = qtf_prepare_movie_atom(context, &context->edit_list, moov_offset, &moov, &moov_size, variant->allow_compressed_moov_atom);
+        }
+        if (result == qtf_result_ok)
+        {
+            // the prepared atom is in one of the context's buffers, which the next variant reuses
+            variant->moov = malloc((size_t)moov_size);
+            if (variant->moov == NULL || !qtf_edit_list_copy(&variant->edit_list, &context->edit_list)) result = qtf_result_memory_error;
+        }
+        if (result == qtf_result_ok)
+        {
+            memcpy(variant->moov, moov, (size_t)moov_size);
+            variant->moov_size = moov_size;
+        }
+    }
+    free(removals.edits);
+    return result;
+}
+
+/*
+ copies the extents found by the scan to every destination, reading each once. Fragment atoms are updated for each variant
+ */
+static qtf_result qtf_fan_out_copy(qtf_context *context, qtf_fan_out_s *fan_out, int fd_source, qtf_trex_s *trex, uint32_t trex_count)
+{
+    qtf_result result = qtf_result_ok;
+    qtf_extent_list extent_list = &context->extent_list;
+    uint8_t *buffer = malloc(QTF_FLATTEN_BLOCK_SIZE);
+    if (buffer == NULL) result = qtf_result_memory_error;
+    
+    for (size_t e = 0; e < extent_list->count && result == qtf_result_ok; e++) {
+        qtf_extent_s *extent = &extent_list->extents[e];
+        
+        if (extent->kind == qtf_extent_patch)
+        {
+            // Load the atom once, then update a copy of it for each variant
+            size_t size = (size_t)extent->length;
+            uint8_t *atom = NULL;
+            if (extent->length <= SIZE_MAX) atom = qtf_buffer_reserve(&context->atom_buffer, size);
+            if (atom == NULL) result = qtf_result_memory_error;
+            if (result == qtf_result_ok) result = qtf_read_at(fd_source, (uint64_t)extent->offset, atom, size);
+            for (size_t i = 0; i < fan_out->variant_count && result == qtf_result_ok; i++) {
+                qtf_edit_list edit_list = &fan_out->variants[i].edit_list;
+                uint8_t *copy = qtf_buffer_reserve(&context->spare_buffer, size);
+                if (copy == NULL)
+                {
+                    result = qtf_result_memory_error;
+                    break;
+                }
+                memcpy(copy, atom, size);
+                if (extent->type == QTF_FCC_moof) result = qtf_offsets_apply_list_moof(&context->atom_tree, copy, size, extent->offset,
+                                                                                       edit_list, trex, trex_count);
+                else if (extent->type == QTF_FCC_sidx) result = qtf_offsets_apply_list_sidx(copy, size, extent->offset, edit_list);
+                else result = qtf_offsets_apply_list_mfra(&context->atom_tree, copy, size, edit_list);
+                for (size_t j = 0; j < fan_out->fd_count && result == qtf_result_ok; j++) {
+                    if (fan_out->fd_variants[j] == i) result = qtf_write(fan_out->fds[j], copy, size);
+                }
+            }
+        }
+        else
+        {
+            // Copy everything else to every destination, a block at a time
+            off_t offset = extent->offset;
+            qtf_atom_size remaining = extent->length;
+            while (result == qtf_result_ok && remaining > 0) {
+                size_t length = (size_t)MIN(remaining, QTF_FLATTEN_BLOCK_SIZE);
+                result = qtf_read_at(fd_source, (uint64_t)offset, buffer, length);
+                if (result == qtf_result_ok) result = qtf_fan_out_write(fan_out, buffer, length);
+                offset += (off_t)length;
+                remaining -= length;
+            }
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+/*
+ *  Spooling
+ *
+ *  A movie read from a pipe is scanned once as it arrives. The ftyp and moov atoms are kept in memory, free, skip and wide
+ *  atoms are dropped and every other atom is appended to an unlinked spool file, which is copied to the destination after
+ *  the prepared moov atom.
+ */
+
+/*
+ creates an unlinked file in directory, or in the system's temporary directory if directory is NULL
+ */
+static int qtf_spool_create(const char *directory)
+{
+    int fd = -1;
+#if defined(_WIN32)
+    char *path = _tempnam(directory, "qtf");
+    if (path != NULL) fd = _open(path, _O_RDWR | _O_CREAT | _O_EXCL | _O_BINARY | _O_TEMPORARY, _S_IREAD | _S_IWRITE);
+    free(path);
+#else
+    if (directory == NULL) directory = getenv("TMPDIR");
+    if (directory == NULL || directory[0] == '\0') directory = "/tmp";
+#if defined(O_TMPFILE)
+    fd = open(directory, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd != -1) return fd;
+#endif
+    // create a named file and remove it once it is open
+    const char *name = "/qtf-spool-XXXXXX";
+    size_t directory_length = strlen(directory);
+    char *path = malloc(directory_length + strlen(name) + 1);
+    if (path != NULL)
+    {
+        memcpy(path, directory, directory_length);
+        strcpy(path + directory_length, name);
+        fd = mkstemp(path);
+        if (fd != -1) unlink(path);
+        free(path);
+    }
+#endif
+    return fd;
+}
+
+/*
+ reads length bytes from fd_source, or everything up to the end of the file if to_end is true, and appends them to
+ fd_spool, unless fd_spool is -1 in which case they are discarded. *io_can_splice is cleared if fd_source turns out not
+ to be a pipe.
+ */
+static qtf_result qtf_spool_append(int fd_source, int fd_spool, qtf_atom_size length, bool to_end, bool *io_can_splice)
+{
+    qtf_result result = qtf_result_ok;
+    
+#if defined(__linux__)
+    // pages are moved from a pipe to the spool without being copied through a buffer
+    while (fd_spool != -1 && *io_can_splice && (length > 0 || to_end)) {
+        size_t chunk = (size_t)(to_end ? QTF_SPLICE_SIZE : MIN(length, QTF_SPLICE_SIZE));
+        ssize_t moved = splice(fd_source, NULL, fd_spool, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved == -1 && errno == EINTR) continue;
+        if (moved == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            // fd_source isn't a pipe, or the spool's file system can't take spliced pages
+            *io_can_splice = false;
+        }
+        else if (moved == -1)
+        {
+            return qtf_result_file_write_error;
+        }
+        else if (moved == 0)
+        {
+            return to_end ? qtf_result_ok : qtf_result_file_not_movie;
+        }
+        else if (!to_end)
+        {
+            length -= (qtf_atom_size)moved;
+        }
+    }
+#endif
+    char buffer[QTF_COPY_BUFFER_SIZE];
+    while (result == qtf_result_ok && (length > 0 || to_end)) {
+        size_t chunk = (size_t)(to_end ? QTF_COPY_BUFFER_SIZE : MIN(length, QTF_COPY_BUFFER_SIZE));
+        size_t got = 0;
+        result = qtf_read_available(fd_source, buffer, chunk, &got);
+        if (result == qtf_result_ok && got > 0 && fd_spool != -1) result = qtf_write(fd_spool, buffer, got);
+        if (result == qtf_result_ok && got < chunk)
+        {
+            // the end of the file
+            if (!to_end) result = qtf_result_file_not_movie;
+            break;
+        }
+        if (!to_end) length -= got;
+    }
+    return result;
+}
+
+/*
+ copies length bytes starting at source_offset in fd_source to the current position in fd_dest, in large blocks and
+ without passing through user memory where the platform allows
+ */
+static qtf_result qtf_copy_range(int fd_source, off_t source_offset, qtf_atom_size length, int fd_dest)
+{
+    off_t offset = source_offset;
+    
+#if defined(__linux__)
+    // between files the kernel copies (or shares) the blocks itself, and sendfile() reaches pipes and sockets
+    loff_t range_offset = source_offset;
+    while (length > 0) {
+        ssize_t copied = copy_file_range(fd_source, &range_offset, fd_dest, NULL, (size_t)MIN(length, QTF_SPLICE_SIZE), 0);
+        if (copied == -1 && errno == EINTR) continue;
+        if (copied <= 0) break;
+        length -= (qtf_atom_size)copied;
+    }
+    offset = (off_t)range_offset;
+    while (length > 0) {
+        ssize_t sent = sendfile(fd_dest, fd_source, &offset, (size_t)MIN(length, QTF_SPLICE_SIZE));
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent <= 0) break;
+        length -= (qtf_atom_size)sent;
+    }
+#endif
+    // anything left is copied through a buffer
+    return length > 0 ? qtf_copy_data(fd_source, offset, fd_dest, length) : qtf_result_ok;
+}
+
+/*
+ *  Recording
+ *
+ *  A recorder writes its movie as
+ *
+ *      [ftyp (optional)][free][mdat]
+ *
+ *  appending movie data to the mdat atom at the end of the file. Each checkpoint writes the moov atom so far into the
+ *  space of the free atom (the reserve), followed by a free atom for whatever is left, and updates the size of the mdat
+ *  atom. Nothing after the reserve ever moves, so the recorder's chunk offsets are final when it builds the moov atom.
+ */
+
+typedef struct qtf_recorder_s
+{
+    bool active;
+    int fd;
+    qtf_options options;
+    uint64_t reserve_offset; // the run of free, skip and moov atoms before the movie data which checkpoints replace
+    uint64_t reserve_size;
+    uint64_t mdat_offset;
+    size_t mdat_header_length; // 8 or 16
+    uint64_t moov_size; // the stored size of the moov atom in the reserve, 0 if there isn't one
+    bool moov_compressed;
+    uint32_t checkpoints;
+    qtf_result result; // the result of the last checkpoint
+} qtf_recorder_s;
+
+/*
+ finds the mdat atom and the last run of free, skip and moov atoms before it, which becomes the reserve
+ */
+static qtf_result qtf_record_scan(qtf_recorder_s *recorder)
+{
+    qtf_result result = qtf_result_ok;
+    uint64_t offset = 0;
+    uint64_t run_offset = 0;
+    uint64_t run_size = 0;
+    uint64_t run_moov_size = 0; // the size of the moov atom starting the run, if it does
+    bool run_moov_compressed = false;
+    bool found_mdat = false;
+    
+    while (result == qtf_result_ok && !found_mdat) {
+        uint8_t header[16];
+        uint32_t type = 0;
+        qtf_atom_size size = 0;
+        size_t header_length = 0;
+        if (lseek(recorder->fd, (off_t)offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+        if (result == qtf_result_ok) result = qtf_read_atom_header(recorder->fd, header, sizeof(header), &type, &size, &header_length);
+        // there must be an mdat atom, and atoms can't be smaller than their headers
+        if (result == qtf_result_ok && (header_length == 0 || size < header_length)) result = qtf_result_file_not_movie;
+        if (result != qtf_result_ok) break;
+        
+        bool reservable = type == QTF_FCC_free || type == QTF_FCC_skip || type == QTF_FCC_moov;
+        if (reservable && run_size == 0)
+        {
+            run_offset = offset;
+            run_moov_size = type == QTF_FCC_moov ? size : 0;
+            run_moov_compressed = false;
+            if (type == QTF_FCC_moov && size >= header_length + 8 && qtf_read(recorder->fd, header, 8) == qtf_result_ok)
+            {
+                run_moov_compressed = qtf_get_32(header + 4) == QTF_FCC_cmov;
+            }
+        }
+        if (reservable)
+        {
+            run_size += size;
+        }
+        else if (run_size != 0)
+        {
+            // keep the run, in case only atoms such as wide come between it and the movie data
+            recorder->reserve_offset = run_offset;
+            recorder->reserve_size = run_size;
+            recorder->moov_size = run_moov_size;
+            recorder->moov_compressed = run_moov_compressed;
+            run_size = 0;
+        }
+        if (type == QTF_FCC_mdat)
+        {
+            found_mdat = true;
+            recorder->mdat_offset = offset;
+            recorder->mdat_header_length = header_length;
+        }
+        offset += size;
+    }
+    if (result == qtf_result_ok && recorder->reserve_size < 8)
+    {
+        result = qtf_result_file_no_free_space;
+    }
+    return result;
+}
+
+/*
+ writes mdat_size into the size field of the mdat atom's header
+ */
+static qtf_result qtf_record_write_mdat_size(qtf_recorder_s *recorder, uint64_t mdat_size)
+{
+    uint8_t field[8];
+    size_t field_length = 4;
+    uint64_t field_offset = recorder->mdat_offset;
+    
+    if (recorder->mdat_header_length == 16)
+    {
+        qtf_put_64(field, mdat_size);
+        field_length = 8;
+        field_offset += 8;
+    }
+    else
+    {
+        // 0 extends the atom to the end of the file, which the last atom may do
+        qtf_put_32(field, mdat_size > UINT32_MAX ? 0 : (uint32_t)mdat_size);
+    }
+    if (lseek(recorder->fd, (off_t)field_offset, SEEK_SET) == -1) return qtf_result_file_write_error;
+    return qtf_write(recorder->fd, field, field_length);
+}
+
+/*
+ appends an extent to plan, which has room for it, following the last
+ */
+static void qtf_plan_add_extent(qtf_plan *plan, uint64_t source_offset, uint64_t length, const void *data)
+{
+    qtf_extent *extent = &plan->extents[plan->extent_count++];
+    extent->dest_offset = plan->dest_length;
+    extent->source_offset = source_offset;
+    extent->length = length;
+    extent->data = data;
+    plan->dest_length += length;
+}
+
+/*
+ *  Already flat movies
+ *
+ *  A movie whose moov atom already follows its ftyp atom, with nothing to drop or move, would be written out unchanged
+ *  by a flatten. Such movies are cloned or hard linked to the destination where that is possible and allowed, and are
+ *  otherwise copied as a single extent.
+ */
+
+/*
+ returns true if flattening the movie found by the completed scan with options would reproduce it unchanged: the first
+ moov atom directly follows any ftyp atom, is compressed exactly when options allow it, and every other atom is kept,
+ with any relocated atoms already following the moov atom. a compressed moov atom may be followed by the free atom which
+ qtf_prepare_movie_atom() pads it out with. moov is the loaded moov atom as it is in the source, or NULL if it is streamed
+ (so is uncompressed)
+ */
+static bool qtf_scan_is_flat(qtf_extent_list extent_list, const qtf_scan_s *scan, const uint8_t *moov, const qtf_options *options)
+{
+    if (scan->moov_offset != (off_t)scan->ftyp_size) return false;
+    
+    bool compressed = false;
+    if (moov != NULL)
+    {
+        size_t header_length = (scan->moov_size >= 16 && qtf_get_32(moov) == 1) ? 16 : 8;
+        compressed = scan->moov_size >= header_length + 8 && qtf_get_32(moov + header_length + 4) == QTF_FCC_cmov;
+    }
+    if (compressed != options->allow_compressed_moov_atom) return false;
+    
+    off_t end = scan->moov_offset + (off_t)scan->moov_size;
+    // the scan drops the padding, so it would otherwise be seen as a gap
+    if (compressed) end += (off_t)scan->moov_padding;
+    
+    // any gap between the extents is an atom which would be dropped
+    bool copied = false;
+    for (size_t i = 0; i < extent_list->count; i++) {
+        qtf_extent_s *extent = &extent_list->extents[i];
+        if (extent->offset != end || (extent->kind == qtf_extent_relocate && copied)) return false;
+        if (extent->kind != qtf_extent_relocate) copied = true;
+        end += (off_t)extent->length;
+    }
+    // the scan ends at the end of the file
+    return end == scan->offset;
+}
+
+/*
+ creates dst_path as a clone of the source (which shares its blocks until either is changed) or, if options allow it, as a
+ hard link to it, returning true on success. Nothing is left at dst_path otherwise.
+ */
+static bool qtf_clone_movie(int fd_source, const char *src_path, const char *dst_path, const qtf_options *options)
+{
+    bool cloned = false;
+#if defined(__APPLE__)
+    cloned = clonefile(src_path, dst_path, 0) == 0;
+#elif defined(__linux__) && defined(FICLONE)
+    int fd_dest = qtf_open_for_writing(dst_path);
+    if (fd_dest != -1)
+    {
+        cloned = ioctl(fd_dest, FICLONE, fd_source) == 0;
+        if (close(fd_dest) != 0) cloned = false;
+        if (!cloned) remove(dst_path);
+    }
+#endif
+#if !defined(_WIN32)
+    // a hard link is the same file, so changes to either show in both
+    if (!cloned && options->allow_hard_link) cloned = link(src_path, dst_path) == 0;
+#endif
+    return cloned;
+}
+
+/*
+ *  Public Functions
+ */
+
+void qtf_options_init(qtf_options *options)
+{
+    options->allow_compressed_moov_atom = false;
+    options->memory_limit = 0;
+    options->punch_holes = false;
+    options->checksum = false;
+    options->compression_effort_ms = 0;
+    options->relocate_atoms = 0;
+    options->index_path = NULL;
+    options->allow_hard_link = false;
+}
+
+qtf_result qtf_flatten_movie(const char *src_path, const char *dst_path, bool allow_compressed_moov_atom)
+{
+    qtf_options options;
+    qtf_options_init(&options);
+    options.allow_compressed_moov_atom = allow_compressed_moov_atom;
+    qtf_result result = qtf_flatten_movie_ex(NULL, src_path, dst_path, &options);
+    // qtf_result_already_flat is only returned by the _ex functions, existing callers expect qtf_result_ok
+    return result == qtf_result_already_flat ? qtf_result_ok : result;
+}
+
+qtf_result qtf_flatten_movie_ex(qtf_context *context, const char *src_path, const char *dst_path, const qtf_options *options)
+{
+    if (context == NULL)
+    {
+        // use a temporary context
+        context = qtf_context_create();
+        if (context == NULL) return qtf_result_memory_error;
+        qtf_result result = qtf_flatten_movie_ex(context, src_path, dst_path, options);
+        qtf_context_destroy(context);
+        return result;
+    }
+    
+    bool flat = false;
+    qtf_result result = qtf_flatten_begin(context, src_path, dst_path, options);
+    if (result == qtf_result_ok)
+    {
+        // scan and load the moov atom, which is enough to recognise an already flat movie before anything is written
+        qtf_flatten_s *job = context->flatten;
+        while (job->result == qtf_result_ok && (job->state == qtf_flatten_state_scan || job->state == qtf_flatten_state_load)) {
+            size_t used = 0;
+            if (job->state == qtf_flatten_state_scan) job->result = qtf_flatten_step_scan(context, job, &used);
+            else job->result = qtf_flatten_step_load(job, SIZE_MAX, &used);
+        }
+        flat = job->result == qtf_result_ok && qtf_scan_is_flat(&context->extent_list, &job->scan, job->moov, options);
+        // a clone has no checksum or seek index to give, and a streamed moov atom has already opened the destination
+        if (flat && !options->checksum && options->index_path == NULL && job->state == qtf_flatten_state_prepare
+            && qtf_clone_movie(job->fd_source, src_path, dst_path, options))
+        {
+            job->state = qtf_flatten_state_done;
+        }
+        // otherwise an already flat movie is copied as a single extent after its moov atom
+        while (qtf_flatten_step(context, SIZE_MAX) == qtf_step_progress);
+        result = qtf_flatten_end(context);
+    }
+    if (result == qtf_result_ok && flat) result = qtf_result_already_flat;
+    return result;
+}
+
+qtf_result qtf_flatten_begin(qtf_context *context, const char *src_path, const char *dst_path, const qtf_options *options)
+{
+    // open source
+    int fd_source = qtf_open_for_reading(src_path);
+    if (fd_source == -1)
+    {
+        return qtf_result_file_read_error;
+    }
+    // the destination is created once the moov atom is ready to write
+    size_t dst_path_length = strlen(dst_path) + 1;
+    char *dst_path_copy = malloc(dst_path_length);
+    if (dst_path_copy == NULL)
+    {
+        close(fd_source);
+        return qtf_result_memory_error;
+    }
+    memcpy(dst_path_copy, dst_path, dst_path_length);
+    return qtf_flatten_begin_job(context, fd_source, true, -1, dst_path_copy, options);
+}
+
+qtf_result qtf_flatten_begin_fd(qtf_context *context, int fd_source, int fd_dest, const qtf_options *options)
+{
+    return qtf_flatten_begin_job(context, fd_source, false, fd_dest, NULL, options);
+}
+
+qtf_step qtf_flatten_step(qtf_context *context, size_t budget_bytes)
+{
+    qtf_flatten_s *job = context->flatten;
+    size_t used = 0;
+    
+    if (job == NULL || job->state == qtf_flatten_state_idle) return qtf_step_done;
+    // every step does something
+    if (budget_bytes == 0) budget_bytes = 1;
+    
+    while (job->result == qtf_result_ok && job->state != qtf_flatten_state_done && used < budget_bytes) {
+        size_t limit = budget_bytes - used;
+        if (job->pending_length > 0)
+        {
+            bool would_block = false;
+            job->result = qtf_flatten_write_pending(job, limit, &used, &would_block);
+            if (would_block) return qtf_step_would_block;
+            continue;
+        }
+        switch (job->state) {
+            case qtf_flatten_state_scan:
+                job->result = qtf_flatten_step_scan(context, job, &used);
+                break;
+            case qtf_flatten_state_load:
+                job->result = qtf_flatten_step_load(job, limit, &used);
+                break;
+            case qtf_flatten_state_prepare:
+                job->result = qtf_flatten_step_prepare(context, job, &used);
+                break;
+            case qtf_flatten_state_write:
+                job->result = qtf_flatten_step_write(job);
+                break;
+            case qtf_flatten_state_stream:
+                job->result = qtf_flatten_step_stream(context, job, limit, &used);
+                break;
+            case qtf_flatten_state_relocate:
+                job->result = qtf_flatten_step_relocate(context, job, limit, &used);
+                break;
+            case qtf_flatten_state_copy:
+                job->result = qtf_flatten_step_copy(context, job, limit, &used);
+                break;
+            default:
+                break;
+        }
+    }
+    if (job->result != qtf_result_ok || job->state == qtf_flatten_state_done) return qtf_step_done;
+    return qtf_step_progress;
+}
+
+uint32_t qtf_flatten_checksum(const qtf_context *context)
+{
+    const qtf_flatten_s *job = context->flatten;
+    if (job == NULL || !job->options.checksum) return 0;
+    return job->checksum;
+}
+
+qtf_result qtf_flatten_end(qtf_context *context)
+{
+    qtf_flatten_s *job = context->flatten;
+    
+    if (job == NULL || job->state == qtf_flatten_state_idle) return qtf_result_ok;
+    
+    qtf_result result = job->result;
+    // a flatten ended early hasn't written its destination
+    if (result == qtf_result_ok && job->state != qtf_flatten_state_done) result = qtf_result_file_write_error;
+    if (result == qtf_result_ok && job->index != NULL) result = qtf_index_write(job->options.index_path, job->index, job->index_length);
+    
+    free(job->trex);
+    free(job->index);
+    job->index = NULL;
+    if (job->close_source) close(job->fd_source);
+    if (job->close_dest && job->fd_dest != -1) close(job->fd_dest);
+    free(job->dst_path);
+    job->state = qtf_flatten_state_idle;
+    return result;
+}
+
+qtf_result qtf_plan_flatten(qtf_context *context, const char *src_path, const qtf_options *options, qtf_plan *out_plan)
+{
+    if (context == NULL)
+    {
+        // use a temporary context, the plan holds its own copy of everything it needs
+        context = qtf_context_create();
+        if (context == NULL) return qtf_result_memory_error;
+        qtf_result result = qtf_plan_flatten(context, src_path, options, out_plan);
+        qtf_context_destroy(context);
+        return result;
+    }
+    
+    qtf_result result = qtf_result_ok;
+    qtf_extent_list extent_list = &context->extent_list;
+    qtf_scan_s scan;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = 0;
+    qtf_trex_s *trex = NULL;
+    uint32_t trex_count = 0;
+    size_t bytes_read = 0;
+    
+    memset(out_plan, 0, sizeof(qtf_plan));
+    int fd_source = qtf_open_for_reading(src_path);
+    if (fd_source == -1) return qtf_result_file_read_error;
+    
+    qtf_scan_init(&scan, options->memory_limit);
+    scan.relocate_atoms = options->relocate_atoms;
+    qtf_edit_list_clear(&context->edit_list);
+    qtf_extent_list_clear(extent_list);
+    while (result == qtf_result_ok && !scan.done) {
+        result = qtf_scan_next_atom(context, &scan, fd_source, &context->edit_list, extent_list, &bytes_read);
+    }
+    // the moov atom is held by the plan, so must fit in memory
+    if (result == qtf_result_ok && scan.moov_streamed) result = qtf_result_file_too_complex;
+    if (result == qtf_result_ok)
+    {
+        // any relocated atoms follow the moov atom
+        if (scan.relocated_size > 0) result = qtf_edit_list_add_edit(&context->edit_list, scan.ftyp_size, scan.relocated_size);
+        if (result == qtf_result_ok) result = qtf_load_movie_atom(context, fd_source, scan.moov_offset, scan.moov_size, &atom_moov, &atom_moov_size);
+    }
+    if (result == qtf_result_ok) result = qtf_box_tree_parse(&context->atom_tree, atom_moov, atom_moov_size);
+    if (result == qtf_result_ok) result = qtf_trex_load(&context->atom_tree, qtf_box_find(&context->atom_tree, 0, QTF_FCC_mvex), &trex, &trex_count);
+    if (result == qtf_result_ok)
+    {
+        result = qtf_prepare_movie_atom(context, &context->edit_list, scan.ftyp_size, &atom_moov, &atom_moov_size,
+                                        options->allow_compressed_moov_atom);
+    }
+    if (result == qtf_result_ok)
+    {
+        // the moov atom and the patched atoms are written from the plan's storage, everything else is copied from the source
+        size_t extent_count = (scan.ftyp_size > 0 ? 1 : 0) + 1 + extent_list->count;
+        uint64_t storage_length = atom_moov_size;
+        for (size_t i = 0; i < extent_list->count; i++) {
+            if (extent_list->extents[i].kind == qtf_extent_patch) storage_length += extent_list->extents[i].length;
+        }
+        if (storage_length <= SIZE_MAX) out_plan->storage = malloc((size_t)storage_length);
+        out_plan->extents = malloc(sizeof(qtf_extent) * extent_count);
+        if (out_plan->storage == NULL || out_plan->extents == NULL) result = qtf_result_memory_error;
+    }
+    if (result == qtf_result_ok)
+    {
+        uint8_t *storage = out_plan->storage;
+        if (scan.ftyp_size > 0) qtf_plan_add_extent(out_plan, 0, scan.ftyp_size, NULL);
+        memcpy(storage, atom_moov, (size_t)atom_moov_size);
+        qtf_plan_add_extent(out_plan, 0, atom_moov_size, storage);
+        storage += atom_moov_size;
+        for (size_t i = 0; i < extent_list->count; i++) {
+            qtf_extent_s *extent = &extent_list->extents[i];
+            if (extent->kind == qtf_extent_relocate) qtf_plan_add_extent(out_plan, (uint64_t)extent->offset, extent->length, NULL);
+        }
+        for (size_t i = 0; i < extent_list->count && result == qtf_result_ok; i++) {
+            qtf_extent_s *extent = &extent_list->extents[i];
+            if (extent->kind == qtf_extent_copy)
+            {
+                qtf_plan_add_extent(out_plan, (uint64_t)extent->offset, extent->length, NULL);
+            }
+            else if (extent->kind == qtf_extent_patch)
+            {
+                if (lseek(fd_source, extent->offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
+                if (result == qtf_result_ok) result = qtf_read(fd_source, storage, (size_t)extent->length);
+                if (result == qtf_result_ok)
+                {
+                    result = qtf_patch_atom(context, storage, (size_t)extent->length, extent->type, extent->offset, trex, trex_count);
+                }
+                if (result == qtf_result_ok) qtf_plan_add_extent(out_plan, 0, extent->length, storage);
+                storage += (size_t)extent->length;
+            }
+        }
+    }
+    free(trex);
+    close(fd_source);
+    if (result != qtf_result_ok) qtf_plan_destroy(out_plan);
+    return result;
+}
+
+qtf_result qtf_plan_execute(const qtf_plan *plan, int fd_source, int fd_dest)
+{
+    qtf_result result = qtf_result_ok;
+    for (size_t i = 0; i < plan->extent_count && result == qtf_result_ok; i++) {
+        const qtf_extent *extent = &plan->extents[i];
+        if (extent->data != NULL) result = qtf_write(fd_dest, extent->data, (size_t)extent->length);
+        else result = qtf_copy_range(fd_source, (off_t)extent->source_offset, extent->length, fd_dest);
+    }
+    return result;
+}
+
+void qtf_plan_destroy(qtf_plan *plan)
+{
+    free(plan->extents);
+    free(plan->storage);
+    memset(plan, 0, sizeof(qtf_plan));
+}
+
+qtf_result qtf_flatten_movie_multi(qtf_context *context, const char *src_path, const char *const *dst_paths,
+                                   const qtf_options *options, size_t count)
+{
+    if (context == NULL)
+    {
+        // use a temporary context
+        context = qtf_context_create();
+        if (context == NULL) return qtf_result_memory_error;
+        qtf_result result = qtf_flatten_movie_multi(context, src_path, dst_paths, options, count);
+        qtf_context_destroy(context);
+        return result;
+    }
+    
+    qtf_result result = qtf_result_ok;
+    qtf_fan_out_s fan_out;
+    void *atom_ftyp = NULL;
+    qtf_atom_size atom_ftyp_size = 0;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = 0;
+    off_t moov_offset = 0;
+    void *original = NULL;
+    qtf_trex_s *trex = NULL;
+    uint32_t trex_count = 0;
+    
+    if (count == 0) return qtf_result_ok;
+    
+    fan_out.fd_count = count;
+    fan_out.variant_count = 0;
+    fan_out.fds = malloc(sizeof(int) * count);
+    fan_out.fd_variants = malloc(sizeof(unsigned int) * count);
+    fan_out.variants = calloc(count, sizeof(qtf_variant_s));
+    if (fan_out.fds == NULL || fan_out.fd_variants == NULL || fan_out.variants == NULL) result = qtf_result_memory_error;
+    for (size_t i = 0; fan_out.fds != NULL && i < count; i++) {
+        fan_out.fds[i] = -1;
+    }
+    
+    // destinations needing the same moov atom share a variant
+    for (size_t i = 0; i < count && result == qtf_result_ok; i++) {
+        size_t v = 0;
+        while (v < fan_out.variant_count && fan_out.variants[v].allow_compressed_moov_atom != options[i].allow_compressed_moov_atom) v++;
+        if (v == fan_out.variant_count)
+        {
+            fan_out.variants[v].allow_compressed_moov_atom = options[i].allow_compressed_moov_atom;
+            qtf_edit_list_init(&fan_out.variants[v].edit_list);
+            fan_out.variant_count++;
+        }
+        fan_out.fd_variants[i] = (unsigned int)v;
+    }
+    
+    int fd_source = result == qtf_result_ok ? qtf_open_for_reading(src_path) : -1;
+    if (result == qtf_result_ok && fd_source == -1) result = qtf_result_file_read_error;
+    
+    qtf_edit_list_clear(&context->edit_list);
+    qtf_extent_list_clear(&context->extent_list);
+    if (result == qtf_result_ok)
+    {
+        result = qtf_scan_movie(context, fd_source, &context->edit_list, &context->extent_list, 0, &atom_ftyp, &atom_ftyp_size,
+                                &atom_moov, &atom_moov_size, &moov_offset);
+    }
+    if (result == qtf_result_ok)
+    {
+        // keep the loaded atom, as the context's buffers are reused to prepare each variant
+        if (atom_moov_size <= SIZE_MAX) original = malloc((size_t)atom_moov_size);
+        if (original == NULL) result = qtf_result_memory_error;
+        else memcpy(original, atom_moov, (size_t)atom_moov_size);
+    }
+    if (result == qtf_result_ok) result = qtf_box_tree_parse(&context->atom_tree, original, atom_moov_size);
+    if (result == qtf_result_ok)
+    {
+        result = qtf_trex_load(&context->atom_tree, qtf_box_find(&context->atom_tree, 0, QTF_FCC_mvex), &trex, &trex_count);
+    }
+    if (result == qtf_result_ok) result = qtf_fan_out_prepare(context, &fan_out, original, atom_moov_size, atom_ftyp_size);
+    
+    for (size_t i = 0; i < count && result == qtf_result_ok; i++) {
+        qtf_variant_s *variant = &fan_out.variants[fan_out.fd_variants[i]];
+        fan_out.fds[i] = qtf_open_for_writing(dst_paths[i]);
+        if (fan_out.fds[i] == -1) result = qtf_result_file_write_error;
+        if (result == qtf_result_ok && atom_ftyp != NULL) result = qtf_write(fan_out.fds[i], atom_ftyp, (size_t)atom_ftyp_size);
+        if (result == qtf_result_ok) result = qtf_write(fan_out.fds[i], variant->moov, (size_t)variant->moov_size);
+    }
+    
+    if (result == qtf_result_ok) result = qtf_fan_out_copy(context, &fan_out, fd_source, trex, trex_count);
+    
+    if (fd_source != -1) close(fd_source);
+    for (size_t i = 0; fan_out.fds != NULL && i < count; i++) {
+        if (fan_out.fds[i] != -1) close(fan_out.fds[i]);
+    }
+    for (size_t i = 0; fan_out.variants != NULL && i < fan_out.variant_count; i++) {
+        free(fan_out.variants[i].moov);
+        free(fan_out.variants[i].edit_list.edits);
+    }
+    free(fan_out.fds);
+    free(fan_out.fd_variants);
+    free(fan_out.variants);
+    free(original);
+    free(trex);
+    return result;
+}
+
+qtf_result qtf_flatten_from_pipe(qtf_context *context, int fd_source, int fd_dest, const char *spool_directory, const qtf_options *options)
+{
+    if (context == NULL)
+    {
+        // use a temporary context
+        context = qtf_context_create();
+        if (context == NULL) return qtf_result_memory_error;
+        qtf_result result = qtf_flatten_from_pipe(context, fd_source, fd_dest, spool_directory, options);
+        qtf_context_destroy(context);
+        return result;
+    }
+    
+    qtf_result result = qtf_result_ok;
+    void *atom_ftyp = NULL;
+    qtf_atom_size atom_ftyp_size = 0;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = 0;
+    qtf_atom_size memory_limit = options->memory_limit;
+    qtf_atom_size source_offset = 0;
+    bool mdat_present = false;
+    bool can_splice = true;
+    bool done = false;
+    uint8_t *index = NULL;
+    size_t index_length = 0;
+    
+    int fd_spool = qtf_spool_create(spool_directory);
+    if (fd_spool == -1) return qtf_result_file_write_error;
+    qtf_edit_list_clear(&context->edit_list);
+    
+    while (result == qtf_result_ok && !done) {
+        uint8_t atom_header[16];
+        size_t bytes_read = 0;
+        result = qtf_read_available(fd_source, atom_header, 8, &bytes_read);
+        if (result != qtf_result_ok) break;
+        if (bytes_read == 0) break;
+        if (bytes_read != 8) result = qtf_result_file_not_movie;
+        
+        qtf_atom_size size = qtf_get_32(atom_header);
+        uint32_t type = qtf_get_32(atom_header + 4);
+        // an atom of size 0 extends to the end of the file
+        bool to_end = size == 0;
+        if (result == qtf_result_ok && size == 1)
+        {
+            result = qtf_read(fd_source, atom_header + 8, 8);
+            bytes_read = 16;
+            size = qtf_get_64(atom_header + 8);
+        }
+        if (result == qtf_result_ok && !to_end && size < bytes_read) result = qtf_result_file_not_movie;
+        if (result != qtf_result_ok) break;
+        
+        switch (type) {
+            case QTF_FCC_ftyp:
+                if (atom_ftyp != NULL || mdat_present || atom_moov != NULL) result = qtf_result_file_not_movie;
+                else if (source_offset != 0 || to_end || (memory_limit != 0 && size > memory_limit)) result = qtf_result_file_too_complex;
+                else result = qtf_load_ftyp_atom(fd_source, atom_header, bytes_read, size, &context->ftyp_buffer, &atom_ftyp);
+                if (result == qtf_result_ok) atom_ftyp_size = size;
+                break;
+            case QTF_FCC_moov:
+                // remove the atom from the file in its current location, we will add it again later
+                result = qtf_edit_list_add_edit(&context->edit_list, source_offset, -(ssize_t)size);
+                if (result == qtf_result_ok && (to_end || (memory_limit != 0 && size > memory_limit)))
+                {
+                    result = qtf_result_file_too_complex;
+                }
+                else if (result == qtf_result_ok && atom_moov == NULL)
+                {
+                    // there should only be one of these, we discard any others
+                    if (size <= SIZE_MAX) atom_moov = qtf_buffer_reserve(&context->moov_buffer, (size_t)size);
+                    if (atom_moov == NULL) result = qtf_result_memory_error;
+                    if (result == qtf_result_ok)
+                    {
+                        memcpy(atom_moov, atom_header, bytes_read);
+                        result = qtf_read(fd_source, (uint8_t *)atom_moov + bytes_read, (size_t)size - bytes_read);
+                    }
+                    atom_moov_size = size;
+                }
+                else if (result == qtf_result_ok)
+                {
+                    result = qtf_spool_append(fd_source, -1, size - bytes_read, false, &can_splice);
+                }
+                break;
+            case QTF_FCC_free:
+            case QTF_FCC_skip:
+            case QTF_FCC_wide:
+                result = qtf_edit_list_add_edit(&context->edit_list, source_offset, -size);
+                if (to_end) done = true;
+                if (result == qtf_result_ok) result = qtf_spool_append(fd_source, -1, to_end ? 0 : size - bytes_read, to_end, &can_splice);
+                break;
+            case QTF_FCC_moof:
+            case QTF_FCC_sidx:
+            case QTF_FCC_mfra:
+                // the offsets in fragments would have to be updated once they are spooled
+                result = qtf_result_file_too_complex;
+                break;
+            case QTF_FCC_mdat:
+                mdat_present = true;
+                // fall through
+            default:
+                result = qtf_write(fd_spool, atom_header, bytes_read);
+                if (result == qtf_result_ok)
+                {
+                    result = qtf_spool_append(fd_source, fd_spool, to_end ? 0 : size - bytes_read, to_end, &can_splice);
+                }
+                if (to_end) done = true;
+                break;
+        }
+        source_offset += size;
+    }
+    
+    // check we can do something with this file
+    if (result == qtf_result_ok && (!mdat_present || atom_moov == NULL)) result = qtf_result_file_too_complex;
+    if (result == qtf_result_ok) result = qtf_decompress_movie_atom(context, &atom_moov, &atom_moov_size, memory_limit);
+    if (result == qtf_result_ok)
+    {
+        result = qtf_prepare_movie_atom(context, &context->edit_list, atom_ftyp_size, &atom_moov, &atom_moov_size,
+                                        options->allow_compressed_moov_atom);
+    }
+    if (result == qtf_result_ok && options->index_path != NULL)
+    {
+        result = qtf_index_build(&context->moov_tree, &index, &index_length);
+    }
+    
+    off_t spool_length = lseek(fd_spool, 0, SEEK_CUR);
+    if (spool_length == -1) result = qtf_result_file_write_error;
+    if (result == qtf_result_ok && atom_ftyp != NULL) result = qtf_write(fd_dest, atom_ftyp, (size_t)atom_ftyp_size);
+    if (result == qtf_result_ok) result = qtf_write(fd_dest, atom_moov, (size_t)atom_moov_size);
+    if (result == qtf_result_ok) result = qtf_copy_range(fd_spool, 0, (qtf_atom_size)spool_length, fd_dest);
+    if (result == qtf_result_ok && index != NULL) result = qtf_index_write(options->index_path, index, index_length);
+    
+    free(index);
+    close(fd_spool);
+    return result;
+}
+
+qtf_result qtf_flatten_movie_in_place(const char *src_path, bool allow_compressed_moov_atom)
+{
+    qtf_options options;
+    qtf_options_init(&options);
+    options.allow_compressed_moov_atom = allow_compressed_moov_atom;
+    qtf_result result = qtf_flatten_movie_in_place_ex(NULL, src_path, &options);
+    // as in qtf_flatten_movie()
+    return result == qtf_result_already_flat ? qtf_result_ok : result;
+}
+
+qtf_result qtf_flatten_movie_in_place_ex(qtf_context *context, const char *src_path, const qtf_options *options)
+{
+    if (context == NULL)
+    {
+        // use a temporary context
+        context = qtf_context_create();
+        if (context == NULL) return qtf_result_memory_error;
+        qtf_result result = qtf_flatten_movie_in_place_ex(context, src_path, options);
+        qtf_context_destroy(context);
+        return result;
+    }
+    
+    qtf_result result = qtf_result_ok;
+#if defined(_WIN32)
+    int fd = _open(src_path, _O_RDWR | _O_BINARY);
+#else
+    int fd = open(src_path, O_RDWR);
+#endif
+
+    if (fd == -1)
+    {
+        return qtf_result_file_read_error;
+    }
+    
+    off_t file_length = 0;
+    result = qtf_get_file_size(fd, &file_length);
+    
+    if (result == qtf_result_ok)
+    {
+        off_t free_start = 0;
+        off_t moov_start = 0;
+        off_t mdat_start = 0;
+        qtf_atom_size free_size = 0;
+        qtf_atom_size moov_size = 0;
+        qtf_atom_size mdat_size = 0;
+        off_t offset = 0;
+        while (result == qtf_result_ok && (moov_size == 0 || free_size == 0 || mdat_size == 0))
+        {
+            uint32_t atom_header[4];
+            uint64_t size = 0;
+            uint32_t type = 0;
+            size_t bytes_read;
+            off_t got = 0;
+            
+            result = qtf_read_atom_header(fd, atom_header, sizeof(atom_header), &type, &size, &bytes_read);
+            
+            if (result != qtf_result_ok || bytes_read == 0) break;
+            
+            if (type == QTF_FCC_free && free_size == 0) // use only the first free atom
+            {
+                free_start = offset;
+                free_size = size;
+            }
+            else if (type == QTF_FCC_wide && offset == (free_start + free_size))
+            {
+                // we can swallow up a wide atom if it immediately follows the free atom
+                free_size += size;
+            }
+            else if (type == QTF_FCC_moov)
+            {
+                moov_start = offset;
+                moov_size = size;
+            }
+            else if (type == QTF_FCC_mdat)
+            {
+                mdat_start = offset;
+                mdat_size = size;
+            }
+            offset += size;
+            got = lseek(fd, size - bytes_read, SEEK_CUR);
+            if (got == -1) result = qtf_result_file_read_error;
+        }
+        
+        // Check there is an mdat atom. This doesn't guarantee this isn't a reference movie
+        if (result == qtf_result_ok && mdat_size == 0)
+        {
+            result = qtf_result_file_too_complex;
+        }
+
+        // Check we can copy the moov atom into memory
+        if (moov_size > SIZE_MAX)
+        {
+            result = qtf_result_memory_error;
+        }
+
+        // Check there is a free atom before the mdat atom and the movie isn't already flattened
+        if (result == qtf_result_ok
+            && (free_start < mdat_start)
+            && (moov_start > mdat_start)
+            && (free_size > 8)
+            && (moov_size > 8))
+        {
+            bool moov_was_at_end = ((moov_start + moov_size) == file_length) ? true : false;
+            // large moov atoms are moved a block at a time rather than loaded, and so can't be compressed
+            bool stream_moov = (options->memory_limit != 0 && moov_size > options->memory_limit);
+            size_t moov_buffer_size = stream_moov ? qtf_stream_buffer_length(options->memory_limit) : (size_t)moov_size;
+            void *moov = qtf_buffer_reserve(stream_moov ? &context->atom_buffer : &context->moov_buffer, moov_buffer_size);
+            if (!moov)
+            {
+                result = qtf_result_memory_error;
+            }
+            if (result == qtf_result_ok)
+            {
+                off_t got = 0;
+                if (!stream_moov)
+                {
+                    got = lseek(fd, moov_start, SEEK_SET);
+                    if (got == -1) result = qtf_result_file_read_error;
+                    if (result == qtf_result_ok)
+                    {
+                        result = qtf_read(fd, moov, (size_t)moov_size);
+                    }
+                }
+                if (result == qtf_result_ok && !stream_moov && options->allow_compressed_moov_atom && !qtf_atom_fits(moov_size, free_size))
+                {
+                    void *compressed = NULL;
+                    size_t compressed_size = 0;
+                    result = qtf_compress_movie_atom_to_fit(context, moov, (size_t)moov_size, free_size, options->compression_effort_ms,
+                                                            &compressed, &compressed_size);
+                    if (compressed_size != 0)
+                    {
+                        // swap our compressed movie atom for the original
+                        qtf_buffer_swap(&context->moov_buffer, &context->spare_buffer);
+                        moov = compressed;
+                        moov_size = compressed_size;
+                    }
+                }
+                // If the moov atom can either replace the free atom entirely
+                // or there is space to insert the moov atom and a new free atom (minimum 8 bytes)
+                if (qtf_atom_fits(moov_size, free_size))
+                {
+                    if (result == qtf_result_ok)
+                    {
+                        got = lseek(fd, free_start, SEEK_SET);
+                        if (got == -1) result = qtf_result_file_read_error;
+                    }
+                    if (result == qtf_result_ok && stream_moov)
+                    {
+                        result = qtf_move_data_backward(fd, moov_start, free_start, moov_size, moov, moov_buffer_size);
+                    }
+                    else if (result == qtf_result_ok)
+                    {
+                        result = qtf_write(fd, moov, (size_t)moov_size);
+                    }
+                    // add a new smaller free after the moov if necessary
+                    if (result == qtf_result_ok && moov_size < free_size)
+                    {
+                        uint32_t new_free_size = qtf_swap_host_to_big_int_32(free_size - moov_size);
+                        uint32_t new_free_type = qtf_swap_host_to_big_int_32(QTF_FCC_free);
+                        result = qtf_write(fd, &new_free_size, 4);
+                        if (result == qtf_result_ok)
+                        {
+                            result = qtf_write(fd, &new_free_type, 4);
+                        }
+                    }
+                    if (result == qtf_result_ok)
+                    {
+                        // If the old moov atom was at the end of the file, truncate the file
+                        // otherwise turn the atom into a free atom
+                        if (moov_was_at_end)
+                        {
+                            ftruncate(fd, moov_start);
+                        }
+                        else
+                        {                            
+                            got = lseek(fd, moov_start + 4, SEEK_SET);
+                            if (got == -1) result = qtf_result_file_read_error;
+                            if (result == qtf_result_ok)
+                            {
+                                uint32_t new_free_type = qtf_swap_host_to_big_int_32(QTF_FCC_free);
+                                result = qtf_write(fd, &new_free_type, 4);
+                            }
+                        }
+                    }
+                }
+                else if (result == qtf_result_ok)
+                {
+                    result = qtf_result_file_no_free_space;
+                }
+            } // end if (moov)
+        }
+        else if (result == qtf_result_ok && moov_start > mdat_start)
+        {
+            // The movie wasn't already flattened and there wasn't a suitable free atom
+            result = qtf_result_file_no_free_space;
+        }
+        else if (result == qtf_result_ok && moov_size != 0)
+        {
+            // The moov atom already precedes the movie data, there is nothing to move
+            result = qtf_result_already_flat;
+        }
+    }
+    if ((result == qtf_result_ok || result == qtf_result_already_flat) && options->punch_holes)
+    {
+        qtf_punch_free_atoms(fd);
+    }
+    close(fd);
+    return result;
+}
+
+qtf_result qtf_fragment_movie(const char *src_path, const char *dst_path, uint32_t fragment_duration_ms)
+{
+    int fd_source = qtf_open_for_reading(src_path);
+    if (fd_source == -1)
+    {
+        return qtf_result_file_read_error;
+    }
+    
+    qtf_result result = qtf_result_ok;
+    void *atom_ftyp = NULL;
+    qtf_atom_size atom_ftyp_size = 0;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = 0;
+    qtf_context *context = qtf_context_create();
+    qtf_box_tree_s *moov_tree = NULL;
+    qtf_track_s *tracks = NULL;
+    uint32_t track_count = 0;
+    qtf_fragment_plan_s plan = {0};
+    uint8_t *init_moov = NULL;
+    size_t init_moov_size = 0;
+    uint8_t *sidx = NULL;
+    size_t sidx_size = 0;
+    uint8_t *moof = NULL;
+    qtf_atom_size *moof_offsets = NULL;
+    int fd_dest = -1;
+    
+    if (fragment_duration_ms == 0) fragment_duration_ms = QTF_DEFAULT_FRAGMENT_DURATION_MS;
+    
+    if (context == NULL) result = qtf_result_memory_error;
+    if (result == qtf_result_ok)
+    {
+        moov_tree = &context->moov_tree;
+        result = qtf_scan_movie(context, fd_source, NULL, NULL, 0, &atom_ftyp, &atom_ftyp_size, &atom_moov, &atom_moov_size, NULL);
+    }
+    
+    if (result == qtf_result_ok)
+    {
+        result = qtf_box_tree_parse(moov_tree, atom_moov, atom_moov_size);
+    }
+    if (result == qtf_result_ok)
+    {
+        if (qtf_box_find(moov_tree, 0, QTF_FCC_mvex) != QTF_BOX_NONE)
+        {
+            // the movie is already fragmented
+            result = qtf_result_file_too_complex;
+        }
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_tracks_load(moov_tree, &tracks, &track_count);
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_fragment_plan_create(tracks, track_count, fragment_duration_ms, &plan);
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_fragment_create_init_movie_atom(moov_tree, &plan, &init_moov, &init_moov_size);
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_fragment_create_sidx_atom(&plan, &sidx, &sidx_size);
+    }
+    if (result == qtf_result_ok)
+    {
+        // allocate once for the largest moof
+        size_t moof_max_size = 0;
+        for (uint32_t f = 0; f < plan.fragment_count; f++) {
+            moof_max_size = MAX(moof_max_size, qtf_fragment_moof_size(&plan, f));
+        }
+        moof = malloc(moof_max_size);
+        moof_offsets = malloc(sizeof(qtf_atom_size) * plan.fragment_count);
+        if (moof == NULL || moof_offsets == NULL) result = qtf_result_memory_error;
+    }
+    if (result == qtf_result_ok)
+    {
+        fd_dest = qtf_open_for_writing(dst_path);
+        if (fd_dest == -1) result = qtf_result_file_write_error;
+    }
+    
+    qtf_atom_size dest_offset = 0;
+    if (result == qtf_result_ok && atom_ftyp != NULL)
+    {
+        result = qtf_write(fd_dest, atom_ftyp, (size_t)atom_ftyp_size);
+        dest_offset += atom_ftyp_size;
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_write(fd_dest, init_moov, init_moov_size);
+        dest_offset += init_moov_size;
+    }
+    if (result == qtf_result_ok && sidx != NULL)
+    {
+        result = qtf_write(fd_dest, sidx, sidx_size);
+        dest_offset += sidx_size;
+    }
+    for (uint32_t f = 0; f < plan.fragment_count && result == qtf_result_ok; f++) {
+        size_t moof_size = qtf_fragment_moof_size(&plan, f);
+        qtf_atom_size data_size = qtf_fragment_data_size(&plan, f);
+        size_t mdat_header_size = qtf_fragment_mdat_header_size(data_size);
+        uint32_t mdat_header[4];
+        
+        moof_offsets[f] = dest_offset;
+        result = qtf_fragment_write_moof(&plan, f, moof);
+        if (result == qtf_result_ok)
+        {
+            result = qtf_write(fd_dest, moof, moof_size);
+        }
+        if (result == qtf_result_ok)
+        {
+            qtf_fragment_write_mdat_header(data_size, mdat_header);
+            result = qtf_write(fd_dest, mdat_header, mdat_header_size);
+        }
+        if (result == qtf_result_ok)
+        {
+            result = qtf_fragment_copy_data(&plan, f, fd_source, fd_dest);
+        }
+        dest_offset += moof_size + mdat_header_size + data_size;
+    }
+    if (result == qtf_result_ok)
+    {
+        uint8_t *mfra = NULL;
+        size_t mfra_size = 0;
+        result = qtf_fragment_create_mfra_atom(&plan, moof_offsets, &mfra, &mfra_size);
+        if (result == qtf_result_ok)
+        {
+            result = qtf_write(fd_dest, mfra, mfra_size);
+        }
+        free(mfra);
+    }
+    
+    free(moof_offsets);
+    free(moof);
+    free(sidx);
+    free(init_moov);
+    qtf_fragment_plan_destroy(&plan);
+    qtf_tracks_destroy(tracks, track_count);
+    qtf_context_destroy(context);
+    close(fd_source);
+    if (fd_dest != -1) close(fd_dest);
+    return result;
+}
+
+qtf_result qtf_interleave_movie(const char *src_path, const char *dst_path, bool allow_compressed_moov_atom, uint32_t interleave_window_ms)
+{
+    int fd_source = qtf_open_for_reading(src_path);
+    if (fd_source == -1)
+    {
+        return qtf_result_file_read_error;
+    }
+    
+    qtf_result result = qtf_result_ok;
+    void *atom_ftyp = NULL;
+    qtf_atom_size atom_ftyp_size = 0;
+    void *atom_moov = NULL;
+    qtf_atom_size atom_moov_size = 0;
+    qtf_context *context = qtf_context_create();
+    qtf_box_tree_s *moov_tree = NULL;
+    qtf_track_s *tracks = NULL;
+    uint32_t track_count = 0;
+    qtf_interleave_chunk_s *chunks = NULL;
+    size_t chunk_count = 0;
+    qtf_atom_size other_atoms_size = 0;
+    qtf_atom_size data_size = 0;
+    size_t mdat_header_size = 8;
+    qtf_edit_list edit_list = NULL;
+    qtf_extent_list extent_list = NULL;
+    int fd_dest = -1;
+    
+    if (context == NULL) result = qtf_result_memory_error;
+    if (result == qtf_result_ok)
+    {
+        moov_tree = &context->moov_tree;
+        extent_list = &context->extent_list;
+        qtf_extent_list_clear(extent_list);
+        result = qtf_scan_movie(context, fd_source, NULL, extent_list, 0, &atom_ftyp, &atom_ftyp_size, &atom_moov, &atom_moov_size, NULL);
+    }
+    
+    if (result == qtf_result_ok)
+    {
+        result = qtf_box_tree_parse(moov_tree, atom_moov, atom_moov_size);
+    }
+    if (result == qtf_result_ok)
+    {
+        if (qtf_box_find(moov_tree, 0, QTF_FCC_mvex) != QTF_BOX_NONE)
+        {
+            // fragmented movies keep their data in their fragments
+            result = qtf_result_file_too_complex;
+        }
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_tracks_load(moov_tree, &tracks, &track_count);
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_interleave_plan_create(tracks, track_count, interleave_window_ms, &chunks, &chunk_count);
+    }
+    if (result == qtf_result_ok)
+    {
+        // the other top-level atoms we keep are the scan's extents other than the movie data, they are written between the
+        // moov and mdat atoms
+        for (size_t i = 0; i < extent_list->count; i++) {
+            if (extent_list->extents[i].type != QTF_FCC_mdat) other_atoms_size += extent_list->extents[i].length;
+        }
+        for (size_t i = 0; i < chunk_count; i++) {
+            data_size += qtf_track_chunk_length(&tracks[chunks[i].track], chunks[i].chunk);
+        }
+        mdat_header_size = qtf_fragment_mdat_header_size(data_size);
+        
+        // set the chunk offsets as if the moov atom were empty, then insert it as for a regular flatten
+        uint64_t offset = atom_ftyp_size + other_atoms_size + mdat_header_size;
+        for (size_t i = 0; i < chunk_count && result == qtf_result_ok; i++) {
+            qtf_track_s *track = &tracks[chunks[i].track];
+            // the offset must still fit once the moov atom is inserted
+            if (offset + atom_moov_size > UINT32_MAX && qtf_get_32(track->chunk_offset_atom + 4) == QTF_FCC_stco)
+            {
+                result = qtf_result_file_too_complex;
+                break;
+            }
+            result = qtf_track_set_chunk_offset(track, chunks[i].chunk, offset);
+            offset += qtf_track_chunk_length(track, chunks[i].chunk);
+        }
+    }
+    if (result == qtf_result_ok)
+    {
+        edit_list = &context->edit_list;
+        qtf_edit_list_clear(edit_list);
+    }
+    if (result == qtf_result_ok)
+    {
+        // the source chunk offsets are kept in tracks, the moov atom may be replaced by a compressed copy here
+        result = qtf_prepare_movie_atom(context, edit_list, atom_ftyp_size, &atom_moov, &atom_moov_size, allow_compressed_moov_atom);
+    }
+    if (result == qtf_result_ok)
+    {
+        fd_dest = qtf_open_for_writing(dst_path);
+        if (fd_dest == -1) result = qtf_result_file_write_error;
+    }
+    if (result == qtf_result_ok && atom_ftyp != NULL)
+    {
+        result = qtf_write(fd_dest, atom_ftyp, (size_t)atom_ftyp_size);
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_write(fd_dest, atom_moov, (size_t)atom_moov_size);
+    }
+    for (size_t i = 0; i < extent_list->count && result == qtf_result_ok; i++) {
+        qtf_extent_s *extent = &extent_list->extents[i];
+        if (extent->type != QTF_FCC_mdat) result = qtf_copy_range(fd_source, extent->offset, extent->length, fd_dest);
+    }
+    if (result == qtf_result_ok)
+    {
+        uint32_t mdat_header[4];
+        qtf_fragment_write_mdat_header(data_size, mdat_header);
+        result = qtf_write(fd_dest, mdat_header, mdat_header_size);
+    }
+    if (result == qtf_result_ok)
+    {
+        // copy the chunks in their new order, merging chunks which are also contiguous in the source
+        uint64_t run_start = 0;
+        qtf_atom_size run_length = 0;
+        for (size_t i = 0; i < chunk_count && result == qtf_result_ok; i++) {
+            const qtf_track_s *track = &tracks[chunks[i].track];
+            qtf_atom_size length = qtf_track_chunk_length(track, chunks[i].chunk);
+            if (length == 0) continue;
+            uint64_t source_offset = track->sample_offsets[track->chunk_first_samples[chunks[i].chunk]];
+            if (run_length != 0 && source_offset != run_start + run_length)
+            {
+                result = qtf_copy_data(fd_source, run_start, fd_dest, run_length);
+                run_length = 0;
+            }
+            if (run_length == 0) run_start = source_offset;
+            run_length += length;
+        }
+        if (result == qtf_result_ok && run_length != 0)
+        {
+            result = qtf_copy_data(fd_source, run_start, fd_dest, run_length);
+        }
+    }
     
-    return qtf_offsets_apply_list(moov_atom, moov_atom_size, &edit_ptr);
+    free(chunks);
+    qtf_tracks_destroy(tracks, track_count);
+    qtf_context_destroy(context);
+    close(fd_source);
+    if (fd_dest != -1) close(fd_dest);
+    return result;
 }
 
-/*
- *  Public Functions
- */
-
-qtf_result qtf_flatten_movie(const char *src_path, const char *dst_path, bool allow_compressed_moov_atom)
+qtf_result qtf_verify(const char *src_path, const char *dst_path, double sample_fraction, unsigned int thread_count)
 {
-    // open source
-#if defined(_WIN32)
-    int fd_source = _open(src_path, _O_RDONLY | _O_BINARY);
-#else
-    int fd_source = open(src_path, O_RDONLY);
-#endif
-    if (fd_source == -1)
+    qtf_result result = qtf_result_ok;
+    qtf_context *context = qtf_context_create();
+    int fd_source = -1;
+    int fd_dest = -1;
+    qtf_track_s *source_tracks = NULL;
+    qtf_track_s *dest_tracks = NULL;
+    uint32_t source_track_count = 0;
+    uint32_t dest_track_count = 0;
+    qtf_range_s *source_ranges = NULL;
+    qtf_range_s *dest_ranges = NULL;
+    uint32_t source_range_count = 0;
+    uint32_t dest_range_count = 0;
+    qtf_verify_chunk_s *chunks = NULL;
+    size_t chunk_count = 0;
+    
+    if (context == NULL) result = qtf_result_memory_error;
+    // the tracks are copied out of the moov atom, so one context can load both movies
+    if (result == qtf_result_ok)
     {
-        return qtf_result_file_read_error;
+        result = qtf_verify_load(context, src_path, &fd_source, &source_tracks, &source_track_count, &source_ranges, &source_range_count);
+    }
+    if (result == qtf_result_ok)
+    {
+        result = qtf_verify_load(context, dst_path, &fd_dest, &dest_tracks, &dest_track_count, &dest_ranges, &dest_range_count);
+        if (result == qtf_result_file_not_movie || result == qtf_result_file_too_complex) result = qtf_result_file_mismatch;
+    }
+    // compare the sample tables
+    if (result == qtf_result_ok && source_track_count != dest_track_count) result = qtf_result_file_mismatch;
+    for (uint32_t t = 0; t < source_track_count && result == qtf_result_ok; t++) {
+        if (!qtf_tracks_equal(&source_tracks[t], &dest_tracks[t])) result = qtf_result_file_mismatch;
+    }
+    // check the chunks are where they should be
+    if (result == qtf_result_ok && !qtf_tracks_within_ranges(source_tracks, source_track_count, source_ranges, source_range_count))
+    {
+        result = qtf_result_file_not_movie;
+    }
+    if (result == qtf_result_ok && !qtf_tracks_within_ranges(dest_tracks, dest_track_count, dest_ranges, dest_range_count))
+    {
+        result = qtf_result_file_mismatch;
+    }
+    // pick the chunks to compare, spread evenly through the movie by a multiplicative hash of their index
+    if (result == qtf_result_ok)
+    {
+        uint64_t threshold = (uint64_t)(MAX(MIN(sample_fraction, 1.0), 0.0) * 4294967296.0);
+        size_t total_chunk_count = 0;
+        for (uint32_t t = 0; t < source_track_count; t++) {
+            total_chunk_count += source_tracks[t].chunk_count;
+        }
+        if (total_chunk_count > 0 && threshold > 0)
+        {
+            chunks = malloc(sizeof(qtf_verify_chunk_s) * total_chunk_count);
+            if (chunks == NULL) result = qtf_result_memory_error;
+        }
+        size_t index = 0;
+        for (uint32_t t = 0; t < source_track_count && chunks != NULL; t++) {
+            for (uint32_t c = 0; c < source_tracks[t].chunk_count; c++, index++) {
+                if ((uint32_t)(index * 2654435761u) >= threshold) continue;
+                qtf_atom_size length = qtf_track_chunk_length(&source_tracks[t], c);
+                if (length == 0) continue;
+                chunks[chunk_count].source_offset = source_tracks[t].chunk_offsets[c];
+                chunks[chunk_count].dest_offset = dest_tracks[t].chunk_offsets[c];
+                chunks[chunk_count].length = length;
+                chunk_count++;
+            }
+        }
+    }
+    if (result == qtf_result_ok && chunk_count > 0)
+    {
+        result = qtf_verify_chunks(fd_source, fd_dest, chunks, chunk_count, thread_count);
+        if (result == qtf_result_file_not_movie) result = qtf_result_file_mismatch;
     }
     
-    // an error, to return when we finish
-    int result = 0;
-    // the atoms we will directly deal with
+    free(chunks);
+    free(source_ranges);
+    free(dest_ranges);
+    if (source_tracks) qtf_tracks_destroy(source_tracks, source_track_count);
+    if (dest_tracks) qtf_tracks_destroy(dest_tracks, dest_track_count);
+    qtf_context_destroy(context);
+    if (fd_source != -1) close(fd_source);
+    if (fd_dest != -1) close(fd_dest);
+    return result;
+}
+
+void qtf_analysis_destroy(qtf_analysis *analysis)
+{
+    free(analysis->atoms);
+    analysis->atoms = NULL;
+    analysis->atom_count = 0;
+}
+
+qtf_result qtf_analyze(const char *src_path, const qtf_options *options, qtf_analysis *out_analysis)
+{
+    qtf_result result = qtf_result_ok;
+    qtf_analysis analysis;
+    uint32_t atom_capacity = 0;
+    // the atoms an in-place flatten would use, found as qtf_flatten_movie_in_place_ex() finds them
+    int64_t free_index = -1;
+    int64_t moov_index = -1;
+    int64_t mdat_index = -1;
     void *atom_ftyp = NULL;
     qtf_atom_size atom_ftyp_size = 0;
     void *atom_moov = NULL;
     qtf_atom_size atom_moov_size = 0;
+    off_t file_size = 0;
     
-    bool atom_mdat_present = false;
+    memset(&analysis, 0, sizeof(qtf_analysis));
     
-    qtf_edit_list edit_list = qtf_edit_list_create();
-    if (edit_list == NULL) result = qtf_result_memory_error;
+    qtf_context *context = qtf_context_create();
+    if (context == NULL) return qtf_result_memory_error;
+    qtf_edit_list edit_list = &context->edit_list;
     
-    off_t offset = 0;
+    int fd = qtf_open_for_reading(src_path);
+    if (fd == -1) result = qtf_result_file_read_error;
+    
+    if (result == qtf_result_ok) result = qtf_get_file_size(fd, &file_size);
+    if (result == qtf_result_ok) analysis.file_size = file_size;
     
-    // copy the ftyp atom if present and the moov atom, get other information we need to ignore free space in the file
+    // record the top-level atoms
+    off_t offset = 0;
+    if (result == qtf_result_ok && lseek(fd, 0, SEEK_SET) == -1) result = qtf_result_file_read_error;
     while (result == qtf_result_ok) {
         uint32_t atom_header[4];
         qtf_atom_size size = 0;
         uint32_t type = 0;
         size_t bytes_read;
-        result = qtf_read_atom_header(fd_source, atom_header, sizeof(atom_header), &type, &size, &bytes_read);
-        
-        if (result != 0 || bytes_read == 0) break;
-        
-        switch (type) {
-            case QTF_FCC_ftyp:
-                // QTFF Chapter 1, The File Type Compatibility Atom
-                // ISO IEC 14496-14 Section 4, File Identification
-                // TODO: could drop 0x0 compatibility atoms (save 3 bytes from QT-built files, woo)
-                if (atom_ftyp_size != 0)
-                {
-                    result = qtf_result_file_not_movie; // there must be only one ftyp atom
-                }
-                else if (offset != 0)
-                {
-                    // This is lazy but most files have their ftyp atom first
-                    result = qtf_result_file_too_complex;
-                }
-                else
-                {
-                    if (bytes_read != 8 || size < 20) result = qtf_result_file_not_movie; // minimally useful size 20 bytes: atom header(8) + major brand(4) + version(4) + 1 compatible brand(4)
-                    
-                    if (result == qtf_result_ok)
-                    {
-                        // We can only work with the atom if we can load it all in memory, fail otherwise
-                        if (size <= SIZE_MAX)
-                        {
-                            atom_ftyp_size = size;
-                            atom_ftyp = malloc((size_t)atom_ftyp_size);
-                        }
-                        if (atom_ftyp == NULL)
-                        {
-                            result = qtf_result_memory_error;
-                        }
-                    }
-                    if (result == qtf_result_ok)
-                    {
-                        // copy what we already read
-                        memcpy(atom_ftyp, atom_header, bytes_read);
-                        // read the rest
-                        result = qtf_read(fd_source, atom_ftyp + bytes_read, (size_t)atom_ftyp_size - bytes_read);
-                        if (result == qtf_result_ok)
-                        {
-                            bytes_read += atom_ftyp_size - bytes_read;
-                        }
-                    }
-                    if (result == qtf_result_ok)
-                    {
-                        // Check for compatibility
-                        unsigned long brand_count = ((size_t)atom_ftyp_size - 16) / 4;
-                        bool has_qt_or_mp4 = false;
-                        for (unsigned long i = 0; i < brand_count; i++) {
-                            uint32_t brand = qtf_swap_big_to_host_int_32(*(uint32_t *)(atom_ftyp + 16 + (i * 4)));
-                            if (brand == QTF_FCC_qt__ || brand == QTF_FCC_mp41 || brand == QTF_FCC_mp42)
-                            {
-                                has_qt_or_mp4 = true;
-                                break;
-                            }
-                        }
-                        if (!has_qt_or_mp4) result = qtf_result_file_not_movie;
-                        // The ftyp atom must precede the moov atom and movie data
-                        if (atom_mdat_present == true || atom_moov_size != 0) result = qtf_result_file_not_movie;
-                    }
-                }
-                break;
-            case QTF_FCC_moov:
-                // remove the atom from the file in its current location, we will add it again later
-                qtf_edit_list_add_edit(edit_list, offset, -(ssize_t)size);
-                // there should only be one of these, we discard any others
-                if (atom_moov_size == 0)
-                {
-                    size_t contents_bytes_read = 0;
-                    qtf_atom_size contents_size = 0;
-                    uint32_t contents_type = 0;
-
-                    uint32_t decompressed_size = 0;
-                    off_t compressed_data_start = 0;
-
-                    // We can only work with the atom if we can load it all in memory, fail otherwise
-                    if (size <= SIZE_MAX)
-                    {
-                        atom_moov_size = size;
-                        atom_moov = malloc((size_t)atom_moov_size);
-                    }
-                    if (atom_moov == NULL)
-                    {
-                        result = qtf_result_memory_error;
-                    }
-                    if (result == qtf_result_ok)
-                    {
-                        // copy what we already read
-                        memcpy(atom_moov, atom_header, bytes_read);
-                        
-                        // read the first atom header inside the moov atom straight into the moov atom in memory
-                        result = qtf_read_atom_header(fd_source, atom_moov + bytes_read, (size_t)atom_moov_size - bytes_read, &contents_type, &contents_size, &contents_bytes_read);
-                        bytes_read += contents_bytes_read;
-                    }
-                    if (result == qtf_result_ok)
-                    {
-                        // check if the atom is compressed
-                        // QTFF Chapter 2, Compressed Movie Resources
-                        if (contents_type == QTF_FCC_cmov)
-                        {                            
-                            // read the next atom header inside the cmov atom
-                            result = qtf_read_atom_header(fd_source, atom_moov + bytes_read, (size_t)atom_moov_size - bytes_read, &contents_type, &contents_size, &contents_bytes_read);
-                            bytes_read += contents_bytes_read;
-                            // check it's a valid dcom atom
-                            if (result == qtf_result_ok && (contents_type != QTF_FCC_dcom || (contents_size - contents_bytes_read) != 4)) result = qtf_result_file_not_movie;
-                            if (result == qtf_result_ok)
-                            {
-                                // read the 4 byte compression type from the dcom atom
-                                result = qtf_read(fd_source, atom_moov + bytes_read, 4);
-                                if (result == qtf_result_ok)
-                                {
-                                    // check for zlib compression
-                                    uint32_t compression = qtf_swap_big_to_host_int_32(*(uint32_t *)(atom_moov + bytes_read));
-                                    if (compression != QTF_FCC_zlib)
-                                    {
-                                        result = qtf_result_file_too_complex;
-                                    }
-                                    bytes_read += 4;
-                                }
-                            }
-                            if (result == qtf_result_ok)
-                            {
-                                // read the cmvd atom header
-                                result = qtf_read_atom_header(fd_source, atom_moov + bytes_read, (size_t)atom_moov_size - bytes_read, &contents_type, &contents_size, &contents_bytes_read);
-                                bytes_read += contents_bytes_read;
-                                // check it's a valid cmvd atom
-                                if (result == qtf_result_ok && (contents_type != QTF_FCC_cmvd || (contents_size - contents_bytes_read) < 4)) result = qtf_result_file_not_movie;
-                                if (result == qtf_result_ok)
-                                {
-                                    // read the 4 byte decompressed size
-                                    result = qtf_read(fd_source, atom_moov + bytes_read, 4);
-                                    if (result == qtf_result_ok)
-                                    {
-                                        decompressed_size = qtf_swap_big_to_host_int_32(*(uint32_t *)(atom_moov + bytes_read));
-                                        if (decompressed_size == 0) result = qtf_result_file_not_movie;
-                                        bytes_read += 4;
-                                        compressed_data_start = bytes_read;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    
-                    if (result == qtf_result_ok)
-                    {
-                        // read the rest of the atom
-                        result = qtf_read(fd_source, atom_moov + bytes_read, (size_t)atom_moov_size - bytes_read);
-                        if (result == qtf_result_ok)
-                        {
-                            bytes_read += atom_moov_size - bytes_read;
-                        }
-                    }
-                    if (result == qtf_result_ok && decompressed_size != 0) // ie the moov atom is compressed
-                    {
-                        void *atom_moov_decompressed = malloc(decompressed_size);
-                        if (atom_moov_decompressed == NULL) result = qtf_result_memory_error;
-                        if (result == qtf_result_ok)
-                        {
-                            size_t actuallly_decompressed = qtf_decompress_data(atom_moov + compressed_data_start, (size_t)(atom_moov_size - compressed_data_start),
-                                                                                atom_moov_decompressed, decompressed_size);
-                            
-                            if (actuallly_decompressed != decompressed_size) result = qtf_result_file_not_movie;
-                            else
-                            {
-                                free(atom_moov);
-                                atom_moov = atom_moov_decompressed;
-                                atom_moov_decompressed = NULL;
-                                atom_moov_size = decompressed_size;
-                            }
-                        }
-                        free(atom_moov_decompressed); // if all went well this will be NULL by now
-                    }
-                }
-                break;
-            case QTF_FCC_free:
-            case QTF_FCC_skip:
-            case QTF_FCC_wide:
-                qtf_edit_list_add_edit(edit_list, offset, -size);
-                break;
-            case QTF_FCC_mdat:
-                atom_mdat_present = true;
-                break;
-            default:
-                break;
-        }
-
-        if (result == qtf_result_ok)
-        {
-            offset = lseek(fd_source, size - bytes_read, SEEK_CUR);
-            if (offset == -1)
-            {
-                result = qtf_result_file_read_error;
-            }
-        }
-    }
-    // check we can do something with this file
-    if (result == qtf_result_ok && (atom_mdat_present == false || atom_moov_size == 0))
-    {
-        result = qtf_result_file_too_complex;
-    }
-    
-    if (allow_compressed_moov_atom)
-    {
-        void *atom_moov_compressed = NULL;
-        qtf_atom_size atom_moov_compressed_size = 0;
-        qtf_atom_size atom_moov_compressed_expected_size = 0;
-        qtf_atom_size atom_moov_compressed_actual_size = 0;
-        
-        if (atom_moov_size < 20) result = qtf_result_file_not_movie;
+        result = qtf_read_atom_header(fd, atom_header, sizeof(atom_header), &type, &size, &bytes_read);
         
-        if (result == qtf_result_ok)
+        if (result != qtf_result_ok || bytes_read == 0) break;
+        if (size < bytes_read)
         {
-            if (result == qtf_result_ok)
-            {
-                atom_moov_compressed_size = atom_moov_size;
-                atom_moov_compressed = malloc((size_t)atom_moov_compressed_size);
-                if (atom_moov_compressed == NULL)
-                {
-                    result = qtf_result_memory_error;
-                }
-            }
-            if (result == qtf_result_ok)
-            {
-                // We have to estimate a compressed size, modify the sample data offsets for that estimated size, then compress
-                // the modified atom and see if we met our target. If not, repeat the process, allowing a little more space until
-                // we succeed or arrive at the original atom size
-                size_t increments = (((size_t)atom_moov_size / 16) + (16 - 1)) & ~(16 - 1);
-                atom_moov_compressed_expected_size = increments * 3;
-                off_t total_offset_change = atom_moov_compressed_expected_size;
-                bool can_store_atoms = false;
-                
-                // add an edit for our estimated size
-                qtf_edit_list_add_edit(edit_list, atom_ftyp_size, atom_moov_compressed_expected_size);
-                // apply all the edits to date
-                result = qtf_offsets_apply_list(atom_moov, atom_moov_size, edit_list);
-                                
-                do {
-                    // This is skipped the first pass, then expands the space we reserve on subsequent passes
-                    if (result == qtf_result_ok && atom_moov_compressed_actual_size > (atom_moov_compressed_expected_size - 8))
-                    {
-                        atom_moov_compressed_expected_size += increments;
-                        total_offset_change += increments;
-                        
-                        result = qtf_offsets_modify(atom_moov, atom_moov_size, increments);
-                    }
-                    
-                    if (result == qtf_result_ok)
-                    {
-                        atom_moov_compressed_actual_size = qtf_compress_movie_atom(atom_moov, (size_t)atom_moov_size,
-                                                                                   atom_moov_compressed, (size_t)atom_moov_compressed_size,
-                                                                                   false, true, false);
-                    }
-                    if (result == qtf_result_ok
-                        &&
-                        (atom_moov_compressed_actual_size == atom_moov_compressed_expected_size
-                         || atom_moov_compressed_actual_size < (atom_moov_compressed_expected_size - 8))
-                        )
-                    {
-                        // atom_moov_compressed_actual_size will be zero if we couldn't compress it in the buffer space
-                        // or if an error occurred in compression, so we use the uncompressed atom in those cases
-                        if (atom_moov_compressed_actual_size != 0)
-                        {
-                            // we substitute the existing atom_moov with the an "atom" which is usually two atoms:
-                            // the compressed moov atom plus a free atom for the extra space we estimated when
-                            // calculating the offset
-                            free(atom_moov);
-                            atom_moov = atom_moov_compressed;
-                            atom_moov_size = atom_moov_compressed_expected_size; // The total size we'll write to the file
-                            atom_moov_compressed = NULL;
-                            size_t free_size = (size_t)(atom_moov_compressed_expected_size - atom_moov_compressed_actual_size);
-                            if (free_size > 0 && free_size < 8)
-                            {
-                                result = qtf_result_memory_error; // this shouldn't happen but it's fatal so check
-                            }
-                            else
-                            {
-                                uint32_t *size = atom_moov + atom_moov_compressed_actual_size;
-                                uint32_t *type = atom_moov + atom_moov_compressed_actual_size + 4;
-                                *size = qtf_swap_host_to_big_int_32(free_size);
-                                *type = qtf_swap_host_to_big_int_32(QTF_FCC_free);
-                            }
-                            
-                        }
-                        else
-                        {
-                            // we failed to compress the atom, set the offsets for the uncompressed atom size
-                            result = qtf_offsets_modify(atom_moov, atom_moov_size, (ssize_t)atom_moov_size - (ssize_t)total_offset_change);
-                        }
-                        can_store_atoms = true;
-                    }
-                } while (result == qtf_result_ok && can_store_atoms == false);
-            }
+            result = qtf_result_file_not_movie;
+            break;
         }
-        // we've swapped it into atom_moov by now if things went well, and atom_moov_compressed will be NULL
-        free(atom_moov_compressed);
-    }
-    else
-    {
-        if (result == qtf_result_ok)
+        
+        if (analysis.atom_count == atom_capacity)
         {
-            // add the movie back in its new position
-            qtf_edit_list_add_edit(edit_list, atom_ftyp_size, atom_moov_size);
-            // update the moov atom with the new offsets
-            result = qtf_offsets_apply_list(atom_moov, atom_moov_size, edit_list);
+            atom_capacity = atom_capacity ? atom_capacity * 2 : 16;
+            qtf_atom_info *atoms = realloc(analysis.atoms, sizeof(qtf_atom_info) * atom_capacity);
+            if (atoms == NULL)
+            {
+                result = qtf_result_memory_error;
+                break;
+            }
+            analysis.atoms = atoms;
+        }
+        uint32_t index = analysis.atom_count++;
+        analysis.atoms[index].type = type;
+        analysis.atoms[index].offset = offset;
+        analysis.atoms[index].size = size;
+        
+        switch (type) {
+            case QTF_FCC_free:
+                if (free_index == -1)
+                {
+                    free_index = index;
+                    analysis.free_space = size;
+                }
+                analysis.removable_size += size;
+                break;
+            case QTF_FCC_wide:
+                // an in-place flatten swallows a wide atom immediately following its free atom
+                if (free_index != -1 && free_index + 1 == index) analysis.free_space += size;
+                analysis.removable_size += size;
+                break;
+            case QTF_FCC_skip:
+            case QTF_FCC_moov:
+                if (type == QTF_FCC_moov && moov_index == -1) moov_index = index;
+                analysis.removable_size += size;
+                break;
+            case QTF_FCC_mdat:
+                if (mdat_index == -1) mdat_index = index;
+                break;
+            default:
+                break;
         }
+        offset += size;
+        if (lseek(fd, offset, SEEK_SET) == -1) result = qtf_result_file_read_error;
     }
-    // We're finished with the edit_list now
-    qtf_edit_list_destroy(edit_list);
-    edit_list = NULL;
-    
-    int fd_dest = 0;
     
+    // load the moov atom, collecting the edits a rewrite makes
+    qtf_edit_list_clear(edit_list);
     if (result == qtf_result_ok)
     {
-#if defined(_WIN32)
-        fd_dest = _open(dst_path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
-#else
-        fd_dest = open(dst_path, O_WRONLY | O_CREAT | O_EXCL,
-                       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); // RW owner, R group, R others
-#endif
-
-        if (fd_dest == -1)
-        {
-            result = qtf_result_file_write_error;
-        }
+        result = qtf_scan_movie(context, fd, edit_list, NULL, 0, &atom_ftyp, &atom_ftyp_size, &atom_moov, &atom_moov_size, NULL);
     }
     if (result == qtf_result_ok)
     {
-        // Write the ftyp atom if there was one
-        if (atom_ftyp != NULL)
+        uint8_t header[16];
+        const qtf_atom_info *moov = &analysis.atoms[moov_index];
+        analysis.moov_size = moov->size;
+        analysis.moov_uncompressed_size = atom_moov_size;
+        // check the first child of the stored atom for a cmov atom
+        if (moov->size >= 16 && lseek(fd, (off_t)moov->offset, SEEK_SET) != -1 && qtf_read(fd, header, 16) == qtf_result_ok)
         {
-            result = qtf_write(fd_dest, atom_ftyp, (size_t)atom_ftyp_size);
+            size_t header_length = qtf_get_32(header) == 1 ? 16 : 8;
+            if (header_length == 8) analysis.moov_is_compressed = qtf_get_32(header + 12) == QTF_FCC_cmov;
         }
-        // Write the moov atom
-        if (result == qtf_result_ok)
+        if (atom_moov_size > 40 && atom_moov_size <= SIZE_MAX)
         {
-            result = qtf_write(fd_dest, atom_moov, (size_t)atom_moov_size);
+            void *compressed = qtf_buffer_reserve(&context->spare_buffer, (size_t)atom_moov_size);
+            if (compressed == NULL) result = qtf_result_memory_error;
+            else analysis.moov_compressed_size = qtf_compress_movie_atom(&context->zlib, atom_moov, (size_t)atom_moov_size,
+                                                                         compressed, (size_t)atom_moov_size, false, true, false);
         }
-        if (result == qtf_result_ok)
+    }
+    
+    if (result == qtf_result_ok)
+    {
+        const qtf_atom_info *moov = &analysis.atoms[moov_index];
+        const qtf_atom_info *mdat = &analysis.atoms[mdat_index];
+        bool can_compress = options->allow_compressed_moov_atom && analysis.moov_compressed_size != 0;
+        // a rewrite writes the compressed atom padded out with a free atom to the space reserved for it
+        uint64_t rewrite_moov_size = analysis.moov_uncompressed_size;
+        if (can_compress) rewrite_moov_size = qtf_compressed_movie_atom_reserve(atom_moov_size, analysis.moov_compressed_size);
+        
+        analysis.strategy = qtf_strategy_rewrite;
+        if (moov->offset < mdat->offset)
+        {
+            analysis.strategy = qtf_strategy_already_flat;
+        }
+        else if (free_index != -1 && analysis.atoms[free_index].offset < mdat->offset && analysis.free_space > 8 && moov->size > 8)
         {
-            // skip over the ftyp atom if present
-            off_t source_offset = lseek(fd_source, atom_ftyp_size, SEEK_SET);
-            if (source_offset == -1)
+            uint64_t free_space = analysis.free_space;
+            uint64_t moov_size = moov->size;
+            
+            if (qtf_atom_fits(moov_size, free_space))
             {
-                result = qtf_result_file_read_error;
+                analysis.strategy = qtf_strategy_in_place;
             }
-            // Copy everything except the moov atom(s) and any free skip or wide atoms
-            char buffer[QTF_COPY_BUFFER_SIZE];
-            
-            while (result == qtf_result_ok) {
-                
-                uint32_t type;
-                qtf_atom_size size;
-                size_t bytes_read;
-                result = qtf_read_atom_header(fd_source, buffer, QTF_COPY_BUFFER_SIZE, &type, &size, &bytes_read);
-                                
-                if (result != 0 || bytes_read == 0) break;
-                
-                bool skip;
-                
-                switch (type) {
-                    case QTF_FCC_moov:
-                    case QTF_FCC_free:
-                    case QTF_FCC_skip:
-                    case QTF_FCC_wide:
-                        skip = true;
-                        break;
-                    default:
-                        skip = false;
-                        break;
-                }
-                if (skip)
+            else if (options->allow_compressed_moov_atom && !analysis.moov_is_compressed)
+            {
+                // compress it as an in-place flatten would
+                void *compressed = NULL;
+                size_t compressed_size = 0;
+                result = qtf_compress_movie_atom_to_fit(context, atom_moov, (size_t)atom_moov_size, free_space,
+                                                        options->compression_effort_ms, &compressed, &compressed_size);
+                if (compressed_size != 0)
                 {
-                    // Skip these atoms
-                    offset = lseek(fd_source, size - bytes_read, SEEK_CUR);
-                    if (offset == -1)
-                    {
-                        result = qtf_result_file_read_error;
-                    }
-                    else
-                    {
-                        bytes_read += (size - bytes_read);
-                    }
+                    analysis.strategy = qtf_strategy_in_place_compressed;
+                    moov_size = compressed_size;
                 }
-                else
-                {
-                    // Write all other atoms to the new file
-                    result = qtf_write(fd_dest, buffer, bytes_read);
-                    if (result == qtf_result_ok)
-                    {
-                        size -= bytes_read;
-                        
-                        while (result == qtf_result_ok && size > 0)
-                        {
-                            size_t to_copy = (size_t)MIN(size, QTF_COPY_BUFFER_SIZE);
-                            result = qtf_read(fd_source, buffer, to_copy);
-                            bytes_read += to_copy;
-                            
-                            if (result == qtf_result_ok)
-                            {
-                                result = qtf_write(fd_dest, buffer, to_copy);
-                                if (result == qtf_result_ok)
-                                {
-                                    size -= to_copy;
-                                }
-                            }
-                        }
-                    }
-                } // skip
-                source_offset += bytes_read;
-            } // while
+            }
+            if (analysis.strategy != qtf_strategy_rewrite)
+            {
+                // the moov atom and the header of any free atom after it
+                analysis.bytes_to_write = moov_size + (moov_size < free_space ? 8 : 0);
+            }
+        }
+        
+        if (analysis.strategy == qtf_strategy_rewrite)
+        {
+            analysis.bytes_to_write = analysis.file_size - analysis.removable_size + rewrite_moov_size;
+        }
+        
+        // check the offsets a rewrite would write still fit
+        result = qtf_edit_list_add_edit(edit_list, atom_ftyp_size, rewrite_moov_size);
+        if (result == qtf_result_ok) result = qtf_box_tree_parse(&context->moov_tree, atom_moov, atom_moov_size);
+        if (result == qtf_result_ok) result = qtf_offsets_check_list(&context->moov_tree, edit_list, &analysis.stco_overflow);
+        if (result == qtf_result_ok && analysis.stco_overflow && analysis.strategy == qtf_strategy_rewrite)
+        {
+            analysis.strategy = qtf_strategy_unsupported;
         }
     }
-    free(atom_moov);
-    free(atom_ftyp);
-    if (fd_source) close(fd_source);
-    if (fd_dest) close(fd_dest);
+    
+    if (fd != -1) close(fd);
+    qtf_context_destroy(context);
+    if (result == qtf_result_ok)
+    {
+        *out_analysis = analysis;
+    }
+    else
+    {
+        qtf_analysis_destroy(&analysis);
+    }
     return result;
 }
 
-qtf_result qtf_flatten_movie_in_place(const char *src_path, bool allow_compressed_moov_atom)
+qtf_result qtf_record_begin(qtf_context *context, int fd, const qtf_options *options)
 {
-    qtf_result result = qtf_result_ok;
-#if defined(_WIN32)
-    int fd = _open(src_path, _O_RDWR | _O_BINARY);
-#else
-    int fd = open(src_path, O_RDWR);
-#endif
+    qtf_recorder_s *recorder = context->recorder;
+    if (recorder == NULL) recorder = context->recorder = malloc(sizeof(qtf_recorder_s));
+    if (recorder == NULL) return qtf_result_memory_error;
+    
+    memset(recorder, 0, sizeof(qtf_recorder_s));
+    recorder->fd = fd;
+    recorder->options = *options;
+    recorder->result = qtf_result_file_not_movie; // until there is a checkpoint
+    
+    qtf_result result = qtf_record_scan(recorder);
+    recorder->active = result == qtf_result_ok;
+    return result;
+}
 
-    if (fd == -1)
+qtf_result qtf_record_checkpoint(qtf_context *context, const void *moov_atom, size_t moov_atom_length, uint64_t mdat_end)
+{
+    qtf_recorder_s *recorder = context->recorder;
+    if (recorder == NULL || !recorder->active) return qtf_result_file_write_error;
+    
+    qtf_result result = qtf_result_ok;
+    uint64_t stored_size = moov_atom_length >= 8 ? qtf_get_32(moov_atom) : 0;
+    if (stored_size == 1 && moov_atom_length >= 16) stored_size = qtf_get_64(moov_atom + 8);
+    
+    if (moov_atom_length < 8 || stored_size != moov_atom_length || qtf_get_32(moov_atom + 4) != QTF_FCC_moov
+        || mdat_end < recorder->mdat_offset + recorder->mdat_header_length)
     {
-        return qtf_result_file_read_error;
+        result = qtf_result_file_not_movie;
     }
     
-    off_t file_length = 0;
-    result = qtf_get_file_size(fd, &file_length);
-    
-    if (result == qtf_result_ok)
+    const void *moov = moov_atom;
+    uint64_t moov_size = moov_atom_length;
+    uint64_t reserve_size = recorder->reserve_size;
+    bool compressed = false;
+    // the moov atom must replace the reserve entirely or leave room for a free atom (minimum 8 bytes)
+    if (result == qtf_result_ok && !qtf_atom_fits(moov_size, reserve_size))
     {
-        off_t free_start = 0;
-        off_t moov_start = 0;
-        off_t mdat_start = 0;
-        qtf_atom_size free_size = 0;
-        qtf_atom_size moov_size = 0;
-        qtf_atom_size mdat_size = 0;
-        off_t offset = 0;
-        while (result == qtf_result_ok && (moov_size == 0 || free_size == 0 || mdat_size == 0))
-        {
-            uint32_t atom_header[4];
-            uint64_t size = 0;
-            uint32_t type = 0;
-            size_t bytes_read;
-            off_t got = 0;
-            
-            result = qtf_read_atom_header(fd, atom_header, sizeof(atom_header), &type, &size, &bytes_read);
-            
-            if (result != qtf_result_ok || bytes_read == 0) break;
-            
-            if (type == QTF_FCC_free && free_size == 0) // use only the first free atom
-            {
-                free_start = offset;
-                free_size = size;
-            }
-            else if (type == QTF_FCC_wide && offset == (free_start + free_size))
-            {
-                // we can swallow up a wide atom if it immediately follows the free atom
-                free_size += size;
-            }
-            else if (type == QTF_FCC_moov)
-            {
-                moov_start = offset;
-                moov_size = size;
-            }
-            else if (type == QTF_FCC_mdat)
-            {
-                mdat_start = offset;
-                mdat_size = size;
-            }
-            offset += size;
-            got = lseek(fd, size - bytes_read, SEEK_CUR);
-            if (got == -1) result = qtf_result_file_read_error;
-        }
-        
-        // Check there is an mdat atom. This doesn't guarantee this isn't a reference movie
-        if (result == qtf_result_ok && mdat_size == 0)
+        void *buffer = NULL;
+        size_t compressed_size = 0;
+        if (recorder->options.allow_compressed_moov_atom)
         {
-            result = qtf_result_file_too_complex;
+            result = qtf_compress_movie_atom_to_fit(context, (void *)moov_atom, moov_atom_length, reserve_size,
+                                                    recorder->options.compression_effort_ms, &buffer, &compressed_size);
         }
-
-        // Check we can copy the moov atom into memory
-        if (moov_size > SIZE_MAX)
+        if (result == qtf_result_ok && compressed_size == 0) result = qtf_result_file_no_free_space;
+        if (result == qtf_result_ok)
         {
-            result = qtf_result_memory_error;
+            moov = buffer;
+            moov_size = compressed_size;
+            compressed = true;
         }
-
-        // Check there is a free atom before the mdat atom and the movie isn't already flattened
-        if (result == qtf_result_ok
-            && (free_start < mdat_start)
-            && (moov_start > mdat_start)
-            && (free_size > 8)
-            && (moov_size > 8))
+    }
+    
+    // the movie data must cover every chunk of the new moov atom before it is written
+    if (result == qtf_result_ok)
+    {
+        result = qtf_record_write_mdat_size(recorder, mdat_end - recorder->mdat_offset);
+    }
+    if (result == qtf_result_ok)
+    {
+        // the moov atom and the header of the free atom after it are written together
+        uint64_t free_size = reserve_size - moov_size;
+        size_t free_header_length = free_size == 0 ? 0 : (free_size > UINT32_MAX ? 16 : 8);
+        uint8_t *region = qtf_buffer_reserve(&context->atom_buffer, (size_t)moov_size + free_header_length);
+        if (region == NULL) result = qtf_result_memory_error;
+        if (result == qtf_result_ok)
         {
-            bool moov_was_at_end = ((moov_start + moov_size) == file_length) ? true : false;
-            void *moov = malloc((size_t)moov_size);
-            if (!moov)
+            memcpy(region, moov, (size_t)moov_size);
+            uint8_t *free_header = region + moov_size;
+            if (free_header_length == 16)
             {
-                result = qtf_result_memory_error;
+                qtf_put_32(free_header, 1);
+                qtf_put_32(free_header + 4, QTF_FCC_free);
+                qtf_put_64(free_header + 8, free_size);
             }
-            if (result == qtf_result_ok)
+            else if (free_header_length == 8)
             {
-                off_t got = 0;
-                got = lseek(fd, moov_start, SEEK_SET);
-                if (got == -1) result = qtf_result_file_read_error;
-                if (result == qtf_result_ok)
-                {
-                    result = qtf_read(fd, moov, (size_t)moov_size);
-                }
-                if (result == qtf_result_ok && allow_compressed_moov_atom && free_size < (moov_size + 8) && (free_size != moov_size) && (free_size > 40))
-                {
-                    void *compressed = malloc((size_t)free_size);
-                    if (compressed)
-                    {
-                        size_t compressed_size = qtf_compress_movie_atom(moov,
-                                                                         (size_t)moov_size,
-                                                                         compressed,
-                                                                         (size_t)free_size,
-                                                                         true, true, true); // use the fastest method that will fit
-                        if (compressed_size != 0)
-                        {
-                            // swap our compressed movie atom for the original
-                            free(moov);
-                            moov = compressed;
-                            moov_size = compressed_size;
-                        }
-                        else
-                        {
-                            free(compressed);
-                        }
-                    }
-                }
-                // If the moov atom can either replace the free atom entirely
-                // or there is space to insert the moov atom and a new free atom (minimum 8 bytes)
-                if ((free_size >= (moov_size + 8)) || (free_size == moov_size))
-                {
-                    if (result == qtf_result_ok)
-                    {
-                        got = lseek(fd, free_start, SEEK_SET);
-                        if (got == -1) result = qtf_result_file_read_error;
-                    }
-                    if (result == qtf_result_ok)
-                    {
-                        result = qtf_write(fd, moov, (size_t)moov_size);
-                    }
-                    // add a new smaller free after the moov if necessary
-                    if (result == qtf_result_ok && moov_size < free_size)
-                    {
-                        uint32_t new_free_size = qtf_swap_host_to_big_int_32(free_size - moov_size);
-                        uint32_t new_free_type = qtf_swap_host_to_big_int_32(QTF_FCC_free);
-                        result = qtf_write(fd, &new_free_size, 4);
-                        if (result == qtf_result_ok)
-                        {
-                            result = qtf_write(fd, &new_free_type, 4);
-                        }
-                    }
-                    if (result == qtf_result_ok)
-                    {
-                        // If the old moov atom was at the end of the file, truncate the file
-                        // otherwise turn the atom into a free atom
-                        if (moov_was_at_end)
-                        {
-                            ftruncate(fd, moov_start);
-                        }
-                        else
-                        {                            
-                            got = lseek(fd, moov_start + 4, SEEK_SET);
-                            if (got == -1) result = qtf_result_file_read_error;
-                            if (result == qtf_result_ok)
-                            {
-                                uint32_t new_free_type = qtf_swap_host_to_big_int_32(QTF_FCC_free);
-                                result = qtf_write(fd, &new_free_type, 4);
-                            }
-                        }
-                    }
-                }
-                else if (result == qtf_result_ok)
-                {
-                    result = qtf_result_file_no_free_space;
-                }
-                free(moov);
-            } // end if (moov)
-        }
-        else if (result == qtf_result_ok && moov_start > mdat_start)
-        {
-            // The movie wasn't already flattened and there wasn't a suitable free atom
-            result = qtf_result_file_no_free_space;
+                qtf_put_32(free_header, (uint32_t)free_size);
+                qtf_put_32(free_header + 4, QTF_FCC_free);
+            }
+            if (lseek(recorder->fd, (off_t)recorder->reserve_offset, SEEK_SET) == -1) result = qtf_result_file_write_error;
         }
+        if (result == qtf_result_ok) result = qtf_write(recorder->fd, region, (size_t)moov_size + free_header_length);
     }
-    close(fd);
+    if (result == qtf_result_ok)
+    {
+        recorder->moov_size = moov_size;
+        recorder->moov_compressed = compressed;
+        recorder->checkpoints++;
+    }
+    recorder->result = result;
     return result;
 }
+
+void qtf_record_get_status(const qtf_context *context, qtf_record_status *out_status)
+{
+    const qtf_recorder_s *recorder = context->recorder;
+    memset(out_status, 0, sizeof(qtf_record_status));
+    if (recorder != NULL && recorder->active)
+    {
+        out_status->reserve_size = recorder->reserve_size;
+        out_status->moov_size = recorder->moov_size;
+        out_status->moov_compressed = recorder->moov_compressed;
+        out_status->checkpoints = recorder->checkpoints;
+    }
+}
+
+qtf_result qtf_record_end(qtf_context *context)
+{
+    qtf_recorder_s *recorder = context->recorder;
+    if (recorder == NULL || !recorder->active) return qtf_result_file_write_error;
+    
+    recorder->active = false;
+    return recorder->result;
+}
@@ -33,11 +33,17 @@
 #define qt_flatten_h
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ The outcome of a call. qtf_result_ok and qtf_result_already_flat are success codes, and every other value is an error.
+ Functions which can return qtf_result_already_flat say so, and callers of them must treat it as success too.
+ */
 typedef enum qtf_result {
     qtf_result_ok = 0,
     qtf_result_file_no_free_space = 1, // there is not enough free space in the file
@@ -45,9 +51,56 @@ typedef enum qtf_result {
     qtf_result_file_not_movie = 3, // file is not a valid movie
     qtf_result_file_read_error = 4, // file system error
     qtf_result_file_write_error = 5, // file system error
-    qtf_result_memory_error = 6 // couldn't allocate sufficient memory
+    qtf_result_memory_error = 6, // couldn't allocate sufficient memory
+    qtf_result_file_mismatch = 7, // the files don't hold the same movie
+    qtf_result_already_flat = 8 // success: the movie was already flat, see qtf_flatten_movie_ex()
 } qtf_result;
 
+/**
+ Top-level atoms which may be moved to follow the moov atom, see qtf_options.
+ */
+typedef enum qtf_relocate {
+    qtf_relocate_udta = 1 << 0, // user data, such as chapter names
+    qtf_relocate_meta = 1 << 1, // metadata
+    qtf_relocate_uuid = 1 << 2 // extensions, such as XMP
+} qtf_relocate;
+
+/**
+ Options for the flatten functions. Initialise with qtf_options_init() before setting any fields, so fields added in
+ future versions get their defaults.
+ */
+typedef struct qtf_options {
+    bool allow_compressed_moov_atom; // default false
+    size_t memory_limit; // the most bytes of a movie's moov atom to hold in memory at once, or 0 (the default) for no limit
+    bool punch_holes; // in-place flattens release the disk space inside free and skip atoms, default false
+    bool checksum; // flattens to a new file compute a CRC-32 of their output, see qtf_flatten_checksum(), default false
+    unsigned int compression_effort_ms; // see qtf_flatten_movie_in_place_ex(), default 0
+    unsigned int relocate_atoms; // qtf_relocate flags, see qtf_flatten_movie_ex(), default 0
+    const char *index_path; // where to write a seek index of the flattened movie, see qtf_flatten_movie_ex(), default NULL
+    bool allow_hard_link; // an already flat movie may be hard linked to the destination, see qtf_flatten_movie_ex(), default false
+} qtf_options;
+
+/**
+ Sets every field of options to its default.
+ */
+void qtf_options_init(qtf_options *options);
+
+/**
+ A context holds the buffers, zlib streams and other state used to flatten a movie, so they can be reused by later calls
+ rather than allocated for every movie. A context may be used by one call at a time, so use one context per thread.
+ */
+typedef struct qtf_context qtf_context;
+
+/**
+ Returns a new context, or NULL if there wasn't enough memory.
+ */
+qtf_context *qtf_context_create(void);
+
+/**
+ Frees a context and everything it holds. context may be NULL.
+ */
+void qtf_context_destroy(qtf_context *context);
+
 /**
  Attempts to flatten a QuickTime movie file in-place by moving the moov atom from the end of the file
  into free space at the start of the file. This requires the original file be created with a suitably-sized
@@ -60,20 +113,373 @@ typedef enum qtf_result {
  If allow_compressed_moov_atom is true the moov atom may be compressed if doing so is necessary to fit it in
  the available free space.
  
- Returns qtf_result_ok on success, qtf_result_file_no_free_space if there isn't a sufficiently large free atom
- preceding the movie data, or an error.
+ Returns qtf_result_ok on success (including when the moov atom already precedes the movie data, so nothing was
+ changed), qtf_result_file_no_free_space if there isn't a sufficiently large free atom preceding the movie data, or an
+ error.
  */
 qtf_result qtf_flatten_movie_in_place(const char *src_path, bool allow_compressed_moov_atom);
 
+/**
+ As qtf_flatten_movie_in_place(), using context (or a temporary context if it is NULL) and taking its settings from options.
+ 
+ If options->memory_limit is not 0 and the moov atom is larger than it, the moov atom is moved in blocks of no more than
+ options->memory_limit bytes and is never compressed.
+ 
+ If options->allow_compressed_moov_atom is true, options->compression_effort_ms is not 0 and the moov atom doesn't fit
+ the free space at any of the usual compression levels, up to options->compression_effort_ms milliseconds of the calling
+ thread's processor time (wall-clock time on Windows) are spent searching for a smaller compression before giving up
+ with qtf_result_file_no_free_space.
+ 
+ If options->punch_holes is true and the file system supports it, the whole blocks inside every free and skip atom
+ (including the old moov atom, if it wasn't at the end of the file) are deallocated once the movie is flat, leaving the
+ file's size unchanged.
+ 
+ Unlike qtf_flatten_movie_in_place(), returns qtf_result_already_flat rather than qtf_result_ok if the moov atom already
+ preceded the movie data, so nothing was changed.
+ */
+qtf_result qtf_flatten_movie_in_place_ex(qtf_context *context, const char *src_path, const qtf_options *options);
+
 /**
  Writes a flattened version of the QuickTime movie file at src_path to dst_path.
  
  If allow_compressed_moov_atom is true the moov atom will be compressed.
  
- Returns qtf_result_ok on success, or an error.
+ Fragmented movies are supported: the offsets in moof, sidx and mfra atoms are updated to account for the moved moov
+ atom and any removed free space.
+ 
+ Where the file system reports them, holes in a sparse source file are skipped and left as holes in dst_path.
+ 
+ Returns qtf_result_ok on success (including when the movie was already flat and dst_path holds an identical copy of it,
+ see qtf_flatten_movie_ex()), or an error.
  */
 qtf_result qtf_flatten_movie(const char *src_path, const char *dst_path, bool allow_compressed_moov_atom);
 
+/**
+ As qtf_flatten_movie(), using context (or a temporary context if it is NULL) and taking its settings from options.
+ 
+ If options->memory_limit is not 0 and the moov atom is larger than it, the moov atom is rewritten to dst_path one atom
+ at a time, with chunk offset tables read, updated and written in blocks of no more than options->memory_limit bytes.
+ Such moov atoms are never compressed. Compressed moov atoms in the source are always loaded whole.
+ 
+ Top-level atoms of the types selected by options->relocate_atoms are moved to follow the moov atom, in their original
+ order, so metadata written after the movie data (such as chapters or XMP) is read without seeking to the end of the
+ file. The offsets of the movie data are updated for the move.
+ 
+ If options->index_path is not NULL, a seek index of the flattened movie is written there once the flatten has succeeded,
+ replacing any existing file. The moov atom must be loaded whole, so a moov atom larger than options->memory_limit fails
+ with qtf_result_file_too_complex. The index lists the sync samples of every track (every sample, for tracks without an
+ stss atom) by decode time with their offsets in the flattened movie, so a seek is a binary search. Samples in movie
+ fragments aren't indexed. Every field is little-endian and aligned to its size:
+ 
+   header, 16 bytes: "QTFI", version (uint32, 1), track count (uint32), entry length (uint32, 16)
+   one track record per track in moov atom order, 32 bytes each: track ID (uint32), media timescale (uint32), media
+     duration (uint64), index of the track's first entry (uint64), entry count (uint64)
+   the entries of each track in ascending time order, entry length bytes each: decode time in the media timescale
+     (uint64), sample offset (uint64)
+ 
+ Readers should reject other versions, and skip any bytes past the first 16 of an entry, which later versions may add.
+ 
+ A movie is already flat if flattening it would write it out unchanged: its moov atom directly follows any ftyp atom and is
+ compressed exactly when options->allow_compressed_moov_atom is set, it has no free, skip or wide atoms and any atoms
+ selected by options->relocate_atoms already follow the moov atom. Such a movie is cloned to dst_path where the file
+ system supports it (reflinks on Linux, clonefile() on macOS), or hard linked to it if options->allow_hard_link is set,
+ so neither takes any copying. Otherwise, or if options->checksum or options->index_path is set, it is copied as it is,
+ with copy_file_range() on Linux. Either way qtf_result_already_flat is returned in place of qtf_result_ok.
+ */
+qtf_result qtf_flatten_movie_ex(qtf_context *context, const char *src_path, const char *dst_path, const qtf_options *options);
+
+/**
+ Writes a flattened version of the QuickTime movie file at src_path to each of the count paths in dst_paths, taking the
+ settings for each from the matching entry of options, as qtf_flatten_movie_ex() would. The source is scanned and its moov
+ atom loaded once, a moov atom is prepared for each distinct setting of allow_compressed_moov_atom, and the movie data is
+ read once and written to every destination.
+ 
+ Only allow_compressed_moov_atom is taken from options: the moov atom is always loaded whole, holes in a sparse source are
+ written out and no checksum is calculated.
+ 
+ Returns qtf_result_ok if every destination was written, or the first error, in which case some destinations may be
+ incomplete.
+ */
+qtf_result qtf_flatten_movie_multi(qtf_context *context, const char *src_path, const char *const *dst_paths,
+                                   const qtf_options *options, size_t count);
+
+/**
+ Writes a flattened version of the movie read from fd_source to fd_dest, from its current position. fd_source needn't be
+ seekable, so it may be a pipe or socket. Until the moov atom arrives the atoms other than the ftyp atom and any free, skip
+ or wide atoms are spooled to an unlinked temporary file in spool_directory (or the system's temporary directory if it is
+ NULL), which is then copied to fd_dest after the ftyp and moov atoms. On Linux data is spliced from a pipe to the spool
+ and copied from the spool with copy_file_range() or sendfile(), so it doesn't pass through user memory. Neither fd is
+ closed.
+ 
+ Only the ftyp and moov atoms are held in memory. If options->memory_limit is not 0, movies whose moov atom is larger than
+ it fail with qtf_result_file_too_complex rather than exceed it. options->allow_compressed_moov_atom and options->index_path
+ are also taken from options. Fragmented movies aren't supported.
+ 
+ Returns qtf_result_ok on success, or an error.
+ */
+qtf_result qtf_flatten_from_pipe(qtf_context *context, int fd_source, int fd_dest, const char *spool_directory,
+                                 const qtf_options *options);
+
+/**
+ The outcome of a call to qtf_flatten_step().
+ */
+typedef enum qtf_step {
+    qtf_step_done = 0, // the flatten finished or failed, call qtf_flatten_end() for its result
+    qtf_step_progress = 1, // the budget was spent, call qtf_flatten_step() again
+    qtf_step_would_block = 2 // the destination can't take more data yet, call qtf_flatten_step() again once it is writable
+} qtf_step;
+
+/**
+ Begins flattening the movie at src_path to dst_path as qtf_flatten_movie_ex() does, but without doing any of the work,
+ so the flatten can be driven from an event loop. Call qtf_flatten_step() until it returns qtf_step_done, then
+ qtf_flatten_end().
+ 
+ The flatten is held by context, which must not be NULL, so use one context for each flatten in progress. options is
+ copied, but any options->index_path must stay valid until qtf_flatten_end(), which writes the index.
+ 
+ Returns qtf_result_ok if the flatten began, otherwise an error, in which case qtf_flatten_end() needn't be called.
+ */
+qtf_result qtf_flatten_begin(qtf_context *context, const char *src_path, const char *dst_path, const qtf_options *options);
+
+/**
+ As qtf_flatten_begin(), reading from fd_source, which must be seekable, and writing to fd_dest from its current position.
+ fd_dest may be non-blocking, such as a pipe or socket. Neither is closed by qtf_flatten_end().
+ */
+qtf_result qtf_flatten_begin_fd(qtf_context *context, int fd_source, int fd_dest, const qtf_options *options);
+
+/**
+ Does the next part of the flatten begun on context, reading and writing roughly budget_bytes in total. Every step does
+ some work however small the budget is. Decompressing and updating a moov atom held in memory is done in a single step.
+ */
+qtf_step qtf_flatten_step(qtf_context *context, size_t budget_bytes);
+
+/**
+ Returns the CRC-32 (as calculated by zlib's crc32()) of every byte written to the destination, in order, by the last
+ flatten on context, or 0 if options->checksum wasn't set for it. The checksum is calculated as the output is written, so
+ the file needn't be read again. It is valid from when qtf_flatten_step() returns qtf_step_done until the next flatten on
+ context begins, and is also set by qtf_flatten_movie_ex() if it is given a context.
+ */
+uint32_t qtf_flatten_checksum(const qtf_context *context);
+
+/**
+ Finishes the flatten begun on context, closing any files it opened and writing any seek index.
+ 
+ Returns qtf_result_ok if the flatten completed, the error which stopped it, or qtf_result_file_write_error if it was
+ ended before qtf_flatten_step() returned qtf_step_done.
+ */
+qtf_result qtf_flatten_end(qtf_context *context);
+
+/**
+ A range of bytes of a flattened movie: length bytes at dest_offset in the destination, which are either copied from
+ source_offset in the source or, if data isn't NULL, are the length bytes at data.
+ */
+typedef struct qtf_extent {
+    uint64_t dest_offset;
+    uint64_t source_offset; // unused if data isn't NULL
+    uint64_t length;
+    const void *data; // held by the plan
+} qtf_extent;
+
+/**
+ The extents which make up a flattened movie, see qtf_plan_flatten().
+ */
+typedef struct qtf_plan {
+    qtf_extent *extents; // in destination order, each following the last with no gaps
+    size_t extent_count;
+    uint64_t dest_length; // the length of the flattened movie
+    void *storage; // holds the data of the extents, used only by the library
+} qtf_plan;
+
+/**
+ Plans the flatten of the QuickTime movie file at src_path that qtf_flatten_movie_ex() would do with options, without
+ writing anything, using context (or a temporary context if it is NULL). The plan lists the ranges of the flattened movie
+ in order: the ftyp atom and the movie data are ranges of the source, with adjacent atoms which are copied as they are
+ merged into a single range, while the prepared moov atom and any moof, sidx or mfra atoms whose offsets were updated are
+ held in memory by the plan. The plan can be inspected, carried out with qtf_plan_execute(), or handed to another I/O
+ engine, for example one writing each extent at its dest_offset with pwrite() or io_uring.
+ 
+ allow_compressed_moov_atom, memory_limit and relocate_atoms are taken from options. The moov atom is always held in
+ memory, so one larger than options->memory_limit (if it isn't 0) fails with qtf_result_file_too_complex. The plan is
+ only valid while the source is unchanged.
+ 
+ Returns qtf_result_ok on success, in which case free the plan with qtf_plan_destroy(), or an error.
+ */
+qtf_result qtf_plan_flatten(qtf_context *context, const char *src_path, const qtf_options *options, qtf_plan *out_plan);
+
+/**
+ Writes the flattened movie described by plan to fd_dest, from its current position, copying ranges of the source from
+ fd_source, which must be the file the plan was made from. On Linux ranges are copied with copy_file_range() (or
+ sendfile(), if fd_dest isn't a file) a megabyte at a time, so they needn't pass through user memory. Holes in a sparse
+ source may be written out. Neither fd is closed.
+ 
+ Returns qtf_result_ok on success, or an error.
+ */
+qtf_result qtf_plan_execute(const qtf_plan *plan, int fd_source, int fd_dest);
+
+/**
+ Frees the memory held by plan.
+ */
+void qtf_plan_destroy(qtf_plan *plan);
+
+/**
+ Writes a flattened version of the QuickTime movie file at src_path to dst_path, rewriting the movie data so the chunks of
+ every track are interleaved by decode time:
+ 
+    [ftyp (optional)][moov][other atoms (optional)][mdat]
+ 
+ Chunks are grouped into windows of interleave_window_ms by decode time. The windows are written in order, and within
+ a window each track's chunks are written together, so players reading the file from start to end seek as little as
+ possible. If interleave_window_ms is 0 chunks are written in strict decode time order. Movie data which isn't part of
+ any chunk is dropped.
+ 
+ If allow_compressed_moov_atom is true the moov atom will be compressed.
+ 
+ Returns qtf_result_ok on success, qtf_result_file_too_complex if a chunk offset would no longer fit in a stco atom,
+ or an error.
+ */
+qtf_result qtf_interleave_movie(const char *src_path, const char *dst_path, bool allow_compressed_moov_atom, uint32_t interleave_window_ms);
+
+/**
+ Writes a fragmented version of the QuickTime movie file at src_path to dst_path:
+ 
+    [ftyp (optional)][moov][sidx]([moof][mdat])...[mfra]
+ 
+ The moov atom carries an mvex atom and empty sample tables, and each moof atom describes the samples in the mdat
+ atom which follows it. A sidx atom indexing every fragment follows the moov atom (unless there are too many fragments
+ for a single sidx atom) and an mfra atom at the end of the file provides random access to each track.
+ 
+ Fragments start on a sync sample of the first track with sync samples and are close to fragment_duration_ms long, or
+ two seconds if fragment_duration_ms is 0. Movies which are already fragmented are not supported.
+ 
+ Returns qtf_result_ok on success, or an error.
+ */
+qtf_result qtf_fragment_movie(const char *src_path, const char *dst_path, uint32_t fragment_duration_ms);
+
+/**
+ Checks that the movie at dst_path holds the same media as the movie at src_path, such as after dst_path was written by
+ qtf_flatten_movie() or qtf_interleave_movie(), without comparing every byte. The sample tables of the two moov atoms are
+ compared, every chunk of both movies is checked to lie within an mdat atom, and the data of sample_fraction (from 0 to 1)
+ of the chunks, spread evenly through the movie, is compared at the chunks' offsets in each file. The comparison is shared
+ between thread_count threads (one if thread_count is 0, and always one on Windows).
+ 
+ Fragmented movies are not supported.
+ 
+ Returns qtf_result_ok if the movies match, qtf_result_file_mismatch if they don't, or an error.
+ */
+qtf_result qtf_verify(const char *src_path, const char *dst_path, double sample_fraction, unsigned int thread_count);
+
+/**
+ A top-level atom of a movie file.
+ */
+typedef struct qtf_atom_info {
+    uint32_t type; // the atom's four character code, such as 0x6d6f6f76 for moov
+    uint64_t offset;
+    uint64_t size;
+} qtf_atom_info;
+
+/**
+ How a movie would be flattened.
+ */
+typedef enum qtf_strategy {
+    qtf_strategy_already_flat = 0, // the moov atom precedes the movie data, so there is nothing to do
+    qtf_strategy_in_place = 1, // the moov atom fits in the free space before the movie data
+    qtf_strategy_in_place_compressed = 2, // the moov atom fits in the free space before the movie data once compressed
+    qtf_strategy_rewrite = 3, // the movie must be written to a new file
+    qtf_strategy_unsupported = 4 // a new file would need a chunk offset which doesn't fit in a stco atom
+} qtf_strategy;
+
+/**
+ A description of a movie file and how it would be flattened, filled by qtf_analyze().
+ */
+typedef struct qtf_analysis {
+    qtf_atom_info *atoms; // the top-level atoms in file order
+    uint32_t atom_count;
+    uint64_t file_size;
+    uint64_t moov_size; // the size of the moov atom as stored
+    uint64_t moov_uncompressed_size;
+    uint64_t moov_compressed_size; // the size of the moov atom compressed with zlib's default level, or 0 if it can't be
+    bool moov_is_compressed; // the stored moov atom holds a cmov atom
+    uint64_t free_space; // the size of the free atom (and any wide atom following it) an in-place flatten would use
+    uint64_t removable_size; // the total size of the free, skip, wide and moov atoms which a new file would drop
+    bool stco_overflow; // a chunk offset in a stco atom wouldn't fit in 32 bits in a new file
+    qtf_strategy strategy;
+    uint64_t bytes_to_write; // an estimate of the bytes which flattening the movie would write
+} qtf_analysis;
+
+/**
+ Describes the movie at src_path and how it would be flattened with options, reading only the headers of its top-level
+ atoms and its moov atom. An in-place flatten is assumed to be attempted first, so strategy is qtf_strategy_rewrite only
+ if the movie can't be flattened in place. options->allow_compressed_moov_atom and options->compression_effort_ms are the
+ only options considered.
+ 
+ On success out_analysis must be released with qtf_analysis_destroy().
+ 
+ Returns qtf_result_ok on success, or an error.
+ */
+qtf_result qtf_analyze(const char *src_path, const qtf_options *options, qtf_analysis *out_analysis);
+
+/**
+ Frees the memory held by an analysis filled by qtf_analyze().
+ */
+void qtf_analysis_destroy(qtf_analysis *analysis);
+
+/**
+ Begins checkpointing a movie as it is recorded to fd, which must be open for reading and writing and is not closed by
+ qtf_record_end(). The recorder writes the movie as
+ 
+    [ftyp (optional)][free][mdat]
+ 
+ where the free atom reserves space for the moov atom and the mdat atom is the last in the file, growing as movie data is
+ appended. The reserve is the last run of free, skip and moov atoms before the mdat atom, so a recording can be resumed
+ after a previous checkpoint. The recording is held by context, which must not be NULL.
+ 
+ Returns qtf_result_ok if the recording began, qtf_result_file_no_free_space if there is no free atom before the mdat
+ atom, or an error.
+ */
+qtf_result qtf_record_begin(qtf_context *context, int fd, const qtf_options *options);
+
+/**
+ Makes the movie recorded so far flat and playable: sets the mdat atom's size so it ends at the file offset mdat_end,
+ then writes moov_atom (a whole moov atom of moov_atom_length bytes) into the reserve, followed by a free atom for the
+ rest of the reserve. The chunk offsets in moov_atom are written unchanged, as nothing moves. The last checkpoint, made
+ once the recording is complete, finishes the movie.
+ 
+ If the moov atom doesn't fit and options->allow_compressed_moov_atom is true, it is compressed as an in-place flatten
+ would, using options->compression_effort_ms. If the mdat atom has an 8 byte header and grows beyond 4GB its size is set
+ to 0, meaning it extends to the end of the file.
+ 
+ The reserve and the mdat header are written but not synchronised, call fsync() on fd if a checkpoint must survive a
+ power failure.
+ 
+ Returns qtf_result_ok on success, qtf_result_file_no_free_space if the moov atom doesn't fit the reserve, in which case
+ the file is unchanged, or an error.
+ */
+qtf_result qtf_record_checkpoint(qtf_context *context, const void *moov_atom, size_t moov_atom_length, uint64_t mdat_end);
+
+/**
+ The state of a recording, see qtf_record_get_status().
+ */
+typedef struct qtf_record_status {
+    uint64_t reserve_size; // the bytes before the mdat atom which checkpoints write to
+    uint64_t moov_size; // the size of the moov atom in the reserve, 0 if there isn't one
+    bool moov_compressed;
+    uint32_t checkpoints; // the successful checkpoints since qtf_record_begin()
+} qtf_record_status;
+
+/**
+ Fills out_status with the state of the recording begun on context, or zeros if there isn't one. The reserve left for the
+ moov atom to grow into is out_status->reserve_size - out_status->moov_size.
+ */
+void qtf_record_get_status(const qtf_context *context, qtf_record_status *out_status);
+
+/**
+ Ends the recording begun on context.
+ 
+ Returns the result of the last checkpoint, qtf_result_file_not_movie if there wasn't one, or qtf_result_file_write_error
+ if no recording had begun.
+ */
+qtf_result qtf_record_end(qtf_context *context);
+
 #ifdef __cplusplus
 }
 #endif